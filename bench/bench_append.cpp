@@ -0,0 +1,97 @@
+// Compares appending through `file_io::write(async_file_handle&, ...)`,
+// which queries the end position before every write, with appending through
+// an `append_handle`, which keeps the tail in memory.
+//
+// Usage: bench_append [<appends> [<record size>]]
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include "util/file_io.h"
+#include "syscall_counter.hpp"
+
+namespace asio = boost::asio;
+namespace sys = boost::system;
+namespace file_io = ouinet::util::file_io;
+
+using Cancel = ouinet::Signal<void()>;
+using Clock = std::chrono::steady_clock;
+
+struct result {
+    double seconds;
+    size_t syscalls;
+};
+
+template<class Open, class Append>
+static result run(const boost::filesystem::path& path, size_t appends, size_t size, Open open, Append append)
+{
+    asio::io_context ctx;
+    Cancel cancel;
+    std::string record(size, 'x');
+    result r{};
+
+    boost::filesystem::remove(path);
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        sys::error_code ec;
+        auto f = open(ctx, path, ec);
+        if (ec) throw sys::system_error(ec);
+
+        // Warm up (ring and thread pool creation) out of the measurement
+        append(f, asio::buffer(record), cancel, yield);
+
+        size_t syscalls = bench::syscall_count;
+        auto start = Clock::now();
+        for (size_t i = 0; i < appends; ++i) {
+            append(f, asio::buffer(record), cancel, yield);
+        }
+        r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        r.syscalls = bench::syscall_count - syscalls;
+    });
+    ctx.run();
+
+    boost::filesystem::remove(path);
+    return r;
+}
+
+static void report(const char* name, const result& r, size_t appends)
+{
+    std::cout << name
+              << ": " << (r.seconds * 1e6 / appends) << " us/append";
+    if (bench::syscall_count_supported()) {
+        std::cout << ", " << (double(r.syscalls) / appends) << " syscalls/append";
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t appends = argc > 1 ? std::stoul(argv[1]) : 10000;
+    size_t size = argc > 2 ? std::stoul(argv[2]) : 100;
+    auto path = boost::filesystem::temp_directory_path()
+              / boost::filesystem::unique_path("bench_append-%%%%%%%%");
+
+    auto end_position = run(path, appends, size,
+        [] (asio::io_context& ctx, const boost::filesystem::path& p, sys::error_code& ec) {
+            return file_io::open_or_create(ctx.get_executor(), p, ec);
+        },
+        [] (async_file_handle& f, asio::const_buffer b, Cancel& c, asio::yield_context y) {
+            file_io::write(f, b, c, y);
+        });
+
+    auto cached_tail = run(path, appends, size,
+        [] (asio::io_context& ctx, const boost::filesystem::path& p, sys::error_code& ec) {
+            return file_io::open_for_append(ctx.get_executor(), p, ec);
+        },
+        [] (file_io::append_handle& f, asio::const_buffer b, Cancel& c, asio::yield_context y) {
+            file_io::write(f, b, c, y);
+        });
+
+    std::cout << appends << " appends of " << size << " bytes" << std::endl;
+    report("end_position + write_at", end_position, appends);
+    report("append_handle", cached_tail, appends);
+}
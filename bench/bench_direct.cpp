@@ -0,0 +1,141 @@
+// Compares writing and then reading back a large file with and without
+// `open_options::direct`, reporting throughput and how much of the file is
+// left in the page cache afterwards (i.e. how much other data it may have
+// evicted).
+//
+// Usage: bench_direct [<file size in MiB> [<block size in KiB>]]
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "util/file_io.h"
+
+namespace asio = boost::asio;
+namespace sys = boost::system;
+namespace file_io = ouinet::util::file_io;
+
+using Cancel = ouinet::Signal<void()>;
+using Clock = std::chrono::steady_clock;
+
+// MiB of the file in the page cache, negative if unknown.
+static double resident_mib(const boost::filesystem::path& p, size_t size)
+{
+#ifndef _WIN32
+    int fd = ::open(p.c_str(), O_RDONLY);
+    if (fd == -1) return -1;
+    void* m = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) return -1;
+
+    size_t page = ::sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((size + page - 1) / page);
+    size_t resident = 0;
+    if (::mincore(m, size, pages.data()) == 0) {
+        for (auto page_state : pages) resident += page_state & 1;
+    }
+    ::munmap(m, size);
+    return double(resident) * page / (1 << 20);
+#else
+    return -1;
+#endif
+}
+
+static void drop_cache(const boost::filesystem::path& p)
+{
+#ifndef _WIN32
+    int fd = ::open(p.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+#endif
+}
+
+static void run(bool direct, const boost::filesystem::path& p, size_t size, size_t block)
+{
+    boost::filesystem::remove(p);
+
+    // Aligned so that direct transfers need no bounce buffer.
+    std::vector<char> storage(block + file_io::direct_alignment);
+    void* data = storage.data();
+    size_t space = storage.size();
+    std::align(file_io::direct_alignment, block, data, space);
+    auto buffer = static_cast<char*>(data);
+    for (size_t i = 0; i < block; ++i) buffer[i] = char(i * 7);
+
+    double write_seconds = 0;
+    double read_seconds = 0;
+    bool is_direct = false;
+
+    asio::io_context ctx;
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        Cancel cancel;
+        sys::error_code ec;
+        auto f = file_io::open_or_create(ctx.get_executor(), p, ec, {direct});
+        if (ec) throw sys::system_error(ec);
+        is_direct = file_io::is_direct(f, ec);
+
+        auto start = Clock::now();
+        for (size_t offset = 0; offset < size; offset += block) {
+            file_io::write_at(f, asio::buffer(buffer, block), offset, cancel, yield);
+        }
+        file_io::fsync(f, cancel, yield);
+        write_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    });
+    ctx.run();
+
+    double after_write = resident_mib(p, size);
+    drop_cache(p);
+
+    ctx.restart();
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        Cancel cancel;
+        sys::error_code ec;
+        auto f = file_io::open_readonly(ctx.get_executor(), p, ec, {direct});
+        if (ec) throw sys::system_error(ec);
+
+        auto start = Clock::now();
+        for (size_t offset = 0; offset < size; offset += block) {
+            file_io::read_at(f, asio::buffer(buffer, block), offset, cancel, yield);
+        }
+        read_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    });
+    ctx.run();
+
+    double after_read = resident_mib(p, size);
+    double mib = double(size) / (1 << 20);
+
+    std::cout << (direct ? (is_direct ? "direct" : "direct (unsupported, buffered)") : "buffered")
+              << ": write " << mib / write_seconds << " MiB/s"
+              << ", cached after write " << after_write << " MiB"
+              << "; cold read " << mib / read_seconds << " MiB/s"
+              << ", cached after read " << after_read << " MiB"
+              << std::endl;
+
+    boost::filesystem::remove(p);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t size = (argc > 1 ? std::stoul(argv[1]) : 256) << 20;
+    size_t block = (argc > 2 ? std::stoul(argv[2]) : 1024) << 10;
+    size = size / block * block;
+
+    auto path = boost::filesystem::temp_directory_path()
+              / boost::filesystem::unique_path("bench_direct-%%%%%%%%");
+
+    run(false, path, size, block);
+    run(true, path, size, block);
+}
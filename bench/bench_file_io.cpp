@@ -0,0 +1,321 @@
+// Microbenchmark of the `file_io` API.
+//
+// Measures throughput and per operation latency percentiles of sequential
+// and random `read_at`/`write_at`, of `read`, `write` (appending),
+// `read_number`/`write_number`, `truncate` and `file_size`, sweeping block
+// sizes (4 KiB to 1 MiB), file sizes and the number of coroutines issuing
+// operations concurrently on the same file.
+//
+// Results are printed as JSON to the standard output (or to the given file)
+// so that they can be compared across releases, and as a table to the
+// standard error.
+//
+// Usage: bench_file_io [--quick] [--json <output file>]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include "util/file_io.h"
+
+namespace asio = boost::asio;
+namespace sys = boost::system;
+namespace file_io = ouinet::util::file_io;
+
+using Cancel = ouinet::Signal<void()>;
+using Clock = std::chrono::steady_clock;
+
+struct params {
+    std::string op;
+    size_t block_size;
+    uint64_t file_size;
+    size_t concurrency;
+};
+
+struct result {
+    params p;
+    size_t ops = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    // Nanoseconds, one entry per operation.
+    std::vector<uint64_t> latencies;
+};
+
+// Runs a single operation, given the worker index and the operation index
+// within that worker, and returns the number of bytes transferred.
+using op_fn = std::function<size_t( async_file_handle&
+                                  , size_t worker
+                                  , size_t i
+                                  , std::vector<char>& buffer
+                                  , Cancel&
+                                  , asio::yield_context)>;
+
+static result run( const params& p
+                 , const boost::filesystem::path& path
+                 , size_t ops_per_worker
+                 , op_fn op)
+{
+    asio::io_context ctx;
+    result r;
+    r.p = p;
+    r.latencies.reserve(ops_per_worker * p.concurrency);
+
+    Clock::time_point start;
+    size_t running = p.concurrency;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        sys::error_code ec;
+        auto f = file_io::open_or_create(ctx.get_executor(), path, ec);
+        if (ec) throw sys::system_error(ec);
+
+        // Warm up (ring and thread pool creation) out of the measurement
+        Cancel cancel;
+        file_io::file_size(f, ec);
+        {
+            std::vector<char> buffer(std::max<size_t>(p.block_size, sizeof(uint64_t)));
+            op(f, 0, 0, buffer, cancel, yield);
+        }
+
+        start = Clock::now();
+
+        for (size_t w = 0; w < p.concurrency; ++w) {
+            asio::spawn(ctx, [&, w](asio::yield_context yield) {
+                Cancel cancel;
+                std::vector<char> buffer(std::max<size_t>(p.block_size, sizeof(uint64_t)), char(w));
+                for (size_t i = 0; i < ops_per_worker; ++i) {
+                    auto t = Clock::now();
+                    r.bytes += op(f, w, i, buffer, cancel, yield);
+                    r.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                Clock::now() - t).count());
+                }
+                --running;
+            });
+        }
+
+        asio::steady_timer timer(ctx);
+        while (running) {
+            timer.expires_after(std::chrono::microseconds(100));
+            timer.async_wait(yield);
+        }
+        r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    });
+    ctx.run();
+
+    r.ops = r.latencies.size();
+    std::sort(r.latencies.begin(), r.latencies.end());
+    return r;
+}
+
+static void prepare_file(const boost::filesystem::path& path, uint64_t size)
+{
+    boost::filesystem::remove(path);
+    std::ofstream out(path.string(), std::ios::binary);
+    std::vector<char> block(1 << 20);
+    for (size_t i = 0; i < block.size(); ++i) block[i] = char(i * 7);
+    for (uint64_t written = 0; written < size; written += block.size()) {
+        out.write(block.data(), std::min<uint64_t>(block.size(), size - written));
+    }
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double q)
+{
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, size_t(q * sorted.size()));
+    return sorted[i];
+}
+
+// Latencies must be sorted.
+static std::string to_json(const result& r)
+{
+    uint64_t total = 0;
+    for (auto l : r.latencies) total += l;
+
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(3)
+       << "{\"op\":\"" << r.p.op << "\""
+       << ",\"block_size\":" << r.p.block_size
+       << ",\"file_size\":" << r.p.file_size
+       << ",\"concurrency\":" << r.p.concurrency
+       << ",\"ops\":" << r.ops
+       << ",\"bytes\":" << r.bytes
+       << ",\"seconds\":" << r.seconds
+       << ",\"ops_per_s\":" << (r.ops / r.seconds)
+       << ",\"mib_per_s\":" << (r.bytes / r.seconds / (1 << 20))
+       << ",\"latency_ns\":{"
+       << "\"mean\":" << (r.ops ? total / r.ops : 0)
+       << ",\"p50\":" << percentile(r.latencies, 0.50)
+       << ",\"p90\":" << percentile(r.latencies, 0.90)
+       << ",\"p99\":" << percentile(r.latencies, 0.99)
+       << ",\"p999\":" << percentile(r.latencies, 0.999)
+       << ",\"max\":" << (r.latencies.empty() ? 0 : r.latencies.back())
+       << "}}";
+    return os.str();
+}
+
+static void print_row(const result& r)
+{
+    std::cerr << std::left << std::setw(14) << r.p.op << std::right
+              << std::setw(9) << r.p.block_size
+              << std::setw(12) << r.p.file_size
+              << std::setw(4) << r.p.concurrency
+              << std::setw(12) << std::fixed << std::setprecision(1)
+              << (r.bytes / r.seconds / (1 << 20)) << " MiB/s"
+              << std::setw(10) << percentile(r.latencies, 0.50) / 1000 << " us p50"
+              << std::setw(10) << percentile(r.latencies, 0.99) / 1000 << " us p99"
+              << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    bool quick = false;
+    std::string json_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "--quick") quick = true;
+        else if (a == "--json" && i + 1 < argc) json_path = argv[++i];
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--json <output file>]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<size_t> block_sizes{4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20};
+    std::vector<uint64_t> file_sizes{16 << 20, 256 << 20};
+    std::vector<size_t> concurrencies{1, 4, 16};
+    // Operations per worker for those without a natural count.
+    size_t small_ops = 2000;
+
+    if (quick) {
+        file_sizes = {4 << 20};
+        concurrencies = {1, 4};
+        small_ops = 200;
+    }
+
+    auto path = boost::filesystem::temp_directory_path()
+              / boost::filesystem::unique_path("bench_file_io-%%%%%%%%");
+
+    std::vector<result> results;
+
+    auto add = [&] (result r) {
+        print_row(r);
+        results.push_back(std::move(r));
+    };
+
+    std::mt19937_64 rng(42);
+
+    for (auto file_size : file_sizes) {
+        prepare_file(path, file_size);
+
+        for (auto block : block_sizes) {
+            uint64_t blocks = file_size / block;
+
+            for (auto n : concurrencies) {
+                // Each pass covers the whole file once, workers taking
+                // interleaved blocks.
+                size_t per_worker = std::max<size_t>(1, blocks / n);
+
+                std::vector<uint64_t> random_blocks(per_worker * n);
+                for (auto& b : random_blocks) b = rng() % blocks;
+
+                auto seq_offset = [=] (size_t w, size_t i) {
+                    return uint64_t((i * n + w) % blocks) * block;
+                };
+                auto rand_offset = [&, n, block] (size_t w, size_t i) {
+                    return random_blocks[i * n + w] * block;
+                };
+
+                add(run({"seq_write", block, file_size, n}, path, per_worker,
+                    [=] (auto& f, size_t w, size_t i, auto& buf, auto& c, auto y) {
+                        file_io::write_at(f, asio::buffer(buf.data(), block), seq_offset(w, i), c, y);
+                        return block;
+                    }));
+                add(run({"seq_read", block, file_size, n}, path, per_worker,
+                    [=] (auto& f, size_t w, size_t i, auto& buf, auto& c, auto y) {
+                        file_io::read_at(f, asio::buffer(buf.data(), block), seq_offset(w, i), c, y);
+                        return block;
+                    }));
+                add(run({"rand_write", block, file_size, n}, path, per_worker,
+                    [&, block] (auto& f, size_t w, size_t i, auto& buf, auto& c, auto y) {
+                        file_io::write_at(f, asio::buffer(buf.data(), block), rand_offset(w, i), c, y);
+                        return block;
+                    }));
+                add(run({"rand_read", block, file_size, n}, path, per_worker,
+                    [&, block] (auto& f, size_t w, size_t i, auto& buf, auto& c, auto y) {
+                        file_io::read_at(f, asio::buffer(buf.data(), block), rand_offset(w, i), c, y);
+                        return block;
+                    }));
+                add(run({"read", block, file_size, n}, path, std::min(per_worker, small_ops),
+                    [=] (auto& f, size_t, size_t, auto& buf, auto& c, auto y) {
+                        file_io::read(f, asio::buffer(buf.data(), block), c, y);
+                        return block;
+                    }));
+            }
+        }
+
+        // Appending grows the file, measure it on a copy of its own.
+        for (auto block : block_sizes) {
+            for (auto n : concurrencies) {
+                auto append_path = path.string() + ".append";
+                boost::filesystem::remove(append_path);
+                size_t per_worker = std::max<size_t>(1, file_size / block / n);
+                add(run({"write", block, file_size, n}, append_path, per_worker,
+                    [=] (auto& f, size_t, size_t, auto& buf, auto& c, auto y) {
+                        file_io::write(f, asio::buffer(buf.data(), block), c, y);
+                        return block;
+                    }));
+                boost::filesystem::remove(append_path);
+            }
+        }
+
+        for (auto n : concurrencies) {
+            add(run({"read_number", sizeof(uint64_t), file_size, n}, path, small_ops,
+                [] (auto& f, size_t, size_t, auto&, auto& c, auto y) {
+                    file_io::read_number<uint64_t>(f, c, y);
+                    return sizeof(uint64_t);
+                }));
+            add(run({"file_size", 0, file_size, n}, path, small_ops,
+                [] (auto& f, size_t, size_t, auto&, auto&, auto) {
+                    sys::error_code ec;
+                    file_io::file_size(f, ec);
+                    return size_t(0);
+                }));
+            add(run({"truncate", 0, file_size, n}, path, small_ops,
+                [=] (auto& f, size_t, size_t i, auto&, auto& c, auto y) {
+                    file_io::truncate(f, size_t(file_size - (i % 2) * 4096), c, y);
+                    return size_t(0);
+                }));
+        }
+
+        // Last as it grows the file.
+        for (auto n : concurrencies) {
+            add(run({"write_number", sizeof(uint64_t), file_size, n}, path, small_ops,
+                [] (auto& f, size_t, size_t i, auto&, auto& c, auto y) {
+                    file_io::write_number<uint64_t>(f, i, c, y);
+                    return sizeof(uint64_t);
+                }));
+        }
+    }
+
+    boost::filesystem::remove(path);
+
+    std::ofstream json_file;
+    if (!json_path.empty()) json_file.open(json_path);
+    std::ostream& out = json_path.empty() ? std::cout : json_file;
+
+    out << "{\"benchmark\":\"bench_file_io\",\"version\":1,\"results\":[";
+    for (size_t i = 0; i < results.size(); ++i) {
+        out << (i ? ",\n" : "\n") << to_json(results[i]);
+    }
+    out << "\n]}" << std::endl;
+}
@@ -0,0 +1,131 @@
+// Compares reading a whole file through `open_readonly` + `read_at` with
+// reading it through a `map_readonly` mapping, with the file in the page
+// cache (hot) and dropped from it before every pass (cold).
+//
+// Usage: bench_map [<file size in MiB> [<passes>]]
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "util/file_io.h"
+
+namespace asio = boost::asio;
+namespace sys = boost::system;
+namespace file_io = ouinet::util::file_io;
+
+using Cancel = ouinet::Signal<void()>;
+using Clock = std::chrono::steady_clock;
+
+static const size_t chunk_size = file_io::buffered_reader::default_chunk_size;
+
+// Evict the file from the page cache (only possible on POSIX).
+static bool drop_cache(const boost::filesystem::path& p)
+{
+#ifndef _WIN32
+    int fd = ::open(p.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    ::fdatasync(fd);
+    bool ok = ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    ::close(fd);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+static uint64_t checksum(const char* data, size_t size)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size; i += 64) sum += static_cast<unsigned char>(data[i]);
+    return sum;
+}
+
+static uint64_t read_pass(const boost::filesystem::path& p, size_t size)
+{
+    asio::io_context ctx;
+    uint64_t sum = 0;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        Cancel cancel;
+        sys::error_code ec;
+        auto f = file_io::open_readonly(ctx.get_executor(), p, ec);
+        if (ec) throw sys::system_error(ec);
+
+        std::vector<char> buffer(chunk_size);
+        for (size_t offset = 0; offset < size; offset += chunk_size) {
+            auto n = std::min(chunk_size, size - offset);
+            file_io::read_at(f, asio::buffer(buffer.data(), n), offset, cancel, yield);
+            sum += checksum(buffer.data(), n);
+        }
+    });
+    ctx.run();
+
+    return sum;
+}
+
+static uint64_t map_pass(const boost::filesystem::path& p, size_t)
+{
+    sys::error_code ec;
+    auto m = file_io::map_readonly(p, ec, {file_io::mapped_file::access_hint::sequential});
+    if (ec) throw sys::system_error(ec);
+    return checksum(m.data(), m.size());
+}
+
+template<class Pass>
+static void run(const char* name, bool cold, const boost::filesystem::path& p, size_t size, size_t passes, Pass pass)
+{
+    double seconds = 0;
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < passes; ++i) {
+        if (cold && !drop_cache(p)) {
+            std::cout << name << " cold: not supported" << std::endl;
+            return;
+        }
+        auto start = Clock::now();
+        sum += pass(p, size);
+        seconds += std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    std::cout << name << (cold ? " cold: " : " hot: ")
+              << (double(size) * passes / (1 << 20) / seconds) << " MiB/s"
+              << " (checksum " << sum << ")" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t size = (argc > 1 ? std::stoul(argv[1]) : 64) << 20;
+    size_t passes = argc > 2 ? std::stoul(argv[2]) : 5;
+    auto path = boost::filesystem::temp_directory_path()
+              / boost::filesystem::unique_path("bench_map-%%%%%%%%");
+
+    {
+        std::ofstream out(path.string(), std::ios::binary);
+        std::string block(chunk_size, '\0');
+        for (size_t i = 0; i < block.size(); ++i) block[i] = char(i * 7);
+        for (size_t written = 0; written < size; written += block.size()) {
+            out.write(block.data(), std::min(block.size(), size - written));
+        }
+    }
+
+    // Warm the page cache up for the hot runs
+    read_pass(path, size);
+
+    run("read_at", false, path, size, passes, read_pass);
+    run("map_readonly", false, path, size, passes, map_pass);
+    run("read_at", true, path, size, passes, read_pass);
+    run("map_readonly", true, path, size, passes, map_pass);
+
+    boost::filesystem::remove(path);
+}
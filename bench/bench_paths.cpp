@@ -0,0 +1,110 @@
+// Compares building archive paths with the regex and std::string based
+// `stellar::fs::hexDir` / `remoteName` (as they were before `fs_paths.h`)
+// with the in place builders of `fs_paths.h`.
+//
+// Usage: bench_paths [<iterations>]
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "util/fs_paths.h"
+
+namespace fs = stellar::fs;
+
+using Clock = std::chrono::steady_clock;
+
+static_assert(fs::hexDirPath("0a1b2c3d") == "0a/1b/2c");
+static_assert(fs::remoteNamePath("ledger", "0a1b2c3d", "xdr.gz") ==
+              "ledger/0a/1b/2c/ledger-0a1b2c3d.xdr.gz");
+
+namespace legacy {
+
+static std::string
+hexDir(std::string const& hexStr)
+{
+    static const std::regex rx(
+        "([[:xdigit:]]{2})([[:xdigit:]]{2})([[:xdigit:]]{2}).*");
+    std::smatch sm;
+    if (!std::regex_match(hexStr, sm, rx)) std::abort();
+    return (std::string(sm[1]) + "/" + std::string(sm[2]) + "/" +
+            std::string(sm[3]));
+}
+
+static std::string
+baseName(std::string const& type, std::string const& hexStr,
+         std::string const& suffix)
+{
+    return type + "-" + hexStr + "." + suffix;
+}
+
+static std::string
+remoteDir(std::string const& type, std::string const& hexStr)
+{
+    return type + "/" + hexDir(hexStr);
+}
+
+static std::string
+remoteName(std::string const& type, std::string const& hexStr,
+           std::string const& suffix)
+{
+    return remoteDir(type, hexStr) + "/" + baseName(type, hexStr, suffix);
+}
+
+} // legacy namespace
+
+// Run `f` on every checkpoint name, returning nanoseconds per call.
+template<class F>
+static double run(const std::vector<std::string>& hexes, size_t iterations, F f)
+{
+    size_t sink = 0;
+    auto start = Clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        sink += f(hexes[i % hexes.size()]);
+    }
+    auto elapsed = Clock::now() - start;
+    // Keep the results alive.
+    if (sink == 0) std::cout << "";
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+    std::vector<std::string> hexes;
+    for (uint32_t checkpoint = 63; hexes.size() < 4096; checkpoint += 64) {
+        char buf[9];
+        std::snprintf(buf, sizeof(buf), "%08x", checkpoint);
+        hexes.emplace_back(buf);
+    }
+
+    for (auto& h : hexes) {
+        if (legacy::remoteName("ledger", h, "xdr.gz")
+                != fs::remoteNamePath("ledger", h, "xdr.gz").view()) {
+            std::cerr << "Mismatch for " << h << std::endl;
+            return 1;
+        }
+    }
+
+    double old_dir = run(hexes, iterations, [] (const std::string& h) {
+            return legacy::hexDir(h).size();
+        });
+    double new_dir = run(hexes, iterations, [] (const std::string& h) {
+            return fs::hexDirPath(h).size();
+        });
+    double old_name = run(hexes, iterations, [] (const std::string& h) {
+            return legacy::remoteName("ledger", h, "xdr.gz").size();
+        });
+    double new_name = run(hexes, iterations, [] (const std::string& h) {
+            return fs::remoteNamePath("ledger", h, "xdr.gz").size();
+        });
+
+    std::cout << "hexDir: regex " << old_dir << " ns, fixed " << new_dir << " ns ("
+              << old_dir / new_dir << "x)" << std::endl
+              << "remoteName: regex " << old_name << " ns, fixed " << new_name << " ns ("
+              << old_name / new_name << "x)" << std::endl;
+}
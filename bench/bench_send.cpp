@@ -0,0 +1,106 @@
+// Compares serving a file (in the page cache) to a loopback TCP client with
+// `send_range` against reading it with `read_at` into a buffer and writing
+// that to the socket, reporting throughput and CPU time of the process.
+//
+// Usage: bench_send [<file size in MiB> [<passes>]]
+
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include "util/file_io.h"
+
+namespace asio = boost::asio;
+namespace sys = boost::system;
+namespace file_io = ouinet::util::file_io;
+
+using tcp = asio::ip::tcp;
+using Cancel = ouinet::Signal<void()>;
+using Clock = std::chrono::steady_clock;
+
+static void run( bool zero_copy
+               , const boost::filesystem::path& p
+               , size_t size
+               , unsigned passes
+               , bool report = true)
+{
+    asio::io_context ctx;
+    tcp::acceptor acceptor(ctx, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket server(ctx);
+    tcp::socket client(ctx);
+    size_t received = 0;
+
+    auto cpu_start = std::clock();
+    auto start = Clock::now();
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        Cancel cancel;
+        sys::error_code ec;
+        acceptor.async_accept(server, yield);
+        auto f = file_io::open_readonly(ctx.get_executor(), p, ec);
+        if (ec) throw sys::system_error(ec);
+
+        std::vector<char> buffer(file_io::buffered_reader::default_chunk_size);
+        for (unsigned i = 0; i < passes; ++i) {
+            if (zero_copy) {
+                file_io::send_range(f, 0, size, server, cancel, yield);
+                continue;
+            }
+            for (size_t offset = 0; offset < size; offset += buffer.size()) {
+                auto b = asio::buffer(buffer.data(), std::min(buffer.size(), size - offset));
+                file_io::read_at(f, b, offset, cancel, yield);
+                asio::async_write(server, b, yield);
+            }
+        }
+        server.shutdown(tcp::socket::shutdown_send);
+    });
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        client.async_connect(acceptor.local_endpoint(), yield);
+        std::vector<char> buffer(1 << 20);
+        sys::error_code ec;
+        while (!ec) received += client.async_read_some(asio::buffer(buffer), yield[ec]);
+    });
+
+    ctx.run();
+    if (!report) return;
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double cpu_seconds = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    double mib = double(received) / (1 << 20);
+
+    std::cout << (zero_copy ? "send_range" : "read_at + async_write")
+              << ": " << mib / seconds << " MiB/s"
+              << ", " << mib / cpu_seconds << " MiB per CPU second"
+              << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t size = (argc > 1 ? std::stoul(argv[1]) : 256) << 20;
+    unsigned passes = argc > 2 ? std::stoul(argv[2]) : 8;
+
+    auto path = boost::filesystem::temp_directory_path()
+              / boost::filesystem::unique_path("bench_send-%%%%%%%%");
+    {
+        std::ofstream out(path.string(), std::ios::binary);
+        std::vector<char> block(1 << 20, 'x');
+        for (size_t done = 0; done < size; done += block.size()) {
+            out.write(block.data(), block.size());
+        }
+    }
+
+    // Warm the page cache up, not measured.
+    run(false, path, size, 1, false);
+
+    run(false, path, size, passes);
+    run(true, path, size, passes);
+
+    boost::filesystem::remove(path);
+}
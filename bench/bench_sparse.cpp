@@ -0,0 +1,96 @@
+// Random 4 KiB `write_at`/`read_at` across a sparse file (16 GiB by
+// default), most of the blocks lying past 4 GiB, reporting operations per
+// second and checking that every block reads back from where it was written
+// (32-bit offsets would wrap and land blocks on top of each other).
+//
+// Usage: bench_sparse [<file size in GiB> [<blocks>]]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include "util/file_io.h"
+
+namespace asio = boost::asio;
+namespace sys = boost::system;
+namespace file_io = ouinet::util::file_io;
+
+using Cancel = ouinet::Signal<void()>;
+using Clock = std::chrono::steady_clock;
+
+static const size_t block_size = 4096;
+
+// Fill the block with its own offset, so that misplaced blocks show.
+static void fill(std::vector<char>& block, uint64_t offset)
+{
+    for (size_t i = 0; i < block.size(); i += sizeof(offset)) {
+        std::memcpy(block.data() + i, &offset, sizeof(offset));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t file_size = uint64_t(argc > 1 ? std::stoul(argv[1]) : 16) << 30;
+    size_t blocks = argc > 2 ? std::stoul(argv[2]) : 20000;
+
+    auto path = boost::filesystem::temp_directory_path()
+              / boost::filesystem::unique_path("bench_sparse-%%%%%%%%");
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<uint64_t> dist(0, file_size / block_size - 1);
+    std::vector<uint64_t> offsets;
+    for (size_t i = 0; i < blocks; ++i) offsets.push_back(dist(rng) * block_size);
+
+    asio::io_context ctx;
+    bool ok = true;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        Cancel cancel;
+        sys::error_code ec;
+        auto f = file_io::open_or_create(ctx.get_executor(), path, ec);
+        if (ec) throw sys::system_error(ec);
+        file_io::truncate(f, file_size, cancel, yield);
+
+        std::vector<char> block(block_size);
+
+        auto start = Clock::now();
+        for (auto offset : offsets) {
+            fill(block, offset);
+            file_io::write_at(f, asio::buffer(block), offset, cancel, yield);
+        }
+        double write_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::shuffle(offsets.begin(), offsets.end(), rng);
+        std::vector<char> expected(block_size);
+
+        start = Clock::now();
+        for (auto offset : offsets) {
+            file_io::read_at(f, asio::buffer(block), offset, cancel, yield);
+            fill(expected, offset);
+            // The same offset may have been drawn twice, with the same content.
+            if (block != expected) ok = false;
+        }
+        double read_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::cout << "file size: " << (file_io::file_size(f, ec) >> 30) << " GiB"
+                  << ", " << blocks << " blocks" << std::endl
+                  << "write_at: " << blocks / write_seconds << " ops/s" << std::endl
+                  << "read_at: " << blocks / read_seconds << " ops/s" << std::endl;
+    });
+
+    ctx.run();
+    boost::filesystem::remove(path);
+
+    if (!ok) {
+        std::cerr << "Blocks did not read back from their offsets" << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+// Counts the file system calls made by the process, by interposing the libc
+// wrappers that file_io uses (64-bit Linux only, elsewhere the count stays at
+// zero).  Calls made by the reactor itself (epoll, eventfd reads) are not
+// counted.  Include it from a single translation unit of an executable.
+
+#include <atomic>
+#include <cstdarg>
+#include <type_traits>
+
+#ifdef __linux__
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+inline std::atomic<size_t> syscall_count{0};
+
+inline bool syscall_count_supported()
+{
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+} // bench namespace
+
+#ifdef __linux__
+
+template<class F>
+static F next_symbol(F, const char* name)
+{
+    static_assert(std::is_pointer<F>::value, "");
+    return reinterpret_cast<F>(::dlsym(RTLD_NEXT, name));
+}
+
+#define BENCH_FORWARD(name, ...) \
+    ++bench::syscall_count; \
+    static auto real = next_symbol(static_cast<decltype(&::name)>(nullptr), #name); \
+    return real(__VA_ARGS__);
+
+extern "C" {
+
+off_t lseek(int fd, off_t offset, int whence) noexcept
+{ BENCH_FORWARD(lseek, fd, offset, whence) }
+
+int fstat(int fd, struct stat* st) noexcept
+{ BENCH_FORWARD(fstat, fd, st) }
+
+int ftruncate(int fd, off_t length) noexcept
+{ BENCH_FORWARD(ftruncate, fd, length) }
+
+int fsync(int fd)
+{ BENCH_FORWARD(fsync, fd) }
+
+int fdatasync(int fd)
+{ BENCH_FORWARD(fdatasync, fd) }
+
+ssize_t pread(int fd, void* buf, size_t n, off_t offset)
+{ BENCH_FORWARD(pread, fd, buf, n, offset) }
+
+ssize_t pwrite(int fd, const void* buf, size_t n, off_t offset)
+{ BENCH_FORWARD(pwrite, fd, buf, n, offset) }
+
+ssize_t preadv(int fd, const iovec* iov, int n, off_t offset)
+{ BENCH_FORWARD(preadv, fd, iov, n, offset) }
+
+ssize_t pwritev(int fd, const iovec* iov, int n, off_t offset)
+{ BENCH_FORWARD(pwritev, fd, iov, n, offset) }
+
+// io_uring_setup/enter/register have no libc wrappers.
+long syscall(long number, ...) noexcept
+{
+    va_list ap;
+    va_start(ap, number);
+    long a[6];
+    for (auto& x : a) x = va_arg(ap, long);
+    va_end(ap);
+    BENCH_FORWARD(syscall, number, a[0], a[1], a[2], a[3], a[4], a[5])
+}
+
+} // extern "C"
+
+#undef BENCH_FORWARD
+
+#endif // __linux__
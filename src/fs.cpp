@@ -11,9 +11,13 @@
 #include <filesystem>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
 #include <map>
-#include <regex>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -33,6 +37,9 @@
 #include <dirent.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #endif
 
 #include <cstdio>
@@ -49,12 +56,14 @@ namespace fs
 #include <psapi.h>
 
 static std::map<std::string, HANDLE> lockMap;
+static std::mutex lockMapMutex;
 
 void
 lockFile(std::string const& path)
 {
     ZoneScoped;
     std::ostringstream errmsg;
+    std::lock_guard<std::mutex> guard(lockMapMutex);
 
     if (lockMap.find(path) != lockMap.end())
     {
@@ -81,6 +90,7 @@ void
 unlockFile(std::string const& path)
 {
     ZoneScoped;
+    std::lock_guard<std::mutex> guard(lockMapMutex);
     auto it = lockMap.find(path);
     if (it != lockMap.end())
     {
@@ -160,6 +170,102 @@ durableRename(std::string const& src, std::string const& dst,
     return true;
 }
 
+// Add the regular files in dir to res, named prefix + name, and their
+// subdirectories to subdirs (unless null).
+static void
+readDirectory(std::string const& dir, std::string const& prefix,
+              bool withStat, DirEntries& res,
+              std::vector<std::string>* subdirs)
+{
+    WIN32_FIND_DATAA fd;
+    // Basic info skips the short (8.3) name, large fetch asks the file system
+    // for as many entries as fit in a bigger buffer.
+    HANDLE h = ::FindFirstFileExA((dir + "\\*").c_str(), FindExInfoBasic, &fd,
+                                  FindExSearchNameMatch, NULL,
+                                  FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+        {
+            return;
+        }
+        FileSystemException::failWithGetLastError(
+            std::string("fs::enumerateDir() failed on FindFirstFileExA(\"") +
+            dir + "\"): ");
+    }
+
+    do
+    {
+        std::string_view name(fd.cFileName);
+        if (name == "." || name == "..")
+        {
+            continue;
+        }
+        DWORD attrs = fd.dwFileAttributes;
+        if (attrs & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            // Junctions and directory symlinks are not followed.
+            if (subdirs && !(attrs & FILE_ATTRIBUTE_REPARSE_POINT))
+            {
+                subdirs->emplace_back(std::string(prefix).append(name));
+            }
+            continue;
+        }
+        if (attrs & FILE_ATTRIBUTE_DEVICE)
+        {
+            continue;
+        }
+        if (!withStat)
+        {
+            res.add(prefix, name);
+            continue;
+        }
+        uint64_t size = (uint64_t(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
+        // FILETIME counts 100ns intervals since 1601-01-01.
+        int64_t mtime = (int64_t((uint64_t(fd.ftLastWriteTime.dwHighDateTime)
+                                  << 32) |
+                                 fd.ftLastWriteTime.dwLowDateTime) -
+                         116444736000000000LL) *
+                        100;
+        res.add(prefix, name, size, mtime);
+    } while (::FindNextFileA(h, &fd));
+
+    DWORD err = GetLastError();
+    ::FindClose(h);
+    if (err != ERROR_NO_MORE_FILES)
+    {
+        SetLastError(err);
+        FileSystemException::failWithGetLastError(
+            std::string("fs::enumerateDir() failed on FindNextFileA(\"") +
+            dir + "\"): ");
+    }
+}
+
+DurableRenameBatch::DurableRenameBatch(size_t maxCachedDirs)
+    : mMaxCachedDirs(maxCachedDirs)
+{
+}
+
+DurableRenameBatch::~DurableRenameBatch()
+{
+}
+
+std::vector<bool>
+DurableRenameBatch::commit()
+{
+    ZoneScoped;
+    std::vector<bool> res;
+    res.reserve(mPending.size());
+    auto pending = std::move(mPending);
+    mPending.clear();
+    // Directory entries are written through by MoveFileExA itself.
+    for (auto const& r : pending)
+    {
+        res.push_back(durableRename(r.src, r.dst, r.dir));
+    }
+    return res;
+}
+
 #else
 #include <cerrno>
 #include <fcntl.h>
@@ -168,12 +274,14 @@ durableRename(std::string const& src, std::string const& dst,
 #include <unistd.h>
 
 static std::map<std::string, int> lockMap;
+static std::mutex lockMapMutex;
 
 void
 lockFile(std::string const& path)
 {
     ZoneScoped;
-    std::ostringstream ermsg;
+    std::ostringstream errmsg;
+    std::lock_guard<std::mutex> guard(lockMapMutex);
 
     if (lockMap.find(path) != lockMap.end())
     {
@@ -189,6 +297,9 @@ lockFile(std::string const& path)
         throw FileSystemException(errmsg.str());
     }
 
+    // flock() locks belong to the open file description, and do not
+    // conflict with OFD locks: keep it so that lock files stay exclusive
+    // against other versions of the binary.
     int r = flock(fd, LOCK_EX | LOCK_NB);
     if (r != 0)
     {
@@ -205,6 +316,7 @@ void
 unlockFile(std::string const& path)
 {
     ZoneScoped;
+    std::lock_guard<std::mutex> guard(lockMapMutex);
     auto it = lockMap.find(path);
     if (it != lockMap.end())
     {
@@ -251,15 +363,9 @@ openFileToWrite(std::string const& path)
     return fd;
 }
 
-bool
-durableRename(std::string const& src, std::string const& dst,
-              std::string const& dir)
+static int
+openDirectory(std::string const& dir)
 {
-    ZoneScoped;
-    if (rename(src.c_str(), dst.c_str()) != 0)
-    {
-        return false;
-    }
     int dfd;
     while ((dfd = open(dir.c_str(), O_RDONLY)) == -1)
     {
@@ -270,6 +376,12 @@ durableRename(std::string const& src, std::string const& dst,
         FileSystemException::failWithErrno(
             std::string("Failed to open directory ") + dir + " :");
     }
+    return dfd;
+}
+
+static void
+fsyncDirectory(int dfd, std::string const& dir)
+{
     while (fsync(dfd) == -1)
     {
         if (errno == EINTR)
@@ -279,6 +391,11 @@ durableRename(std::string const& src, std::string const& dst,
         FileSystemException::failWithErrno(
             std::string("Failed to fsync directory ") + dir + " :");
     }
+}
+
+static void
+closeDirectory(int dfd, std::string const& dir)
+{
     while (close(dfd) == -1)
     {
         if (errno == EINTR)
@@ -288,12 +405,285 @@ durableRename(std::string const& src, std::string const& dst,
         FileSystemException::failWithErrno(
             std::string("Failed to close directory ") + dir + " :");
     }
+}
+
+static int64_t
+mtimeNs(struct stat const& st)
+{
+#ifdef __APPLE__
+    auto const& ts = st.st_mtimespec;
+#else
+    auto const& ts = st.st_mtim;
+#endif
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Add the entry name of type type (DT_*) in the directory dfd to res or
+// subdirs, see readDirectory.
+static void
+addDirEntry(int dfd, char const* name, unsigned char type,
+            std::string const& prefix, bool withStat, DirEntries& res,
+            std::vector<std::string>* subdirs)
+{
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    {
+        return;
+    }
+    if (type == DT_DIR)
+    {
+        if (subdirs)
+        {
+            subdirs->emplace_back(prefix + name);
+        }
+        return;
+    }
+    if (type == DT_REG && !withStat)
+    {
+        res.add(prefix, name);
+        return;
+    }
+    if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+    {
+        return;
+    }
+
+    // Symlinks are followed like std::filesystem::status() does, but only
+    // to files: symlinked directories are not walked into.
+    bool link = type == DT_LNK;
+    struct stat st;
+    if (fstatat(dfd, name, &st, link ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        // Removed meanwhile, or a dangling symlink.
+        return;
+    }
+    if (S_ISLNK(st.st_mode))
+    {
+        link = true;
+        if (fstatat(dfd, name, &st, 0) != 0)
+        {
+            return;
+        }
+    }
+    if (S_ISDIR(st.st_mode) && !link && subdirs)
+    {
+        subdirs->emplace_back(prefix + name);
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+        if (withStat)
+        {
+            res.add(prefix, name, st.st_size, mtimeNs(st));
+        }
+        else
+        {
+            res.add(prefix, name);
+        }
+    }
+}
+
+// Add the regular files in dir to res, named prefix + name, and their
+// subdirectories to subdirs (unless null).
+static void
+readDirectory(std::string const& dir, std::string const& prefix,
+              bool withStat, DirEntries& res,
+              std::vector<std::string>* subdirs)
+{
+    int dfd;
+    while ((dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) ==
+           -1)
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        FileSystemException::failWithErrno(
+            std::string("fs::enumerateDir() failed to open \"") + dir +
+            "\": ");
+    }
+
+#ifdef __linux__
+    // Many entries per system call, without the per entry copy into a
+    // struct dirent which readdir() does.
+    thread_local std::vector<char> buf(bufsz());
+    for (;;)
+    {
+        long n = syscall(SYS_getdents64, dfd, buf.data(), buf.size());
+        if (n == 0)
+        {
+            break;
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            int err = errno;
+            close(dfd);
+            errno = err;
+            FileSystemException::failWithErrno(
+                std::string("fs::enumerateDir() failed on getdents64(\"") +
+                dir + "\"): ");
+        }
+        for (long pos = 0; pos < n;)
+        {
+            // Same layout as the kernel's struct linux_dirent64.
+            auto ent = reinterpret_cast<struct dirent64*>(buf.data() + pos);
+            addDirEntry(dfd, ent->d_name, ent->d_type, prefix, withStat, res,
+                        subdirs);
+            pos += ent->d_reclen;
+        }
+    }
+    close(dfd);
+#else
+    DIR* d = fdopendir(dfd);
+    if (!d)
+    {
+        int err = errno;
+        close(dfd);
+        errno = err;
+        FileSystemException::failWithErrno(
+            std::string("fs::enumerateDir() failed on fdopendir(\"") + dir +
+            "\"): ");
+    }
+    errno = 0;
+    while (struct dirent* ent = readdir(d))
+    {
+        addDirEntry(dfd, ent->d_name, ent->d_type, prefix, withStat, res,
+                    subdirs);
+        errno = 0;
+    }
+    int err = errno;
+    closedir(d);
+    if (err != 0)
+    {
+        errno = err;
+        FileSystemException::failWithErrno(
+            std::string("fs::enumerateDir() failed on readdir(\"") + dir +
+            "\"): ");
+    }
+#endif
+}
+
+bool
+durableRename(std::string const& src, std::string const& dst,
+              std::string const& dir)
+{
+    ZoneScoped;
+    if (rename(src.c_str(), dst.c_str()) != 0)
+    {
+        return false;
+    }
+    int dfd = openDirectory(dir);
+    fsyncDirectory(dfd, dir);
+    closeDirectory(dfd, dir);
     return true;
 }
+
+DurableRenameBatch::DurableRenameBatch(size_t maxCachedDirs)
+    : mMaxCachedDirs(maxCachedDirs)
+{
+}
+
+DurableRenameBatch::~DurableRenameBatch()
+{
+    for (auto const& d : mDirHandles)
+    {
+        // can't throw from here
+        close(d.second);
+    }
+}
+
+native_handle_t
+DurableRenameBatch::dirHandle(std::string const& dir)
+{
+    auto it = mDirHandles.find(dir);
+    if (it != mDirHandles.end())
+    {
+        // The directory may have been removed and recreated since it was
+        // opened, syncing the old inode would not make the renames durable.
+        struct stat cached, current;
+        if (fstat(it->second, &cached) == 0 &&
+            stat(dir.c_str(), &current) == 0 &&
+            cached.st_dev == current.st_dev && cached.st_ino == current.st_ino)
+        {
+            return it->second;
+        }
+        int stale = it->second;
+        mDirHandles.erase(it);
+        closeDirectory(stale, dir);
+    }
+    int dfd = openDirectory(dir);
+    mDirHandles.emplace(dir, dfd);
+    return dfd;
+}
+
+void
+DurableRenameBatch::trimDirCache(std::vector<std::string> const& keep)
+{
+    for (auto it = mDirHandles.begin();
+         it != mDirHandles.end() && mDirHandles.size() > mMaxCachedDirs;)
+    {
+        if (std::find(keep.begin(), keep.end(), it->first) != keep.end())
+        {
+            ++it;
+            continue;
+        }
+        int dfd = it->second;
+        std::string dir = it->first;
+        it = mDirHandles.erase(it);
+        closeDirectory(dfd, dir);
+    }
+    for (auto it = mDirHandles.begin();
+         it != mDirHandles.end() && mDirHandles.size() > mMaxCachedDirs;)
+    {
+        int dfd = it->second;
+        std::string dir = it->first;
+        it = mDirHandles.erase(it);
+        closeDirectory(dfd, dir);
+    }
+}
+
+std::vector<bool>
+DurableRenameBatch::commit()
+{
+    ZoneScoped;
+    std::vector<bool> res;
+    std::vector<std::string> dirs;
+    res.reserve(mPending.size());
+    auto pending = std::move(mPending);
+    mPending.clear();
+
+    for (auto const& r : pending)
+    {
+        bool ok = rename(r.src.c_str(), r.dst.c_str()) == 0;
+        res.push_back(ok);
+        if (ok && std::find(dirs.begin(), dirs.end(), r.dir) == dirs.end())
+        {
+            dirs.emplace_back(r.dir);
+        }
+    }
+
+    for (auto const& dir : dirs)
+    {
+        fsyncDirectory(dirHandle(dir), dir);
+    }
+
+    trimDirCache(dirs);
+    return res;
+}
 #endif
 
 namespace stdfs = std::filesystem;
 
+void
+DurableRenameBatch::add(std::string const& src, std::string const& dst,
+                        std::string const& dir)
+{
+    mPending.emplace_back(Rename{src, dst, dir});
+}
+
 bool
 exists(std::string const& name)
 {
@@ -323,17 +713,144 @@ findfiles(std::string const& p,
           std::function<bool(std::string const& name)> predicate)
 {
     ZoneScoped;
+    auto entries = enumerateDir(p);
     std::vector<std::string> res;
-    for (auto& entry : stdfs::directory_iterator(stdfs::path(p)))
+    std::string name;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        name.assign(entries.name(i));
+        if (predicate(name))
+        {
+            res.emplace_back(name);
+        }
+    }
+    return res;
+}
+
+void
+DirEntries::add(std::string_view prefix, std::string_view name)
+{
+    mNames.append(prefix);
+    mNames.append(name);
+    mEnds.push_back(mNames.size());
+}
+
+void
+DirEntries::add(std::string_view prefix, std::string_view name, uint64_t size,
+                int64_t mtime)
+{
+    mSizes.resize(mEnds.size());
+    mMtimes.resize(mEnds.size());
+    add(prefix, name);
+    mSizes.push_back(size);
+    mMtimes.push_back(mtime);
+}
+
+void
+DirEntries::append(DirEntries&& other)
+{
+    if (empty())
+    {
+        *this = std::move(other);
+        return;
+    }
+    bool withStat = !mSizes.empty() || !other.mSizes.empty();
+    if (withStat)
+    {
+        mSizes.resize(size());
+        mMtimes.resize(size());
+        other.mSizes.resize(other.size());
+        other.mMtimes.resize(other.size());
+        mSizes.insert(mSizes.end(), other.mSizes.begin(), other.mSizes.end());
+        mMtimes.insert(mMtimes.end(), other.mMtimes.begin(),
+                       other.mMtimes.end());
+    }
+    size_t base = mNames.size();
+    mNames.append(other.mNames);
+    for (auto end : other.mEnds)
+    {
+        mEnds.push_back(base + end);
+    }
+}
+
+DirEntries
+enumerateDir(std::string const& path, EnumerateOptions const& options)
+{
+    ZoneScoped;
+    DirEntries res;
+    if (!options.recursive)
     {
-        if (stdfs::is_regular_file(entry.status()))
+        readDirectory(path, "", options.withStat, res, nullptr);
+        return res;
+    }
+
+    // Directories left to read, relative to path; each thread reads them into
+    // its own entries which are merged at the end.
+    std::vector<std::string> pending{""};
+    size_t busy = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    auto walk = [&]() {
+        DirEntries entries;
+        std::vector<std::string> subdirs;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
         {
-            auto n = entry.path().filename().string();
-            if (predicate(n))
+            cv.wait(lock,
+                    [&] { return error || !pending.empty() || busy == 0; });
+            if (error || pending.empty())
+            {
+                break;
+            }
+            auto dir = std::move(pending.back());
+            pending.pop_back();
+            ++busy;
+            lock.unlock();
+
+            std::exception_ptr e;
+            try
+            {
+                readDirectory(dir.empty() ? path : path + "/" + dir,
+                              dir.empty() ? dir : dir + "/", options.withStat,
+                              entries, &subdirs);
+            }
+            catch (...)
             {
-                res.emplace_back(n);
+                e = std::current_exception();
             }
+
+            lock.lock();
+            --busy;
+            if (e && !error)
+            {
+                error = e;
+            }
+            for (auto& d : subdirs)
+            {
+                pending.emplace_back(std::move(d));
+            }
+            subdirs.clear();
+            cv.notify_all();
         }
+        res.append(std::move(entries));
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < options.maxThreads; ++i)
+    {
+        threads.emplace_back(walk);
+    }
+    walk();
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
     }
     return res;
 }
@@ -353,36 +870,65 @@ hexStr(uint32_t checkpointNum)
     return fmt::format("{:08x}", checkpointNum);
 }
 
+// The std::string versions are not limited to RemotePath's capacity, they
+// build the result in a single allocation instead.
+static void
+appendHexDir(std::string& res, std::string const& hexStr)
+{
+    releaseAssert(hasHexDirPrefix(hexStr));
+    res.append(hexStr, 0, 2).append(1, '/');
+    res.append(hexStr, 2, 2).append(1, '/');
+    res.append(hexStr, 4, 2);
+}
+
+static void
+appendBaseName(std::string& res, std::string const& type,
+               std::string const& hexStr, std::string const& suffix)
+{
+    res.append(type).append(1, '-').append(hexStr).append(1, '.').append(
+        suffix);
+}
+
 std::string
 hexDir(std::string const& hexStr)
 {
-    static const std::regex rx(
-        "([[:xdigit:]]{2})([[:xdigit:]]{2})([[:xdigit:]]{2}).*");
-    std::smatch sm;
-    bool matched = std::regex_match(hexStr, sm, rx);
-    releaseAssert(matched);
-    return (std::string(sm[1]) + "/" + std::string(sm[2]) + "/" +
-            std::string(sm[3]));
+    std::string res;
+    res.reserve(8);
+    appendHexDir(res, hexStr);
+    return res;
 }
 
 std::string
 baseName(std::string const& type, std::string const& hexStr,
          std::string const& suffix)
 {
-    return type + "-" + hexStr + "." + suffix;
+    std::string res;
+    res.reserve(type.size() + hexStr.size() + suffix.size() + 2);
+    appendBaseName(res, type, hexStr, suffix);
+    return res;
 }
 
 std::string
 remoteDir(std::string const& type, std::string const& hexStr)
 {
-    return type + "/" + hexDir(hexStr);
+    std::string res;
+    res.reserve(type.size() + 9);
+    res.append(type).append(1, '/');
+    appendHexDir(res, hexStr);
+    return res;
 }
 
 std::string
 remoteName(std::string const& type, std::string const& hexStr,
            std::string const& suffix)
 {
-    return remoteDir(type, hexStr) + "/" + baseName(type, hexStr, suffix);
+    std::string res;
+    res.reserve(2 * type.size() + hexStr.size() + suffix.size() + 12);
+    res.append(type).append(1, '/');
+    appendHexDir(res, hexStr);
+    res.append(1, '/');
+    appendBaseName(res, type, hexStr, suffix);
+    return res;
 }
 
 void
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio/error.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "../namespaces.h"
+
+namespace ouinet {
+
+// A cancellation token which, unlike `Cancel`, may be fired and connected to
+// from any thread, e.g. when file operations complete on an io_context run by
+// a pool of threads.
+//
+// * Whether it fired is an atomic flag, so checking it is cheap anywhere.
+// * Connecting pushes the slot onto a lock-free list; a short lock is only
+//   taken to disconnect a slot which was not called, and to fire.
+// * Small callables (up to `Connection::inline_size` bytes, e.g. lambdas
+//   capturing a few references) are stored inside the connection itself, so
+//   neither connecting nor firing allocates.
+//
+// As with `Cancel`, each slot is called at most once.  Connecting to a token
+// which already fired calls the slot right away.  Once a connection is gone
+// its slot is no longer running nor going to be called (unless it is destroyed
+// from within its own slot).  Connections must not outlive their token.
+class AtomicCancel {
+public:
+    class Connection {
+    public:
+        static constexpr size_t inline_size = 4 * sizeof(void*);
+
+        Connection() = default;
+
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+
+        ~Connection()
+        {
+            if (_token) _token->disconnect(*this);
+            if (_destroy) _destroy(_storage);
+        }
+
+        // Whether the slot has been called.
+        size_t call_count() const { return _called.load(std::memory_order_acquire) ? 1 : 0; }
+
+        operator bool() const { return call_count() != 0; }
+
+    private:
+        friend class AtomicCancel;
+
+        // The connection is linked by address, so it is built right where
+        // `connect` returns it.
+        template<class F>
+        Connection(AtomicCancel& token, F&& slot)
+        {
+            emplace(std::forward<F>(slot));
+            token.link(*this);
+        }
+
+        template<class F>
+        void emplace(F&& f)
+        {
+            using Fn = std::decay_t<F>;
+
+            if constexpr (sizeof(Fn) <= inline_size
+                          && alignof(Fn) <= alignof(std::max_align_t)) {
+                new (_storage) Fn(std::forward<F>(f));
+                _call    = [] (void* p) { (*static_cast<Fn*>(p))(); };
+                _destroy = [] (void* p) { static_cast<Fn*>(p)->~Fn(); };
+            } else {
+                *reinterpret_cast<Fn**>(_storage) = new Fn(std::forward<F>(f));
+                _call    = [] (void* p) { (**static_cast<Fn**>(p))(); };
+                _destroy = [] (void* p) { delete *static_cast<Fn**>(p); };
+            }
+        }
+
+        void call()
+        {
+            _called.store(true, std::memory_order_release);
+            _call(_storage);
+        }
+
+    private:
+        alignas(std::max_align_t) unsigned char _storage[inline_size];
+        void (*_call)(void*) = nullptr;
+        void (*_destroy)(void*) = nullptr;
+
+        AtomicCancel* _token = nullptr;
+        // On the token's lists, guarded by its mutex.
+        bool _linked = false;
+        Connection* _next = nullptr;
+        std::atomic<bool> _called{false};
+    };
+
+public:
+    AtomicCancel() = default;
+
+    // Fire along with `parent` (but not the other way round).
+    AtomicCancel(AtomicCancel& parent)
+        : _parent_connection(parent.connect([this] { (*this)(); }))
+    {}
+
+    AtomicCancel(const AtomicCancel&) = delete;
+    AtomicCancel& operator=(const AtomicCancel&) = delete;
+
+    ~AtomicCancel()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto c = _head.exchange(fired_list(), std::memory_order_acquire);
+        for (; c && c != fired_list(); c = c->_next) c->_token = nullptr;
+    }
+
+    template<class F>
+    Connection connect(F&& slot)
+    {
+        return Connection(*this, std::forward<F>(slot));
+    }
+
+    void operator()()
+    {
+        _call_count.fetch_add(1, std::memory_order_relaxed);
+
+        if (_fired.exchange(true, std::memory_order_acq_rel)) return;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _firing_thread = std::this_thread::get_id();
+        // New connections see the token as fired from now on.
+        _firing = _head.exchange(fired_list(), std::memory_order_acq_rel);
+
+        // Slots run without the lock held, so that they may connect or
+        // disconnect too.  A slot which is taken off the list can only be
+        // disconnected once it is done.
+        while (_firing) {
+            auto c = _firing;
+            _firing = c->_next;
+            c->_linked = false;
+            _running.store(c, std::memory_order_release);
+            lock.unlock();
+
+            c->call();
+
+            lock.lock();
+            _running.store(nullptr, std::memory_order_release);
+        }
+
+        _firing_thread = std::thread::id();
+    }
+
+    size_t call_count() const { return _call_count.load(std::memory_order_relaxed); }
+
+    operator bool() const { return _fired.load(std::memory_order_acquire); }
+
+private:
+    // Marks the list of a token which fired.
+    static Connection* fired_list()
+    {
+        static Connection marker;
+        return &marker;
+    }
+
+    void link(Connection& c)
+    {
+        auto head = _head.load(std::memory_order_acquire);
+
+        // Set before publishing the connection: once it is on the list
+        // it may be fired at any moment.
+        c._token = this;
+        c._linked = true;
+
+        do {
+            if (head == fired_list()) {
+                c._token = nullptr;
+                c._linked = false;
+                c.call();
+                return;
+            }
+            c._next = head;
+        } while (!_head.compare_exchange_weak( head, &c
+                                             , std::memory_order_release
+                                             , std::memory_order_acquire));
+    }
+
+    static bool unlink(Connection*& list, Connection& c)
+    {
+        for (auto p = &list; *p; p = &(*p)->_next) {
+            if (*p == &c) {
+                *p = c._next;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void disconnect(Connection& c)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            if (!c._linked) {
+                // Already taken by the firing thread.
+            } else if (unlink(_firing, c)) {
+                c._linked = false;
+                return;
+            } else {
+                // Only connecting threads touch the list concurrently and
+                // they only push at the head, so if `c` is not the head its
+                // predecessor is stable while we hold the lock.
+                auto head = &c;
+                if (!_head.compare_exchange_strong( head, c._next
+                                                  , std::memory_order_acq_rel)) {
+                    Connection* list = head;
+                    for (auto p = list; p && p != fired_list(); p = p->_next) {
+                        if (p->_next == &c) {
+                            p->_next = c._next;
+                            break;
+                        }
+                    }
+                }
+                c._linked = false;
+                return;
+            }
+
+            if (_firing_thread == std::this_thread::get_id()) return;
+        }
+
+        // Wait for the slot to return if it is running on another thread.
+        while (_running.load(std::memory_order_acquire) == &c) {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    std::atomic<Connection*> _head{nullptr};
+    std::atomic<bool> _fired{false};
+    std::atomic<size_t> _call_count{0};
+
+    std::mutex _mutex;
+    // Connections taken off `_head` and not yet called.
+    Connection* _firing = nullptr;
+    std::atomic<Connection*> _running{nullptr};
+    std::thread::id _firing_thread;
+
+    Connection _parent_connection;
+};
+
+inline
+sys::error_code
+compute_error_code( const sys::error_code& ec
+                  , const AtomicCancel& cancel)
+{
+    if (cancel) return asio::error::operation_aborted;
+    return ec;
+}
+
+} // ouinet namespace
@@ -0,0 +1,319 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <map>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace ouinet { namespace util {
+
+struct buffer_pool::thread_cache {
+    uint64_t pool_id;
+    std::vector<char*> buffers;
+};
+
+// Pools alive, so that exiting threads can give their cached buffers back.
+static std::mutex& live_pools_mutex()
+{
+    static std::mutex m;
+    return m;
+}
+
+static std::map<uint64_t, buffer_pool*>& live_pools()
+{
+    static std::map<uint64_t, buffer_pool*> pools;
+    return pools;
+}
+
+struct buffer_pool::thread_caches {
+    std::vector<thread_cache> caches;
+
+    ~thread_caches()
+    {
+        std::lock_guard<std::mutex> lock(live_pools_mutex());
+        for (auto& c : caches) {
+            auto i = live_pools().find(c.pool_id);
+            // Buffers of pools already gone went away with them.
+            if (i == live_pools().end()) continue;
+            for (auto b : c.buffers) i->second->put_shared(b);
+        }
+    }
+};
+
+static std::atomic<uint64_t> next_pool_id{0};
+
+buffer_pool::buffer_pool()
+    : buffer_pool(options{})
+{}
+
+buffer_pool::buffer_pool(options opts)
+    : _options(opts)
+    , _id(next_pool_id++)
+{
+    {
+        std::lock_guard<std::mutex> lock(live_pools_mutex());
+        live_pools()[_id] = this;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    while (_buffers < std::min(_options.initial_buffers, _options.max_buffers)) {
+        add_slab();
+    }
+}
+
+buffer_pool::~buffer_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(live_pools_mutex());
+        live_pools().erase(_id);
+    }
+
+    for (auto& s : _slabs) deallocate(s.data, s.size);
+}
+
+static std::mutex global_mutex;
+static std::atomic<buffer_pool*> global_pool{nullptr};
+static buffer_pool::options global_options;
+
+buffer_pool& buffer_pool::global()
+{
+    if (auto p = global_pool.load(std::memory_order_acquire)) return *p;
+
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if (!global_pool) {
+        // Never destroyed, buffers may be in use until the very end.
+        global_pool.store(new buffer_pool(global_options), std::memory_order_release);
+    }
+    return *global_pool;
+}
+
+bool buffer_pool::set_global_options(const options& opts)
+{
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if (global_pool) return false;
+    global_options = opts;
+    return true;
+}
+
+char* buffer_pool::allocate(size_t size, bool huge_pages, bool& got_huge_pages)
+{
+    got_huge_pages = false;
+    void* p = nullptr;
+
+#ifdef _WIN32
+    (void) huge_pages;
+    p = ::VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+# ifdef MAP_HUGETLB
+    if (huge_pages) {
+        p = ::mmap( nullptr, size, PROT_READ | PROT_WRITE
+                  , MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) p = nullptr;
+        else got_huge_pages = true;
+    }
+# endif
+    if (!p) {
+        p = ::mmap( nullptr, size, PROT_READ | PROT_WRITE
+                  , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) p = nullptr;
+# ifdef MADV_HUGEPAGE
+        // No huge pages reserved, try transparent ones.
+        if (p && huge_pages) ::madvise(p, size, MADV_HUGEPAGE);
+# endif
+    }
+#endif
+
+    if (!p) throw std::bad_alloc();
+    return static_cast<char*>(p);
+}
+
+void buffer_pool::deallocate(char* p, size_t size)
+{
+#ifdef _WIN32
+    (void) size;
+    ::VirtualFree(p, 0, MEM_RELEASE);
+#else
+    ::munmap(p, size);
+#endif
+}
+
+// Must be called with the mutex held.
+void buffer_pool::add_slab()
+{
+    static constexpr size_t huge_page_size = 2 << 20;
+
+    size_t count = std::max<size_t>(1, std::min( _options.buffers_per_slab
+                                               , _options.max_buffers - _buffers));
+    size_t size = count * _options.buffer_size;
+
+    if (_options.huge_pages) {
+        // Fill whole huge pages.
+        size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+        count = size / _options.buffer_size;
+    }
+
+    bool huge_pages;
+    char* data = allocate(size, _options.huge_pages, huge_pages);
+    _slabs.push_back({data, size, huge_pages});
+
+    // Lower addresses are leased first.
+    for (size_t i = count; i > 0; --i) {
+        _unused.push_back(data + (i - 1) * _options.buffer_size);
+    }
+    _buffers += count;
+}
+
+buffer_pool::thread_cache* buffer_pool::local_cache()
+{
+    if (_options.thread_cache == 0) return nullptr;
+
+    thread_local thread_caches local;
+
+    for (auto& c : local.caches) {
+        if (c.pool_id == _id) return &c;
+    }
+
+    {
+        // Forget about pools which are gone.
+        std::lock_guard<std::mutex> lock(live_pools_mutex());
+        auto& caches = local.caches;
+        caches.erase(std::remove_if(caches.begin(), caches.end(), [] (auto& c) {
+                    return live_pools().count(c.pool_id) == 0;
+                }), caches.end());
+    }
+
+    local.caches.push_back({_id, {}});
+    local.caches.back().buffers.reserve(_options.thread_cache);
+    return &local.caches.back();
+}
+
+buffer_pool::lease buffer_pool::acquire()
+{
+    ++_leases;
+
+    char* data = nullptr;
+    bool pooled = true;
+
+    auto cache = local_cache();
+
+    if (cache && !cache->buffers.empty()) {
+        data = cache->buffers.back();
+        cache->buffers.pop_back();
+        ++_thread_cache_hits;
+    } else {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_free.empty()) {
+            data = _free.back();
+            _free.pop_back();
+            ++_shared_hits;
+        } else {
+            if (_unused.empty() && _buffers < _options.max_buffers) add_slab();
+            if (!_unused.empty()) {
+                data = _unused.back();
+                _unused.pop_back();
+            } else {
+                pooled = false;
+            }
+        }
+    }
+
+    if (!pooled) {
+        bool huge_pages;
+        data = allocate(_options.buffer_size, false, huge_pages);
+        ++_unpooled;
+    }
+
+    size_t in_use = ++_in_use;
+    size_t peak = _peak_in_use.load(std::memory_order_relaxed);
+    while (in_use > peak && !_peak_in_use.compare_exchange_weak(peak, in_use)) {}
+
+    return lease(this, data, pooled);
+}
+
+void buffer_pool::put(char* data)
+{
+    --_in_use;
+
+    auto cache = local_cache();
+    if (cache && cache->buffers.size() < _options.thread_cache) {
+        cache->buffers.push_back(data);
+        return;
+    }
+
+    put_shared(data);
+}
+
+void buffer_pool::put_shared(char* data)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free.push_back(data);
+}
+
+buffer_pool::stats buffer_pool::get_stats() const
+{
+    stats s;
+    s.leases = _leases;
+    s.thread_cache_hits = _thread_cache_hits;
+    s.shared_hits = _shared_hits;
+    s.unpooled = _unpooled;
+    s.in_use = _in_use;
+    s.peak_in_use = _peak_in_use;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    s.buffers = _buffers;
+    s.slabs = _slabs.size();
+    s.huge_page_slabs = std::count_if(_slabs.begin(), _slabs.end(), [] (auto& s) {
+            return s.huge_pages;
+        });
+    return s;
+}
+
+std::vector<asio::mutable_buffer> buffer_pool::slabs() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<asio::mutable_buffer> r;
+    for (auto& s : _slabs) r.push_back(asio::buffer(s.data, s.size));
+    return r;
+}
+
+//--------------------------------------------------------------------
+// lease
+
+buffer_pool::lease::lease(lease&& other)
+    : _pool(other._pool)
+    , _data(other._data)
+    , _pooled(other._pooled)
+{
+    other._data = nullptr;
+}
+
+buffer_pool::lease& buffer_pool::lease::operator=(lease&& other)
+{
+    if (this == &other) return *this;
+    release();
+    _pool = other._pool;
+    _data = other._data;
+    _pooled = other._pooled;
+    other._data = nullptr;
+    return *this;
+}
+
+void buffer_pool::lease::release()
+{
+    if (!_data) return;
+
+    if (_pooled) {
+        _pool->put(_data);
+    } else {
+        --_pool->_in_use;
+        deallocate(_data, _pool->buffer_size());
+    }
+    _data = nullptr;
+}
+
+}} // namespaces
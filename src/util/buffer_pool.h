@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+
+#include "../namespaces.h"
+
+namespace ouinet { namespace util {
+
+// A pool of page aligned I/O buffers of a fixed size, so that reading or
+// writing a chunk does not allocate, and buffers are suitable for direct I/O
+// (see `file_io::open_options::direct`).
+//
+// Buffers are carved out of slabs mapped from the system (optionally backed
+// by huge pages) and are never given back to it while the pool lives.  Each
+// thread keeps a few released buffers for itself so that a lease and its
+// release usually take no lock; the rest go to a shared free list.  Beyond
+// `max_buffers` leases are served from individual allocations freed on
+// release.
+//
+// Most users share the process wide pool, whose options must be given
+// before it is first used:
+//
+//     buffer_pool::set_global_options({...});
+//     auto lease = buffer_pool::global().acquire();
+//     file_io::read_at(f, lease.buffer(), offset, cancel, yield);
+//
+// The pool must outlive its leases.
+class buffer_pool {
+public:
+    struct options {
+        // Same as `stellar::fs::bufsz()`, an AWS EBS IOP.
+        size_t buffer_size = 0x40000;
+        // Buffers mapped at once when the pool runs out of them.
+        size_t buffers_per_slab = 16;
+        // Buffers mapped up front, e.g. to register them with io_uring.
+        size_t initial_buffers = 0;
+        // Pooled buffers, further leases are allocated and freed each time.
+        size_t max_buffers = 1024;
+        // Released buffers kept by each thread (0 to disable).
+        size_t thread_cache = 4;
+        // Back slabs with huge pages where possible (MAP_HUGETLB, or
+        // transparent huge pages if none are reserved).
+        bool huge_pages = false;
+    };
+
+    struct stats {
+        // Buffers handed out.
+        uint64_t leases;
+        // Leases served with a released buffer, from the thread's own cache
+        // or from the shared free list.
+        uint64_t thread_cache_hits;
+        uint64_t shared_hits;
+        // Leases beyond `max_buffers`.
+        uint64_t unpooled;
+        // Buffers leased right now, and the most ever leased at once.
+        size_t in_use;
+        size_t peak_in_use;
+        // Buffers mapped from the system so far, in `slabs` slabs of which
+        // `huge_page_slabs` are backed by huge pages.
+        size_t buffers;
+        size_t slabs;
+        size_t huge_page_slabs;
+
+        double hit_rate() const {
+            return leases ? double(thread_cache_hits + shared_hits) / leases : 0;
+        }
+    };
+
+    // A buffer leased from the pool, given back when the lease is
+    // destroyed or released.
+    class lease {
+    public:
+        lease() = default;
+
+        lease(const lease&) = delete;
+        lease& operator=(const lease&) = delete;
+
+        lease(lease&&);
+        lease& operator=(lease&&);
+
+        ~lease() { release(); }
+
+        char* data() const { return _data; }
+        size_t size() const { return _pool ? _pool->buffer_size() : 0; }
+
+        asio::mutable_buffer buffer() const { return asio::buffer(_data, size()); }
+
+        explicit operator bool() const { return _data != nullptr; }
+
+        void release();
+
+    private:
+        friend class buffer_pool;
+
+        lease(buffer_pool* pool, char* data, bool pooled)
+            : _pool(pool), _data(data), _pooled(pooled)
+        {}
+
+    private:
+        buffer_pool* _pool = nullptr;
+        char* _data = nullptr;
+        bool _pooled = false;
+    };
+
+    buffer_pool();
+    explicit buffer_pool(options);
+
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    ~buffer_pool();
+
+    // The process wide pool.
+    static buffer_pool& global();
+
+    // Options of the process wide pool, false if it is already in use.
+    static bool set_global_options(const options&);
+
+    const options& get_options() const { return _options; }
+
+    size_t buffer_size() const { return _options.buffer_size; }
+
+    lease acquire();
+
+    stats get_stats() const;
+
+    // The memory mapped so far, one buffer per slab, e.g. to be registered
+    // as io_uring fixed buffers.
+    std::vector<asio::mutable_buffer> slabs() const;
+
+private:
+    struct slab {
+        char* data;
+        size_t size;
+        bool huge_pages;
+    };
+
+    struct thread_cache;
+    struct thread_caches;
+
+    void add_slab();
+    void put(char*);
+    void put_shared(char*);
+    thread_cache* local_cache();
+
+    static char* allocate(size_t, bool huge_pages, bool& got_huge_pages);
+    static void deallocate(char*, size_t);
+
+private:
+    const options _options;
+    // Tells thread caches of different pools apart, never reused.
+    const uint64_t _id;
+
+    mutable std::mutex _mutex;
+    std::vector<slab> _slabs;
+    // Released buffers, and those never leased.
+    std::vector<char*> _free;
+    std::vector<char*> _unused;
+    size_t _buffers = 0;
+
+    std::atomic<uint64_t> _leases{0};
+    std::atomic<uint64_t> _thread_cache_hits{0};
+    std::atomic<uint64_t> _shared_hits{0};
+    std::atomic<uint64_t> _unpooled{0};
+    std::atomic<size_t> _in_use{0};
+    std::atomic<size_t> _peak_in_use{0};
+};
+
+}} // namespaces
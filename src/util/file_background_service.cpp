@@ -0,0 +1,90 @@
+#include "file_background_service.h"
+
+#include <algorithm>
+
+namespace ouinet { namespace util {
+
+asio::execution_context::id file_background_service::id;
+
+file_background_service::file_background_service(asio::execution_context& ctx)
+    : file_background_service(ctx, options{})
+{}
+
+file_background_service::file_background_service( asio::execution_context& ctx
+                                                , options opts)
+    : asio::execution_context::service(ctx)
+    , _options(opts)
+    // Handlers without an associated executor complete on the io_context.
+    , _ioc(&static_cast<asio::io_context&>(ctx))
+{
+    unsigned n = std::max(1u, _options.threads);
+    _threads.reserve(n);
+    for (unsigned i = 0; i < n; ++i) {
+        _threads.emplace_back([this] { worker(); });
+    }
+}
+
+file_background_service::~file_background_service()
+{
+    shutdown();
+}
+
+void file_background_service::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopped) return;
+        _stopped = true;
+    }
+
+    _cv.notify_all();
+
+    // Jobs already running are let to finish (a blocking syscall can't be
+    // interrupted anyway), their completions are dropped by the io_context.
+    for (auto& t : _threads) t.join();
+    _threads.clear();
+
+    for (auto job : _queue) delete job;
+    _queue.clear();
+}
+
+file_background_service::stats file_background_service::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return stats{ _queue.size(), _max_queue_length, _running, _completed };
+}
+
+void file_background_service::push(detail::background_job* job)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(job);
+        _max_queue_length = std::max(_max_queue_length, _queue.size());
+    }
+    _cv.notify_one();
+}
+
+void file_background_service::worker()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _cv.wait(lock, [&] { return _stopped || !_queue.empty(); });
+
+        if (_stopped) return;
+
+        auto job = _queue.front();
+        _queue.pop_front();
+        ++_running;
+
+        lock.unlock();
+        job->run();
+        job->complete();
+        lock.lock();
+
+        --_running;
+        ++_completed;
+    }
+}
+
+}} // namespaces
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "../namespaces.h"
+
+namespace ouinet { namespace util {
+
+namespace detail {
+
+struct background_job {
+    // Runs on a worker thread.
+    virtual void run() = 0;
+    // Hands the result back to the initiator's executor.
+    virtual void complete() = 0;
+    virtual ~background_job() = default;
+};
+
+template<class Work, class Handler>
+struct background_handler_job : background_job {
+    using executor_type = asio::associated_executor_t<Handler, asio::io_context::executor_type>;
+
+    background_handler_job(Work w, Handler h, asio::io_context::executor_type ex)
+        : work(std::move(w))
+        , handler(std::move(h))
+        , guard(asio::get_associated_executor(handler, ex))
+    {}
+
+    void run() override { result = work(ec); }
+
+    void complete() override {
+        auto h = std::move(handler);
+        auto g = std::move(guard);
+        auto e = ec;
+        auto n = result;
+        delete this;
+        asio::post(g.get_executor(), [h = std::move(h), e, n] () mutable {
+            h(e, n);
+        });
+    }
+
+    Work work;
+    Handler handler;
+    asio::executor_work_guard<executor_type> guard;
+    sys::error_code ec;
+    size_t result = 0;
+};
+
+} // detail namespace
+
+// Runs blocking file system calls (pread, pwrite, ftruncate, fsync...) on a
+// bounded pool of worker threads so that they do not stall the io_context,
+// the POSIX counterpart of the Windows `file_background_service`.
+//
+// Used by `file_io` where io_uring is not available.  As with any asio
+// service, options must be given before it is first used:
+//
+//     asio::make_service<file_background_service>(ctx, file_background_service::options{8});
+class file_background_service : public asio::execution_context::service {
+public:
+    struct options {
+        // Number of worker threads.
+        unsigned threads = 4;
+    };
+
+    struct stats {
+        // Jobs waiting for a free worker.
+        size_t queue_length;
+        // Largest `queue_length` seen so far.
+        size_t max_queue_length;
+        // Jobs being run by a worker.
+        size_t running;
+        uint64_t completed;
+    };
+
+    static asio::execution_context::id id;
+
+    explicit file_background_service(asio::execution_context&);
+    file_background_service(asio::execution_context&, options);
+
+    file_background_service(const file_background_service&) = delete;
+    file_background_service& operator=(const file_background_service&) = delete;
+
+    ~file_background_service();
+
+    const options& get_options() const { return _options; }
+
+    stats get_stats() const;
+
+    // Run `work` (callable as `size_t(sys::error_code&)`) on a worker thread
+    // and complete with its error and result on the initiator's executor.
+    template<class Work, class Token>
+    auto async_run(Work&& work, Token&& token)
+    {
+        using Sig = void(sys::error_code, size_t);
+        asio::async_completion<Token, Sig> init(token);
+        using Handler = typename asio::async_completion<Token, Sig>::completion_handler_type;
+
+        push(new detail::background_handler_job<std::decay_t<Work>, Handler>(
+                    std::forward<Work>(work),
+                    std::move(init.completion_handler),
+                    _ioc->get_executor()));
+
+        return init.result.get();
+    }
+
+private:
+    void shutdown() override;
+
+    void push(detail::background_job*);
+    void worker();
+
+private:
+    options _options;
+    asio::io_context* _ioc;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<detail::background_job*> _queue;
+    std::vector<std::thread> _threads;
+    bool _stopped = false;
+
+    size_t _max_queue_length = 0;
+    size_t _running = 0;
+    uint64_t _completed = 0;
+};
+
+}} // namespaces
@@ -4,11 +4,43 @@
 #include <boost/asio/write_at.hpp>
 
 #include "file_io.h"
+#include "group_commit_service.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+#ifndef _WIN32
+#include <climits>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "file_background_service.h"
+#include "io_uring_service.h"
+#else
+#include <winioctl.h>
+#endif
 
 namespace ouinet { namespace util { namespace file_io {
 
 namespace errc = boost::system::errc;
 
+using detail::io_timer;
+
 static
 sys::error_code last_error()
 {
@@ -16,15 +48,52 @@ sys::error_code last_error()
 }
 
 void
-fseek(async_file_handle& file_handle, size_t pos, sys::error_code& ec)
+fseek(async_file_handle& file_handle, uint64_t pos, sys::error_code& ec)
 {
     if(!fseek_native(file_handle, pos))
     {
+#ifdef _WIN32
+        ec = sys::error_code(::GetLastError(), sys::system_category());
+#else
         ec = last_error();
+#endif
         if (!ec) ec = make_error_code(errc::no_message);
     }
 }
 
+void
+commit(async_file_handle& f
+      , Cancel& cancel
+      , asio::yield_context yield)
+{
+    io_timer timer(io_op::commit);
+    sys::error_code ec;
+    auto& service = asio::use_service<group_commit_service>(f.get_executor().context());
+    service.async_commit(f.native_handle(), yield[ec]);
+    timer.finish(f.native_handle(), 0, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+file_lock
+lock_range( async_file_handle& f
+          , uint64_t offset
+          , uint64_t length
+          , lock_mode mode
+          , Cancel& cancel
+          , asio::yield_context yield)
+{
+    auto& service = asio::use_service<file_lock_service>(f.get_executor().context());
+    auto h = f.native_handle();
+    // Only abort this request, other waiters on the file are left alone.
+    const void* tag = &cancel;
+    auto cancel_slot = cancel.connect([&service, tag] { service.cancel_request(tag); });
+
+    sys::error_code ec;
+    auto l = service.async_lock(h, offset, length, mode, tag, yield[ec]);
+    return_or_throw_on_error(yield, cancel, ec, file_lock());
+    return l;
+}
+
 bool
 check_or_create_directory(const fs::path& dir, sys::error_code& ec)
 {
@@ -53,68 +122,73 @@ check_or_create_directory(const fs::path& dir, sys::error_code& ec)
 void
 remove_file(const fs::path& p)
 {
-    if (!exists(p)) return;
-    assert(is_regular_file(p));
-    if (!is_regular_file(p)) return;
     sys::error_code ignored_ec;
-    fs::remove(p, ignored_ec);
+    remove_file(p, ignored_ec);
+}
+
+std::vector<sys::error_code>
+remove_files(const std::vector<fs::path>& paths)
+{
+    std::vector<sys::error_code> errors(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) remove_file(paths[i], errors[i]);
+    return errors;
 }
 
 #ifdef _WIN32
-bool
-fseek_native(async_file_handle& file_handle, size_t pos) {
-    native_handle_t native_handle = file_handle.native_handle();
-    bool success;
-    success = INVALID_SET_FILE_POINTER !=  SetFilePointer(native_handle, pos, NULL, FILE_BEGIN);
-    return success;
+static
+sys::error_code
+last_win_error()
+{
+    return sys::error_code(::GetLastError(), sys::system_category());
 }
 
-size_t
-current_position(async_file_handle& f, sys::error_code& ec)
+// SetFilePointer only takes and returns the low 32 bits unless
+// given a pointer for the high ones, the Ex variant avoids that.
+static
+uint64_t
+set_file_pointer(async_file_handle& f, uint64_t pos, DWORD method, sys::error_code& ec)
 {
-    native_handle_t native_handle = f.native_handle();
-    auto offset = SetFilePointer(native_handle, 0, NULL, FILE_CURRENT);
-    if(INVALID_SET_FILE_POINTER ==  offset)
-    {
-        ec = last_error();
-        if (!ec) ec = make_error_code(errc::no_message);
-        return size_t(-1);
+    LARGE_INTEGER distance, result;
+    distance.QuadPart = pos;
+    if (!::SetFilePointerEx(f.native_handle(), distance, &result, method)) {
+        ec = last_win_error();
+        return uint64_t(-1);
     }
+    return result.QuadPart;
+}
 
-    return offset;
+bool
+fseek_native(async_file_handle& file_handle, uint64_t pos) {
+    sys::error_code ec;
+    set_file_pointer(file_handle, pos, FILE_BEGIN, ec);
+    return !ec;
 }
 
-size_t
-end_position(async_file_handle& f, sys::error_code& ec)
+uint64_t
+current_position(async_file_handle& f, sys::error_code& ec)
 {
-    native_handle_t native_handle = f.native_handle();
-    auto offset = SetFilePointer(native_handle, 0, NULL, FILE_END);
-    if(INVALID_SET_FILE_POINTER ==  offset)
-    {
-        ec = last_error();
-        if (!ec) ec = make_error_code(errc::no_message);
-        return size_t(-1);
-    }
+    return set_file_pointer(f, 0, FILE_CURRENT, ec);
+}
 
-    return offset;
+uint64_t
+end_position(async_file_handle& f, sys::error_code& ec)
+{
+    return set_file_pointer(f, 0, FILE_END, ec);
 }
 
-size_t
+uint64_t
 file_size(async_file_handle& f, sys::error_code& ec)
 {
-    auto start_pos = current_position(f, ec);
-    if (ec) return size_t(-1);
-
-    auto end = end_position(f, ec);
-    if (ec) return size_t(-1);
-
-    fseek(f, start_pos, ec);
-    if (ec) return size_t(-1);
-
-    return end;
+    // Unlike seeking to the end, this leaves the file pointer alone.
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(f.native_handle(), &size)) {
+        ec = last_win_error();
+        return uint64_t(-1);
+    }
+    return size.QuadPart;
 }
 
-size_t
+uint64_t
 file_remaining_size(async_file_handle& f, sys::error_code& ec)
 {
     auto size = file_size(f, ec);
@@ -142,14 +216,25 @@ open(native_handle_t file, const asio::executor &exec, sys::error_code &ec) {
     return f;
 }
 
+static
+DWORD
+access_flags(const open_options& opts)
+{
+    return opts.pattern == access_pattern::random ? FILE_FLAG_RANDOM_ACCESS
+                                                  : FILE_FLAG_SEQUENTIAL_SCAN;
+}
+
 async_file_handle
-open_or_create(const asio::executor &exec, const fs::path &p, sys::error_code &ec) {
+open_or_create( const asio::executor &exec
+              , const fs::path &p
+              , sys::error_code &ec
+              , open_options opts) {
     native_handle_t file = ::CreateFile(p.string().c_str(),
                                GENERIC_READ | GENERIC_WRITE,       // DesiredAccess
                                FILE_SHARE_READ | FILE_SHARE_WRITE, // ShareMode
                                NULL,                  // SecurityAttributes
                                OPEN_ALWAYS,         // CreationDisposition
-                               FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, // FlagsAndAttributes
+                               FILE_FLAG_OVERLAPPED | access_flags(opts), // FlagsAndAttributes
                                NULL);                 // TemplateFile
 
     return open(file, exec, ec);
@@ -158,18 +243,91 @@ open_or_create(const asio::executor &exec, const fs::path &p, sys::error_code &e
 async_file_handle
 open_readonly( const asio::executor& exec
              , const fs::path& p
-             , sys::error_code& ec)
+             , sys::error_code& ec
+             , open_options opts)
 {
     native_handle_t file = ::CreateFile(p.string().c_str(),
                                GENERIC_READ,        // DesiredAccess
                                FILE_SHARE_READ,     // ShareMode
                                NULL,                // SecurityAttributes
                                OPEN_ALWAYS,         // CreationDisposition
-                               FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN | FILE_ATTRIBUTE_READONLY, // FlagsAndAttributes
+                               FILE_FLAG_OVERLAPPED | access_flags(opts) | FILE_ATTRIBUTE_READONLY, // FlagsAndAttributes
                                NULL);               // TemplateFile
     return open(file, exec, ec);
 }
 
+async_file_handle
+async_open_or_create( const asio::executor& exec
+                    , const fs::path& p
+                    , Cancel& cancel
+                    , asio::yield_context yield
+                    , open_options opts)
+{
+    io_timer timer(io_op::open);
+    sys::error_code ec;
+    auto f = open_or_create(exec, p, ec, opts);
+    timer.add_syscalls(1);
+    timer.finish(f.native_handle(), 0, ec);
+    return_or_throw_on_error(yield, cancel, ec, std::move(f));
+    return f;
+}
+
+async_file_handle
+async_open_readonly( const asio::executor& exec
+                   , const fs::path& p
+                   , Cancel& cancel
+                   , asio::yield_context yield
+                   , open_options opts)
+{
+    io_timer timer(io_op::open);
+    sys::error_code ec;
+    auto f = open_readonly(exec, p, ec, opts);
+    timer.add_syscalls(1);
+    timer.finish(f.native_handle(), 0, ec);
+    return_or_throw_on_error(yield, cancel, ec, std::move(f));
+    return f;
+}
+
+void
+async_close(async_file_handle& f, Cancel& cancel, asio::yield_context yield)
+{
+    io_timer timer(io_op::close);
+    auto h = f.native_handle();
+    sys::error_code ec;
+    f.close(ec);
+    timer.add_syscalls(1);
+    timer.finish(h, 0, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+bool
+is_direct(async_file_handle&, sys::error_code&)
+{
+    // FILE_FLAG_NO_BUFFERING is not used.
+    return false;
+}
+
+void
+advise(async_file_handle&, uint64_t, uint64_t, access_pattern, sys::error_code&)
+{
+    // Access patterns are given at CreateFile time on Windows.
+}
+
+void
+prefetch( async_file_handle&
+        , uint64_t
+        , uint64_t
+        , Cancel&
+        , asio::yield_context)
+{
+}
+
+void
+register_buffers(asio::io_context&, const buffer_pool&, sys::error_code& ec)
+{
+    ec = asio::error::operation_not_supported;
+}
+
 native_handle_t dup_fd(async_file_handle& f, sys::error_code& ec)
 {
     native_handle_t file;
@@ -190,25 +348,155 @@ native_handle_t dup_fd(async_file_handle& f, sys::error_code& ec)
 
 void
 truncate(async_file_handle& f
-        , size_t new_length
+        , uint64_t new_length
         , sys::error_code& ec)
 {
-    fseek(f, new_length, ec);
-    if (!::SetEndOfFile(f.native_handle())) {
+    set_file_pointer(f, new_length, FILE_BEGIN, ec);
+    if (ec) return;
+    if (!::SetEndOfFile(f.native_handle())) ec = last_win_error();
+}
+
+void
+truncate( async_file_handle& f
+        , uint64_t new_length
+        , Cancel& cancel
+        , asio::yield_context yield)
+{
+    io_timer timer(io_op::truncate);
+    sys::error_code ec;
+    truncate(f, new_length, ec);
+    timer.add_syscalls(2);
+    timer.finish(f.native_handle(), 0, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+fsync( async_file_handle& f
+     , Cancel& cancel
+     , asio::yield_context yield)
+{
+    io_timer timer(io_op::fsync);
+    sys::error_code ec;
+    if (!::FlushFileBuffers(f.native_handle())) {
         ec = last_error();
         if (!ec) ec = make_error_code(errc::no_message);
     }
+    timer.add_syscalls(1);
+    timer.finish(f.native_handle(), 0, ec);
+    return_or_throw_on_error(yield, cancel, ec);
 }
 
+static
+bool
+standard_info(HANDLE h, FILE_STANDARD_INFO& info, sys::error_code& ec)
+{
+    if (::GetFileInformationByHandleEx(h, FileStandardInfo, &info, sizeof(info))) return true;
+    ec = last_win_error();
+    return false;
+}
+
+static
 void
-read(async_file_handle& f
-    , asio::mutable_buffer b
-    , Cancel& cancel
-    , asio::yield_context yield)
+set_end_of_file(HANDLE h, uint64_t size, sys::error_code& ec)
+{
+    FILE_END_OF_FILE_INFO eof;
+    eof.EndOfFile.QuadPart = size;
+    if (!::SetFileInformationByHandle(h, FileEndOfFileInfo, &eof, sizeof(eof))) {
+        ec = last_win_error();
+    }
+}
+
+// Set the range to zeros, deallocating it if the file is sparse.
+static
+void
+set_zero_data(HANDLE h, uint64_t offset, uint64_t end, sys::error_code& ec)
+{
+    FILE_ZERO_DATA_INFORMATION zero;
+    zero.FileOffset.QuadPart = offset;
+    zero.BeyondFinalZero.QuadPart = end;
+    DWORD returned;
+    if (!::DeviceIoControl( h, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero)
+                          , nullptr, 0, &returned, nullptr)) {
+        ec = last_win_error();
+    }
+}
+
+// As with `truncate`, space is changed inline on Windows.
+void
+preallocate( async_file_handle& f
+           , uint64_t offset
+           , uint64_t length
+           , bool keep_size
+           , Cancel& cancel
+           , asio::yield_context yield)
+{
+    sys::error_code ec;
+    HANDLE h = f.native_handle();
+    FILE_STANDARD_INFO info;
+    uint64_t end = offset + length;
+    if (standard_info(h, info, ec) && uint64_t(info.AllocationSize.QuadPart) < end) {
+        // Allocating less than the file has would truncate it.
+        FILE_ALLOCATION_INFO alloc;
+        alloc.AllocationSize.QuadPart = end;
+        // Only a hint, the size is still grown below.
+        ::SetFileInformationByHandle(h, FileAllocationInfo, &alloc, sizeof(alloc));
+    }
+    if (!ec && !keep_size && uint64_t(info.EndOfFile.QuadPart) < end) {
+        set_end_of_file(h, end, ec);
+    }
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+punch_hole( async_file_handle& f
+          , uint64_t offset
+          , uint64_t length
+          , Cancel& cancel
+          , asio::yield_context yield)
+{
+    sys::error_code ec;
+    HANDLE h = f.native_handle();
+    FILE_STANDARD_INFO info;
+    if (standard_info(h, info, ec)) {
+        uint64_t end = std::min<uint64_t>(offset + length, info.EndOfFile.QuadPart);
+        DWORD returned;
+        // Without it the range is just overwritten with zeros.
+        ::DeviceIoControl(h, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+        if (offset < end) set_zero_data(h, offset, end, ec);
+    }
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+zero_range( async_file_handle& f
+          , uint64_t offset
+          , uint64_t length
+          , Cancel& cancel
+          , asio::yield_context yield)
+{
+    sys::error_code ec;
+    HANDLE h = f.native_handle();
+    FILE_STANDARD_INFO info;
+    uint64_t end = offset + length;
+    if (standard_info(h, info, ec) && uint64_t(info.EndOfFile.QuadPart) < end) {
+        set_end_of_file(h, end, ec);
+    }
+    if (!ec) set_zero_data(h, offset, end, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+read_at(async_file_handle& f
+       , asio::mutable_buffer b
+       , uint64_t offset
+       , Cancel& cancel
+       , asio::yield_context yield)
 {
-    auto cancel_slot = cancel.connect([&] { f.close(); });
+    io_timer timer(io_op::read);
+    auto cancel_slot = cancel.connect([&] { f.cancel(); });
     sys::error_code ec;
-    asio::async_read_at(f, 0, b, yield[ec]);
+    size_t n = asio::async_read_at(f, offset, b, yield[ec]);
+    timer.finish(f.native_handle(), n, ec);
     return_or_throw_on_error(yield, cancel, ec);
 }
 
@@ -219,33 +507,1841 @@ write_at(async_file_handle& f
         , Cancel& cancel
         , asio::yield_context yield)
 {
-    auto cancel_slot = cancel.connect([&] { f.close(); });
-    sys::error_code ec_write;
-    asio::async_write_at(f, offset, b, [&ec_write](const boost::system::error_code& ec,
-                                                   std::size_t bytes_transferred){ec_write = std::move(ec);});
-    return_or_throw_on_error(yield, cancel, ec_write);
+    io_timer timer(io_op::write);
+    auto cancel_slot = cancel.connect([&] { f.cancel(); });
+    sys::error_code ec;
+    size_t n = asio::async_write_at(f, offset, b, yield[ec]);
+    timer.finish(f.native_handle(), n, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+mapped_file::mapping::~mapping()
+{
+    if (data) ::UnmapViewOfFile(data);
 }
 
 void
-write_at_end(async_file_handle& f
-        , asio::const_buffer b
-        , Cancel& cancel
-        , asio::yield_context yield)
+mapped_file::advise(access_hint, sys::error_code&) const
+{
+    // Access hints are given at CreateFile time on Windows.
+}
+
+mapped_file
+map_readonly(const fs::path& p, sys::error_code& ec, map_options)
+{
+    HANDLE file = ::CreateFile(p.string().c_str(),
+                               GENERIC_READ,        // DesiredAccess
+                               FILE_SHARE_READ,     // ShareMode
+                               NULL,                // SecurityAttributes
+                               OPEN_EXISTING,       // CreationDisposition
+                               FILE_ATTRIBUTE_READONLY, // FlagsAndAttributes
+                               NULL);               // TemplateFile
+    if (file == INVALID_HANDLE_VALUE) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+        return mapped_file();
+    }
+
+    auto m = std::make_shared<mapped_file::mapping>();
+
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(file, &size)) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+        ::CloseHandle(file);
+        return mapped_file();
+    }
+
+    // Empty files can not be mapped.
+    if (size.QuadPart == 0) {
+        ::CloseHandle(file);
+        return mapped_file(std::move(m));
+    }
+
+    HANDLE map = ::CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map) {
+        m->data = static_cast<const char*>(::MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0));
+        m->size = size.QuadPart;
+    }
+    if (!m->data) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+    }
+    // The view keeps the file mapped.
+    if (map) ::CloseHandle(map);
+    ::CloseHandle(file);
+
+    if (ec) return mapped_file();
+    return mapped_file(std::move(m));
+}
+
+void
+remove_file(const fs::path& p, sys::error_code& ec)
 {
+    if (!::DeleteFileW(p.c_str())) {
+        ec = sys::error_code(::GetLastError(), sys::system_category());
+    }
+}
+
+// There is no background service on Windows, removals are done inline
+// like `truncate`.
+std::vector<sys::error_code>
+remove_files( const asio::executor&
+            , const std::vector<fs::path>& paths
+            , Cancel& cancel
+            , asio::yield_context yield)
+{
+    auto errors = remove_files(paths);
     sys::error_code ec;
-    uint64_t offset = end_position(f, ec);
-    write_at(f, b, offset, cancel, yield);
+    return_or_throw_on_error(yield, cancel, ec, std::move(errors));
+    return errors;
+}
+
+void
+remove_tree(const fs::path& p, sys::error_code& ec, unsigned)
+{
+    fs::remove_all(p, ec);
+}
+
+void
+remove_tree( const asio::executor&
+           , const fs::path& p
+           , Cancel& cancel
+           , asio::yield_context yield
+           , unsigned workers)
+{
+    sys::error_code ec;
+    remove_tree(p, ec, workers);
     return_or_throw_on_error(yield, cancel, ec);
 }
 
+namespace detail {
+
 void
-write(async_file_handle& f
-        , asio::const_buffer b
-        , Cancel& cancel
-        , asio::yield_context yield)
+async_read_at( async_file_handle& f
+             , asio::mutable_buffer b
+             , uint64_t offset
+             , read_handler h)
 {
-    write_at_end(f, b, cancel, yield);
+    asio::async_read_at(f, offset, b, std::move(h));
+}
+
+void
+read_v( async_file_handle& f
+      , const mutable_buffers& bufs
+      , uint64_t offset
+      , Cancel& cancel
+      , asio::yield_context yield)
+{
+    io_timer timer(io_op::read);
+    auto cancel_slot = cancel.connect([&] { f.cancel(); });
+    sys::error_code ec;
+    size_t n = asio::async_read_at(f, offset, bufs, yield[ec]);
+    timer.finish(f.native_handle(), n, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+write_v( async_file_handle& f
+       , const const_buffers& bufs
+       , uint64_t offset
+       , Cancel& cancel
+       , asio::yield_context yield)
+{
+    io_timer timer(io_op::write);
+    auto cancel_slot = cancel.connect([&] { f.cancel(); });
+    sys::error_code ec;
+    size_t n = asio::async_write_at(f, offset, bufs, yield[ec]);
+    timer.finish(f.native_handle(), n, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+} // detail namespace
+
+#else // POSIX
+
+static
+io_uring_service* uring(async_file_handle& f)
+{
+#ifdef OUINET_HAS_IO_URING
+    // The ring needs an io_context reactor to wait for completions.
+    auto ex = f.get_executor().target<asio::io_context::executor_type>();
+    if (!ex) return nullptr;
+    auto& s = asio::use_service<io_uring_service>(ex->context());
+    if (s.is_open()) return &s;
+#endif
+    return nullptr;
 }
 
+mapped_file::mapping::~mapping()
+{
+    if (data) ::munmap(const_cast<char*>(data), size);
+}
+
+static
+int madvise_flag(mapped_file::access_hint hint)
+{
+    switch (hint) {
+        case mapped_file::access_hint::sequential: return MADV_SEQUENTIAL;
+        case mapped_file::access_hint::random:     return MADV_RANDOM;
+        case mapped_file::access_hint::willneed:   return MADV_WILLNEED;
+        default:                                   return MADV_NORMAL;
+    }
+}
+
+void
+mapped_file::advise(access_hint hint, sys::error_code& ec) const
+{
+    if (!_mapping || !_mapping->data) return;
+    if (::madvise(const_cast<char*>(_mapping->data), _mapping->size, madvise_flag(hint)) == -1) {
+        ec = last_error();
+    }
+}
+
+mapped_file
+map_readonly(const fs::path& p, sys::error_code& ec, map_options opts)
+{
+    int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+        return mapped_file();
+    }
+
+    auto m = std::make_shared<mapped_file::mapping>();
+
+    struct stat st;
+    if (::fstat(fd, &st) == -1) {
+        ec = last_error();
+        ::close(fd);
+        return mapped_file();
+    }
+
+    // Does not fit in the address space (on 32-bit platforms).
+    if (uint64_t(st.st_size) > std::numeric_limits<size_t>::max()) {
+        ec = make_error_code(errc::file_too_large);
+        ::close(fd);
+        return mapped_file();
+    }
+
+    // Empty files can not be mapped.
+    if (st.st_size == 0) {
+        ::close(fd);
+        return mapped_file(std::move(m));
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (opts.populate) flags |= MAP_POPULATE;
 #endif
+
+    void* data = ::mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+    // The mapping keeps a reference to the file.
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        ec = last_error();
+        return mapped_file();
+    }
+
+    m->data = static_cast<const char*>(data);
+    m->size = st.st_size;
+
+    mapped_file mf(std::move(m));
+    if (opts.hint != mapped_file::access_hint::normal) {
+        sys::error_code ignored_ec;
+        mf.advise(opts.hint, ignored_ec);
+    }
+    return mf;
+}
+
+static
+file_background_service& background(async_file_handle& f)
+{
+    return asio::use_service<file_background_service>(f.get_executor().context());
+}
+
+static
+file_background_service& background(const asio::executor& ex)
+{
+    return asio::use_service<file_background_service>(ex.context());
+}
+
+// State shared by a blocking operation on the thread pool
+// and the coroutine waiting for it.
+struct blocking_op {
+    std::atomic<bool> abort{false};
+    unsigned syscalls = 0;
+    // Only set for operations being measured.
+    io_stats::clock::time_point started;
+};
+
+// Offsets are handed to lseek, pread, ftruncate and friends as they are.
+static_assert(sizeof(off_t) >= sizeof(uint64_t), "Build with _FILE_OFFSET_BITS=64");
+
+bool
+fseek_native(async_file_handle& f, uint64_t pos)
+{
+    return ::lseek(f.native_handle(), pos, SEEK_SET) != -1;
+}
+
+uint64_t
+current_position(async_file_handle& f, sys::error_code& ec)
+{
+    off_t offset = ::lseek(f.native_handle(), 0, SEEK_CUR);
+    if (offset == -1) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+        return uint64_t(-1);
+    }
+    return offset;
+}
+
+uint64_t
+end_position(async_file_handle& f, sys::error_code& ec)
+{
+    off_t offset = ::lseek(f.native_handle(), 0, SEEK_END);
+    if (offset == -1) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+        return uint64_t(-1);
+    }
+    return offset;
+}
+
+uint64_t
+file_size(async_file_handle& f, sys::error_code& ec)
+{
+    struct stat st;
+    if (::fstat(f.native_handle(), &st) == -1) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+        return uint64_t(-1);
+    }
+    return st.st_size;
+}
+
+uint64_t
+file_remaining_size(async_file_handle& f, sys::error_code& ec)
+{
+    auto size = file_size(f, ec);
+    if (ec) return 0;
+
+    auto pos = current_position(f, ec);
+    if (ec) return 0;
+
+    return size - pos;
+}
+
+static
+async_file_handle
+open(native_handle_t file, const asio::executor& exec, sys::error_code& ec)
+{
+    async_file_handle f = async_file_handle(exec);
+    if (file == -1) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+        return f;
+    }
+
+    // A new descriptor is at the start of the file already (seeking would
+    // fail on FIFOs and the like).
+    f.assign(file);
+
+    return f;
+}
+
+static
+bool
+fadvise(int fd, uint64_t offset, uint64_t length, access_pattern pattern)
+{
+#ifdef POSIX_FADV_NORMAL
+    int advice = POSIX_FADV_NORMAL;
+    switch (pattern) {
+        case access_pattern::normal:     advice = POSIX_FADV_NORMAL; break;
+        case access_pattern::sequential: advice = POSIX_FADV_SEQUENTIAL; break;
+        case access_pattern::random:     advice = POSIX_FADV_RANDOM; break;
+        case access_pattern::noreuse:    advice = POSIX_FADV_NOREUSE; break;
+        case access_pattern::willneed:   advice = POSIX_FADV_WILLNEED; break;
+        case access_pattern::dontneed:   advice = POSIX_FADV_DONTNEED; break;
+    }
+    // Returns the error instead of setting errno.
+    int err = ::posix_fadvise(fd, offset, length, advice);
+    if (err) errno = err;
+    return err == 0;
+#else
+    return true;
+#endif
+}
+
+static
+native_handle_t
+open_native(const fs::path& p, int flags, open_options opts)
+{
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+#ifdef O_NOATIME
+    if (opts.no_atime) flags |= O_NOATIME;
+#endif
+    auto try_open = [&] (int flags) {
+        native_handle_t file = ::open(p.c_str(), flags, mode);
+#ifdef O_NOATIME
+        // Not the owner of the file.
+        if (file == -1 && errno == EPERM && (flags & O_NOATIME)) {
+            file = ::open(p.c_str(), flags & ~O_NOATIME, mode);
+        }
+#endif
+        return file;
+    };
+    native_handle_t file = -1;
+#ifdef O_DIRECT
+    if (opts.direct) {
+        file = try_open(flags | O_DIRECT);
+        // The file system does not support direct I/O (e.g. tmpfs).
+        if (file == -1 && errno != EINVAL) return file;
+    }
+#endif
+    if (file == -1) file = try_open(flags);
+    if (file == -1) return file;
+#ifdef F_NOCACHE
+    if (opts.direct) ::fcntl(file, F_NOCACHE, 1);
+#endif
+    if (opts.pattern != access_pattern::normal) fadvise(file, 0, 0, opts.pattern);
+    if (opts.readahead) fadvise(file, 0, opts.readahead, access_pattern::willneed);
+    return file;
+}
+
+async_file_handle
+open_or_create( const asio::executor& exec
+              , const fs::path& p
+              , sys::error_code& ec
+              , open_options opts)
+{
+    native_handle_t file = open_native(p, O_RDWR | O_CREAT | O_CLOEXEC, opts);
+    return open(file, exec, ec);
+}
+
+async_file_handle
+open_readonly( const asio::executor& exec
+             , const fs::path& p
+             , sys::error_code& ec
+             , open_options opts)
+{
+    native_handle_t file = open_native(p, O_RDONLY | O_CLOEXEC, opts);
+    return open(file, exec, ec);
+}
+
+// State shared by an open on the thread pool and the coroutine waiting for it.
+struct open_job : blocking_op {
+    native_handle_t file = -1;
+};
+
+static
+async_file_handle
+async_open( const asio::executor& exec
+          , const fs::path& p
+          , int flags
+          , open_options opts
+          , Cancel& cancel
+          , asio::yield_context yield)
+{
+    io_timer timer(io_op::open);
+    bool measured = timer.enabled();
+    auto job = std::make_shared<open_job>();
+    auto cancel_slot = cancel.connect([job] { job->abort = true; });
+    sys::error_code ec;
+    background(exec).async_run([job, p, flags, opts, measured] (sys::error_code& ec) {
+            if (measured) job->started = io_stats::clock::now();
+            if (job->abort) {
+                ec = asio::error::operation_aborted;
+                return size_t(0);
+            }
+            ++job->syscalls;
+            job->file = open_native(p, flags, opts);
+            if (job->file == -1) ec = last_error();
+            return size_t(0);
+        }, yield[ec]);
+    if (measured) {
+        timer.dispatched(job->started);
+        timer.add_syscalls(job->syscalls);
+    }
+    timer.finish(job->file, 0, ec);
+
+    async_file_handle f(exec);
+    if (job->file != -1) {
+        // Cancelled while opening.
+        if (cancel) ::close(job->file);
+        else f = open(job->file, exec, ec);
+    }
+    return_or_throw_on_error(yield, cancel, ec, std::move(f));
+    return f;
+}
+
+async_file_handle
+async_open_or_create( const asio::executor& exec
+                    , const fs::path& p
+                    , Cancel& cancel
+                    , asio::yield_context yield
+                    , open_options opts)
+{
+    return async_open(exec, p, O_RDWR | O_CREAT | O_CLOEXEC, opts, cancel, yield);
+}
+
+async_file_handle
+async_open_readonly( const asio::executor& exec
+                   , const fs::path& p
+                   , Cancel& cancel
+                   , asio::yield_context yield
+                   , open_options opts)
+{
+    return async_open(exec, p, O_RDONLY | O_CLOEXEC, opts, cancel, yield);
+}
+
+void
+async_close(async_file_handle& f, Cancel& cancel, asio::yield_context yield)
+{
+    if (!f.is_open()) return;
+    io_timer timer(io_op::close);
+    auto op = timer.enabled() ? std::make_shared<blocking_op>() : nullptr;
+    // The descriptor is ours from now on (see the header about pending
+    // operations).
+    int fd = f.release();
+    sys::error_code ec;
+    background(f).async_run([fd, op] (sys::error_code& ec) {
+            if (op) op->started = io_stats::clock::now();
+            // Not retried on EINTR, as the descriptor is released anyway.
+            if (::close(fd) == -1) ec = last_error();
+            return size_t(0);
+        }, yield[ec]);
+    if (op) {
+        timer.dispatched(op->started);
+        timer.add_syscalls(1);
+    }
+    timer.finish(fd, 0, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+register_buffers(asio::io_context& ctx, const buffer_pool& pool, sys::error_code& ec)
+{
+    auto& s = asio::use_service<io_uring_service>(ctx);
+    if (!s.is_open()) {
+        ec = asio::error::operation_not_supported;
+        return;
+    }
+    s.register_buffers(pool.slabs(), ec);
+}
+
+static
+bool
+is_direct_fd(int fd)
+{
+#ifdef O_DIRECT
+    int flags = ::fcntl(fd, F_GETFL);
+    return flags != -1 && (flags & O_DIRECT);
+#else
+    // F_NOCACHE has no alignment constraints.
+    return false;
+#endif
+}
+
+bool
+is_direct(async_file_handle& f, sys::error_code& ec)
+{
+    int flags = ::fcntl(f.native_handle(), F_GETFL);
+    if (flags == -1) {
+        ec = last_error();
+        return false;
+    }
+#ifdef O_DIRECT
+    return flags & O_DIRECT;
+#else
+    return false;
+#endif
+}
+
+void
+advise( async_file_handle& f
+      , uint64_t offset
+      , uint64_t length
+      , access_pattern pattern
+      , sys::error_code& ec)
+{
+    if (!fadvise(f.native_handle(), offset, length, pattern)) ec = last_error();
+}
+
+// Bytes handed to a single readahead call, so that cancellation is
+// noticed in between.
+static const uint64_t prefetch_chunk = 16 << 20;
+
+void
+prefetch( async_file_handle& f
+        , uint64_t offset
+        , uint64_t length
+        , Cancel& cancel
+        , asio::yield_context yield)
+{
+    auto op = std::make_shared<blocking_op>();
+    auto cancel_slot = cancel.connect([op] { op->abort = true; });
+    int fd = f.native_handle();
+    sys::error_code ec;
+    background(f).async_run([op, fd, offset, length] (sys::error_code& ec) {
+            for (uint64_t done = 0; done < length && !ec; done += prefetch_chunk) {
+                if (op->abort) {
+                    ec = asio::error::operation_aborted;
+                    break;
+                }
+                auto n = std::min(prefetch_chunk, length - done);
+#ifdef __linux__
+                // EINVAL if the file does not support it (e.g. a pipe).
+                if (::readahead(fd, offset + done, n) == 0) continue;
+                if (errno != EINVAL) {
+                    ec = last_error();
+                    break;
+                }
+#endif
+                if (!fadvise(fd, offset + done, n, access_pattern::willneed)) {
+                    ec = last_error();
+                }
+            }
+            return size_t(0);
+        }, yield[ec]);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+native_handle_t dup_fd(async_file_handle& f, sys::error_code& ec)
+{
+    native_handle_t file = ::dup(f.native_handle());
+    if (file == -1) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+    }
+    return file;
+}
+
+void
+truncate( async_file_handle& f
+        , uint64_t new_length
+        , sys::error_code& ec)
+{
+    // IORING_OP_FTRUNCATE only exists in recent kernels,
+    // and changing the length of a file does not touch the disk anyway.
+    if (::ftruncate(f.native_handle(), new_length) == -1) {
+        ec = last_error();
+        if (!ec) ec = make_error_code(errc::no_message);
+    }
+}
+
+void
+truncate( async_file_handle& f
+        , uint64_t new_length
+        , Cancel& cancel
+        , asio::yield_context yield)
+{
+    io_timer timer(io_op::truncate);
+    auto op = timer.enabled() ? std::make_shared<blocking_op>() : nullptr;
+    sys::error_code ec;
+    int fd = f.native_handle();
+    background(f).async_run([fd, new_length, op] (sys::error_code& ec) {
+            if (op) op->started = io_stats::clock::now();
+            if (::ftruncate(fd, new_length) == -1) ec = last_error();
+            return size_t(0);
+        }, yield[ec]);
+    if (op) {
+        timer.dispatched(op->started);
+        timer.add_syscalls(1);
+    }
+    timer.finish(fd, 0, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+fsync( async_file_handle& f
+     , Cancel& cancel
+     , asio::yield_context yield)
+{
+    io_timer timer(io_op::fsync);
+    auto op = timer.enabled() ? std::make_shared<blocking_op>() : nullptr;
+    sys::error_code ec;
+    int fd = f.native_handle();
+    background(f).async_run([fd, op] (sys::error_code& ec) {
+            if (op) op->started = io_stats::clock::now();
+            while (true) {
+                if (op) ++op->syscalls;
+                if (::fsync(fd) != -1) break;
+                if (errno == EINTR) continue;
+                ec = last_error();
+                break;
+            }
+            return size_t(0);
+        }, yield[ec]);
+    if (op) {
+        timer.dispatched(op->started);
+        timer.add_syscalls(op->syscalls);
+    }
+    timer.finish(fd, 0, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+remove_file(const fs::path& p, sys::error_code& ec)
+{
+    // Directories are left alone by unlink(2).
+    if (::unlink(p.c_str()) == -1) ec = last_error();
+}
+
+std::vector<sys::error_code>
+remove_files( const asio::executor& exec
+            , const std::vector<fs::path>& paths
+            , Cancel& cancel
+            , asio::yield_context yield)
+{
+    auto op = std::make_shared<blocking_op>();
+    auto cancel_slot = cancel.connect([op] { op->abort = true; });
+    auto errors = std::make_shared<std::vector<sys::error_code>>(paths.size());
+    sys::error_code ec;
+    background(exec).async_run([op, errors, paths] (sys::error_code& ec) {
+            for (size_t i = 0; i < paths.size(); ++i) {
+                if (op->abort) {
+                    ec = asio::error::operation_aborted;
+                    break;
+                }
+                remove_file(paths[i], (*errors)[i]);
+            }
+            return size_t(0);
+        }, yield[ec]);
+    return_or_throw_on_error(yield, cancel, ec, std::move(*errors));
+    return std::move(*errors);
+}
+
+namespace {
+
+// A directory being emptied by `remove_tree`.  It is removed itself once it
+// has been read and all its subdirectories are gone.
+struct tree_dir {
+    tree_dir(std::shared_ptr<tree_dir> parent, std::string path)
+        : parent(std::move(parent)), path(std::move(path))
+    {}
+
+    std::shared_ptr<tree_dir> parent;
+    std::string path;
+    // Its own read plus its subdirectories not removed yet.
+    std::atomic<size_t> pending{1};
+};
+
+// Workers take directories from a shared stack, remove the entries of each
+// one relative to its descriptor and push its subdirectories for any worker
+// to take on.
+class tree_remover {
+public:
+    explicit tree_remover(const std::atomic<bool>& abort)
+        : _abort(abort)
+    {}
+
+    void run(std::string root, unsigned workers, sys::error_code& ec)
+    {
+        _pending.push_back(std::make_shared<tree_dir>(nullptr, std::move(root)));
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < workers; ++i) {
+            threads.emplace_back([this] { work(); });
+        }
+        work();
+        for (auto& t : threads) t.join();
+
+        ec = _ec;
+    }
+
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _cv.wait(lock, [&] { return _ec || !_pending.empty() || _busy == 0; });
+            if (_ec || _pending.empty()) break;
+            auto dir = std::move(_pending.back());
+            _pending.pop_back();
+            ++_busy;
+            lock.unlock();
+
+            sys::error_code ec;
+            std::vector<std::shared_ptr<tree_dir>> subdirs;
+            empty(dir, subdirs, ec);
+            if (!ec) {
+                dir->pending += subdirs.size();
+                finished(std::move(dir), ec);
+            }
+
+            lock.lock();
+            --_busy;
+            if (ec) {
+                if (!_ec) _ec = ec;
+            } else {
+                for (auto& d : subdirs) _pending.push_back(std::move(d));
+            }
+            _cv.notify_all();
+        }
+    }
+
+    // Remove every entry of the directory but its subdirectories.
+    void empty( const std::shared_ptr<tree_dir>& dir
+              , std::vector<std::shared_ptr<tree_dir>>& subdirs
+              , sys::error_code& ec)
+    {
+        int dfd = ::open(dir->path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dfd == -1) {
+            // Removed meanwhile by someone else.
+            if (errno != ENOENT) ec = last_error();
+            return;
+        }
+        DIR* d = ::fdopendir(dfd);
+        if (!d) {
+            ec = last_error();
+            ::close(dfd);
+            return;
+        }
+
+        while (true) {
+            errno = 0;
+            struct dirent* e = ::readdir(d);
+            if (!e) {
+                if (errno) ec = last_error();
+                break;
+            }
+            const char* name = e->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+            if (_abort) {
+                ec = asio::error::operation_aborted;
+                break;
+            }
+
+            if (e->d_type != DT_DIR) {
+                if (::unlinkat(dfd, name, 0) == 0 || errno == ENOENT) continue;
+                // Only file systems not telling entry types get here
+                // with a directory.
+                int err = errno;
+                struct stat st;
+                if ( e->d_type != DT_UNKNOWN
+                  || ::fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1
+                  || !S_ISDIR(st.st_mode)) {
+                    ec = make_error_code(static_cast<errc::errc_t>(err));
+                    break;
+                }
+            }
+            subdirs.push_back(std::make_shared<tree_dir>(dir, dir->path + "/" + name));
+        }
+        ::closedir(d);
+    }
+
+    // One of the things the directory was waiting for is done, remove it
+    // (and then its parent...) if it was the last one.
+    void finished(std::shared_ptr<tree_dir> dir, sys::error_code& ec)
+    {
+        for (; dir && --dir->pending == 0; dir = dir->parent) {
+            if (::rmdir(dir->path.c_str()) == -1 && errno != ENOENT) {
+                ec = last_error();
+                return;
+            }
+        }
+    }
+
+private:
+    const std::atomic<bool>& _abort;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::vector<std::shared_ptr<tree_dir>> _pending;
+    size_t _busy = 0;
+    sys::error_code _ec;
+};
+
+} // anonymous namespace
+
+static
+void
+remove_tree( const fs::path& p
+           , unsigned workers
+           , const std::atomic<bool>& abort
+           , sys::error_code& ec)
+{
+    struct stat st;
+    if (::lstat(p.c_str(), &st) == -1) {
+        if (errno != ENOENT) ec = last_error();
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (::unlink(p.c_str()) == -1 && errno != ENOENT) ec = last_error();
+        return;
+    }
+    tree_remover(abort).run(p.string(), std::max(1u, workers), ec);
+}
+
+void
+remove_tree(const fs::path& p, sys::error_code& ec, unsigned workers)
+{
+    std::atomic<bool> abort{false};
+    remove_tree(p, workers, abort, ec);
+}
+
+void
+remove_tree( const asio::executor& exec
+           , const fs::path& p
+           , Cancel& cancel
+           , asio::yield_context yield
+           , unsigned workers)
+{
+    // The job runs on a single thread of the background service,
+    // from which the other workers are started.
+    auto op = std::make_shared<blocking_op>();
+    auto cancel_slot = cancel.connect([op] { op->abort = true; });
+    sys::error_code ec;
+    background(exec).async_run([op, p, workers] (sys::error_code& ec) {
+            remove_tree(p, workers, op->abort, ec);
+            return size_t(0);
+        }, yield[ec]);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+// Returns the number of bytes transferred.
+static
+size_t
+blocking_io_at( bool is_read
+              , int fd
+              , std::vector<iovec> iov
+              , uint64_t offset
+              , blocking_op* op
+              , sys::error_code& ec)
+{
+    auto i = iov.begin();
+    size_t transferred = 0;
+
+    while (i != iov.end()) {
+        if (op && op->abort) {
+            ec = asio::error::operation_aborted;
+            break;
+        }
+        if (op) ++op->syscalls;
+        int n = std::min<size_t>(iov.end() - i, IOV_MAX);
+        ssize_t r = is_read ? ::preadv(fd, &*i, n, offset)
+                            : ::pwritev(fd, &*i, n, offset);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            ec = last_error();
+            break;
+        }
+        if (r == 0) {
+            ec = is_read ? asio::error::eof : make_error_code(errc::io_error);
+            break;
+        }
+        offset += r;
+        transferred += r;
+        for (; i != iov.end() && size_t(r) >= i->iov_len; ++i) r -= i->iov_len;
+        if (r) {
+            i->iov_base = static_cast<char*>(i->iov_base) + r;
+            i->iov_len -= r;
+        }
+    }
+
+    return transferred;
+}
+
+// Copy `n` bytes between `p` and the buffers, starting `skip` bytes into them.
+static
+void
+copy_iov(const std::vector<iovec>& iov, size_t skip, char* p, size_t n, bool to_iov)
+{
+    for (auto& v : iov) {
+        if (n == 0) break;
+        if (skip >= v.iov_len) {
+            skip -= v.iov_len;
+            continue;
+        }
+        size_t m = std::min(n, v.iov_len - skip);
+        auto b = static_cast<char*>(v.iov_base) + skip;
+        if (to_iov) std::memcpy(b, p, m);
+        else        std::memcpy(p, b, m);
+        p += m;
+        n -= m;
+        skip = 0;
+    }
+}
+
+// Read or write a whole aligned range, a short read (zero filled) means
+// the end of the file.  Returns the number of bytes read or written.
+static
+size_t
+pread_or_pwrite(bool is_read, int fd, char* p, size_t n, uint64_t offset, sys::error_code& ec)
+{
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = is_read ? ::pread(fd, p + done, n - done, offset + done)
+                            : ::pwrite(fd, p + done, n - done, offset + done);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            ec = last_error();
+            break;
+        }
+        if (r == 0) break;
+        done += r;
+    }
+    if (is_read) std::memset(p + done, 0, n - done);
+    return done;
+}
+
+// Transfer through an aligned bounce buffer what the kernel rejected for not
+// being aligned as direct I/O requires.  Writes read the blocks they only
+// partly cover first, and the file is truncated back if writing whole blocks
+// made it grow further than the data.  Returns the number of bytes
+// transferred.
+static
+size_t
+direct_io_at( bool is_read
+            , int fd
+            , std::vector<iovec> iov
+            , uint64_t offset
+            , blocking_op* op
+            , sys::error_code& ec)
+{
+    static constexpr size_t align = direct_alignment;
+    static constexpr size_t window = 64 * align;
+
+    size_t total = 0;
+    for (auto& v : iov) total += v.iov_len;
+
+    void* mem = nullptr;
+    if (::posix_memalign(&mem, align, window) != 0) {
+        ec = make_error_code(errc::not_enough_memory);
+        return 0;
+    }
+    std::unique_ptr<void, void(*)(void*)> bounce(mem, ::free);
+    auto buf = static_cast<char*>(mem);
+
+    uint64_t old_size = 0;
+    if (!is_read) {
+        struct stat st;
+        if (::fstat(fd, &st) == -1) {
+            ec = last_error();
+            return 0;
+        }
+        old_size = st.st_size;
+    }
+
+    size_t done = 0;
+    uint64_t written_end = 0;
+
+    while (done < total) {
+        if (op && op->abort) {
+            ec = asio::error::operation_aborted;
+            break;
+        }
+
+        uint64_t pos = offset + done;
+        uint64_t start = pos & ~uint64_t(align - 1);
+        size_t skip = pos - start;
+        size_t len = std::min(total - done, window - skip);
+        size_t span = (skip + len + align - 1) & ~(align - 1);
+
+        if (is_read) {
+            if (op) ++op->syscalls;
+            size_t r = pread_or_pwrite(true, fd, buf, span, start, ec);
+            if (ec) break;
+            size_t n = r > skip ? std::min(len, r - skip) : 0;
+            copy_iov(iov, done, buf + skip, n, true);
+            done += n;
+            if (n < len) {
+                ec = asio::error::eof;
+                break;
+            }
+            continue;
+        }
+
+        // Keep what the partly covered blocks at either end already hold.
+        if (skip) {
+            if (op) ++op->syscalls;
+            pread_or_pwrite(true, fd, buf, align, start, ec);
+        }
+        if (!ec && (skip + len) % align && (span > align || !skip)) {
+            if (op) ++op->syscalls;
+            pread_or_pwrite(true, fd, buf + span - align, align, start + span - align, ec);
+        }
+        if (ec) break;
+
+        copy_iov(iov, done, buf + skip, len, false);
+
+        if (op) ++op->syscalls;
+        size_t w = pread_or_pwrite(false, fd, buf, span, start, ec);
+        if (ec) break;
+        if (w < span) {
+            ec = make_error_code(errc::io_error);
+            break;
+        }
+        done += len;
+        written_end = start + span;
+    }
+
+    uint64_t data_end = std::max(old_size, offset + done);
+    if (written_end > data_end && ::ftruncate(fd, data_end) == -1 && !ec) {
+        ec = last_error();
+    }
+
+    return done;
+}
+
+template<class BufferSequence>
+static
+std::vector<iovec>
+to_iovecs(const BufferSequence& bufs)
+{
+    std::vector<iovec> iov;
+    for (auto i = asio::buffer_sequence_begin(bufs); i != asio::buffer_sequence_end(bufs); ++i) {
+        auto b = asio::buffer(*i);
+        if (b.size() == 0) continue;
+        iov.push_back({ const_cast<void*>(static_cast<const void*>(b.data())), b.size() });
+    }
+    return iov;
+}
+
+// Retry on the thread pool a transfer on a file opened for direct I/O
+// which was not aligned.
+static
+size_t
+unaligned_direct_io_at( bool is_read
+                      , async_file_handle& f
+                      , std::vector<iovec> iov
+                      , uint64_t offset
+                      , Cancel& cancel
+                      , asio::yield_context yield)
+{
+    auto op = std::make_shared<blocking_op>();
+    auto cancel_slot = cancel.connect([op] { op->abort = true; });
+    int fd = f.native_handle();
+    sys::error_code ec;
+    size_t n = background(f).async_run([=, iov = std::move(iov)] (sys::error_code& ec) {
+            return direct_io_at(is_read, fd, std::move(iov), offset, op.get(), ec);
+        }, yield[ec]);
+    return or_throw(yield, ec, n);
+}
+
+// Transfer the whole buffer sequence at the given offset, through io_uring
+// if available, otherwise with blocking calls on the background thread pool.
+template<class BufferSequence>
+static
+void
+io_at( bool is_read
+     , async_file_handle& f
+     , const BufferSequence& bufs
+     , uint64_t offset
+     , Cancel& cancel
+     , asio::yield_context yield)
+{
+    sys::error_code ec;
+    io_timer timer(is_read ? io_op::read : io_op::write);
+    int fd = f.native_handle();
+    size_t n = 0;
+
+    if (auto s = uring(f)) {
+        // Only this operation is cancelled, the file stays open for others.
+        const void* tag = &ec;
+        auto cancel_slot = cancel.connect([s, tag] { s->cancel(tag); });
+        util::detail::io_uring_trace trace;
+        auto t = timer.enabled() ? &trace : nullptr;
+        if (is_read) {
+            n = s->async_read_at(fd, offset, bufs, tag, t, yield[ec]);
+        } else {
+            n = s->async_write_at(fd, offset, bufs, tag, t, yield[ec]);
+        }
+        if (trace.submissions) {
+            timer.dispatched(trace.submitted);
+            timer.add_syscalls(trace.submissions);
+        }
+    } else {
+        // The worker gives up before its next call (or before starting if
+        // the job is still queued), a call already blocked on the file is
+        // let finish.
+        auto op = std::make_shared<blocking_op>();
+        auto cancel_slot = cancel.connect([op] { op->abort = true; });
+        bool measured = timer.enabled();
+        n = background(f).async_run([=, iov = to_iovecs(bufs)] (sys::error_code& ec) {
+                if (measured) op->started = io_stats::clock::now();
+                return blocking_io_at(is_read, fd, std::move(iov), offset, op.get(), ec);
+            }, yield[ec]);
+        if (measured) {
+            timer.dispatched(op->started);
+            timer.add_syscalls(op->syscalls);
+        }
+    }
+
+    if (ec == errc::invalid_argument && !cancel && is_direct_fd(fd)) {
+        ec = {};
+        n = unaligned_direct_io_at(is_read, f, to_iovecs(bufs), offset, cancel, yield[ec]);
+    }
+
+    timer.finish(fd, n, ec);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+read_at(async_file_handle& f
+       , asio::mutable_buffer b
+       , uint64_t offset
+       , Cancel& cancel
+       , asio::yield_context yield)
+{
+    io_at(true, f, b, offset, cancel, yield);
+}
+
+void
+write_at(async_file_handle& f
+        , asio::const_buffer b
+        , uint64_t offset
+        , Cancel& cancel
+        , asio::yield_context yield)
+{
+    io_at(false, f, b, offset, cancel, yield);
+}
+
+namespace detail {
+
+void
+async_read_at( async_file_handle& f
+             , asio::mutable_buffer b
+             , uint64_t offset
+             , read_handler h)
+{
+    int fd = f.native_handle();
+    auto pool = &background(f);
+
+    // Retry unaligned reads on files opened for direct I/O.
+    auto handler = [fd, b, offset, pool, h = std::move(h)]
+                   (const sys::error_code& ec, size_t n) {
+        if (ec != errc::invalid_argument || !is_direct_fd(fd)) return h(ec, n);
+        pool->async_run([fd, b, offset] (sys::error_code& ec) {
+                return direct_io_at(true, fd, {{b.data(), b.size()}}, offset, nullptr, ec);
+            }, h);
+    };
+
+    if (auto s = uring(f)) {
+        s->async_read_at(fd, offset, b, std::move(handler));
+        return;
+    }
+
+    pool->async_run([fd, b, offset] (sys::error_code& ec) {
+            return blocking_io_at(true, fd, {{b.data(), b.size()}}, offset, nullptr, ec);
+        }, std::move(handler));
+}
+
+void
+read_v( async_file_handle& f
+      , const mutable_buffers& bufs
+      , uint64_t offset
+      , Cancel& cancel
+      , asio::yield_context yield)
+{
+    io_at(true, f, bufs, offset, cancel, yield);
+}
+
+void
+write_v( async_file_handle& f
+       , const const_buffers& bufs
+       , uint64_t offset
+       , Cancel& cancel
+       , asio::yield_context yield)
+{
+    io_at(false, f, bufs, offset, cancel, yield);
+}
+
+} // detail namespace
+
+static
+bool
+is_fallocate_unsupported(int err)
+{
+    return err == EOPNOTSUPP || err == ENOTSUP || err == ENOSYS;
+}
+
+// Write zeros over the range, for file systems which can not deallocate or
+// zero it in place.
+static
+void
+write_zeros(int fd, uint64_t offset, uint64_t length, blocking_op* op, sys::error_code& ec)
+{
+    std::vector<char> zeros(std::min<uint64_t>(length, 1 << 20));
+    while (length && !ec) {
+        if (op->abort) {
+            ec = asio::error::operation_aborted;
+            break;
+        }
+        size_t n = std::min<uint64_t>(length, zeros.size());
+        ++op->syscalls;
+        pread_or_pwrite(false, fd, zeros.data(), n, offset, ec);
+        offset += n;
+        length -= n;
+    }
+}
+
+static
+uint64_t
+fd_size(int fd, sys::error_code& ec)
+{
+    struct stat st;
+    if (::fstat(fd, &st) == -1) {
+        ec = last_error();
+        return 0;
+    }
+    return st.st_size;
+}
+
+enum class space_op { preallocate, preallocate_keep_size, punch_hole, zero_range };
+
+// Blocking part of `preallocate`, `punch_hole` and `zero_range`.
+static
+void
+change_space( int fd
+            , space_op what
+            , uint64_t offset
+            , uint64_t length
+            , blocking_op* op
+            , sys::error_code& ec)
+{
+#ifdef __linux__
+    int mode = 0;
+    switch (what) {
+        case space_op::preallocate:           mode = 0; break;
+        case space_op::preallocate_keep_size: mode = FALLOC_FL_KEEP_SIZE; break;
+        case space_op::punch_hole:            mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE; break;
+        case space_op::zero_range:            mode = FALLOC_FL_ZERO_RANGE; break;
+    }
+    while (true) {
+        ++op->syscalls;
+        if (::fallocate(fd, mode, offset, length) == 0) return;
+        if (errno == EINTR) continue;
+        if (!is_fallocate_unsupported(errno)) {
+            ec = last_error();
+            return;
+        }
+        break;
+    }
+#endif
+
+    uint64_t size = fd_size(fd, ec);
+    if (ec) return;
+    uint64_t end = offset + length;
+
+    switch (what) {
+        case space_op::preallocate_keep_size:
+            // Only a hint.
+            break;
+        case space_op::preallocate:
+            if (size < end && ::ftruncate(fd, end) == -1) ec = last_error();
+            break;
+        case space_op::punch_hole:
+            if (offset < size) write_zeros(fd, offset, std::min(end, size) - offset, op, ec);
+            break;
+        case space_op::zero_range:
+            write_zeros(fd, offset, length, op, ec);
+            break;
+    }
+}
+
+static
+void
+change_space( async_file_handle& f
+            , space_op what
+            , uint64_t offset
+            , uint64_t length
+            , Cancel& cancel
+            , asio::yield_context yield)
+{
+    auto op = std::make_shared<blocking_op>();
+    auto cancel_slot = cancel.connect([op] { op->abort = true; });
+    int fd = f.native_handle();
+    sys::error_code ec;
+    background(f).async_run([op, fd, what, offset, length] (sys::error_code& ec) {
+            change_space(fd, what, offset, length, op.get(), ec);
+            return size_t(0);
+        }, yield[ec]);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+preallocate( async_file_handle& f
+           , uint64_t offset
+           , uint64_t length
+           , bool keep_size
+           , Cancel& cancel
+           , asio::yield_context yield)
+{
+    auto what = keep_size ? space_op::preallocate_keep_size : space_op::preallocate;
+    change_space(f, what, offset, length, cancel, yield);
+}
+
+void
+punch_hole( async_file_handle& f
+          , uint64_t offset
+          , uint64_t length
+          , Cancel& cancel
+          , asio::yield_context yield)
+{
+    change_space(f, space_op::punch_hole, offset, length, cancel, yield);
+}
+
+void
+zero_range( async_file_handle& f
+          , uint64_t offset
+          , uint64_t length
+          , Cancel& cancel
+          , asio::yield_context yield)
+{
+    change_space(f, space_op::zero_range, offset, length, cancel, yield);
+}
+
+// Data copied by a single copy_file_range call, so that cancellation is
+// noticed in between.
+static const size_t copy_chunk = 16 << 20;
+
+struct copy_job : blocking_op {
+    copy_method method = copy_method::read_write;
+};
+
+// Errors of copy methods not supported for a pair of files (or kernel).
+static
+bool
+is_copy_unsupported(int err)
+{
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP
+        || err == EINVAL || err == EBADF;
+}
+
+// Copy as much of the range as the kernel can without going through user
+// space, sharing extents or else with copy_file_range, and setting the
+// method tried last.  Returns the number of bytes copied, which may fall
+// short of the range without error if the method is not supported or the
+// source ends.
+static
+uint64_t
+copy_in_kernel(int in, int out, const copy_range& r, copy_job* op, sys::error_code& ec)
+{
+#ifdef FICLONERANGE
+    op->method = copy_method::reflink;
+    struct file_clone_range clone = {};
+    clone.src_fd = in;
+    clone.src_offset = r.src_offset;
+    clone.src_length = r.length;
+    clone.dest_offset = r.dst_offset;
+    ++op->syscalls;
+    // Fails as well if the range is not aligned to file system blocks.
+    if (::ioctl(out, FICLONERANGE, &clone) == 0) return r.length;
+#endif
+#ifdef __NR_copy_file_range
+    op->method = copy_method::copy_file_range;
+    uint64_t done = 0;
+    while (done < r.length) {
+        if (op->abort) {
+            ec = asio::error::operation_aborted;
+            break;
+        }
+        loff_t in_offset = r.src_offset + done;
+        loff_t out_offset = r.dst_offset + done;
+        size_t n = std::min<uint64_t>(r.length - done, copy_chunk);
+        ++op->syscalls;
+        ssize_t c = ::syscall(__NR_copy_file_range, in, &in_offset, out, &out_offset, n, 0u);
+        if (c == -1) {
+            if (errno == EINTR) continue;
+            if (!is_copy_unsupported(errno)) ec = last_error();
+            break;
+        }
+        if (c == 0) break;
+        done += c;
+    }
+    return done;
+#else
+    return 0;
+#endif
+}
+
+static
+uint64_t
+copy_in_kernel( async_file_handle& src
+              , async_file_handle& dst
+              , const copy_range& r
+              , copy_method& method
+              , io_timer& timer
+              , Cancel& cancel
+              , asio::yield_context yield)
+{
+    auto op = std::make_shared<copy_job>();
+    auto cancel_slot = cancel.connect([op] { op->abort = true; });
+    bool measured = timer.enabled();
+    int in = src.native_handle();
+    int out = dst.native_handle();
+    sys::error_code ec;
+    uint64_t n = background(dst).async_run([op, in, out, r, measured] (sys::error_code& ec) {
+            if (measured) op->started = io_stats::clock::now();
+            return copy_in_kernel(in, out, r, op.get(), ec);
+        }, yield[ec]);
+    if (measured) {
+        timer.dispatched(op->started);
+        timer.add_syscalls(op->syscalls);
+    }
+    method = op->method;
+    return or_throw(yield, ec, n);
+}
+
+#ifdef __linux__
+// Data handed to a single sendfile call, which sends less if the socket
+// buffer fills up.
+static const size_t send_chunk = 4 << 20;
+
+// Send as much of the range as sendfile(2) can, setting `unsupported` if the
+// file does not support it before anything was sent.
+static
+uint64_t
+send_in_kernel( async_file_handle& f
+              , uint64_t offset
+              , uint64_t length
+              , asio::ip::tcp::socket& s
+              , bool& unsupported
+              , io_timer& timer
+              , Cancel& cancel
+              , asio::yield_context yield)
+{
+    sys::error_code ec;
+    s.native_non_blocking(true, ec);
+    if (ec) return or_throw(yield, ec, uint64_t(0));
+
+    auto op = std::make_shared<blocking_op>();
+    auto cancel_slot = cancel.connect([op, &s] {
+            op->abort = true;
+            s.cancel();
+        });
+    int in = f.native_handle();
+    int out = s.native_handle();
+    uint64_t done = 0;
+
+    while (done < length) {
+        if (op->abort) {
+            ec = asio::error::operation_aborted;
+            break;
+        }
+        uint64_t at = offset + done;
+        size_t n = std::min<uint64_t>(length - done, send_chunk);
+        size_t sent = background(f).async_run([op, in, out, at, n] (sys::error_code& ec) {
+                while (true) {
+                    ++op->syscalls;
+                    off_t o = at;
+                    ssize_t r = ::sendfile(out, in, &o, n);
+                    if (r != -1) return size_t(r);
+                    if (errno == EINTR) continue;
+                    ec = last_error();
+                    return size_t(0);
+                }
+            }, yield[ec]);
+        done += sent;
+
+        if (ec == errc::operation_would_block || ec == errc::resource_unavailable_try_again) {
+            ec = {};
+        } else if ((ec == errc::invalid_argument || ec == errc::function_not_supported) && done == 0) {
+            // e.g. file systems without page cache backed reads.
+            unsupported = true;
+            ec = {};
+            break;
+        } else if (ec) {
+            break;
+        } else if (sent == 0) {
+            ec = asio::error::eof;
+            break;
+        } else if (sent == n) {
+            continue;
+        }
+
+        // The socket buffer is full.
+        s.async_wait(asio::ip::tcp::socket::wait_write, yield[ec]);
+        if (ec) break;
+    }
+
+    timer.add_syscalls(op->syscalls);
+    return or_throw(yield, ec, done);
+}
+#endif
+
+#endif
+
+static
+io_op
+to_io_op(copy_method m)
+{
+    switch (m) {
+        case copy_method::reflink:         return io_op::copy_reflink;
+        case copy_method::copy_file_range: return io_op::copy_file_range;
+        case copy_method::read_write:      return io_op::copy_read_write;
+    }
+    return io_op::copy_read_write;
+}
+
+const char*
+to_string(copy_method m)
+{
+    switch (m) {
+        case copy_method::reflink:         return "reflink";
+        case copy_method::copy_file_range: return "copy_file_range";
+        case copy_method::read_write:      return "read_write";
+    }
+    return "unknown";
+}
+
+copy_result
+copy( async_file_handle& src
+    , async_file_handle& dst
+    , copy_range range
+    , Cancel& cancel
+    , asio::yield_context yield)
+{
+    io_timer timer(io_op::copy_read_write);
+    sys::error_code ec;
+    copy_result result;
+
+    if (range.length == 0) {
+        auto size = file_size(src, ec);
+        if (size > range.src_offset) range.length = size - range.src_offset;
+    }
+
+#ifndef _WIN32
+    if (!ec && range.length) {
+        result.bytes = copy_in_kernel(src, dst, range, result.method, timer, cancel, yield[ec]);
+    }
+#endif
+
+    // Whatever the kernel could not copy by itself.
+    if (!ec && result.bytes < range.length) {
+        result.method = copy_method::read_write;
+        auto lease = buffer_pool::global().acquire();
+        while (result.bytes < range.length) {
+            size_t n = std::min<uint64_t>(lease.size(), range.length - result.bytes);
+            auto b = asio::buffer(lease.data(), n);
+            read_at(src, b, range.src_offset + result.bytes, cancel, yield[ec]);
+            if (ec) break;
+            write_at(dst, b, range.dst_offset + result.bytes, cancel, yield[ec]);
+            if (ec) break;
+            result.bytes += n;
+        }
+    }
+
+    timer.set_op(to_io_op(result.method));
+    timer.finish(dst.native_handle(), result.bytes, ec);
+    return_or_throw_on_error(yield, cancel, ec, result);
+    return result;
+}
+
+uint64_t
+send_range( async_file_handle& f
+          , uint64_t offset
+          , uint64_t length
+          , asio::ip::tcp::socket& s
+          , Cancel& cancel
+          , asio::yield_context yield)
+{
+    io_timer timer(io_op::send);
+    sys::error_code ec;
+    uint64_t done = 0;
+    bool unsupported = true;
+
+#ifdef __linux__
+    unsupported = false;
+    done = send_in_kernel(f, offset, length, s, unsupported, timer, cancel, yield[ec]);
+#endif
+
+    if (unsupported && !ec) {
+        auto cancel_slot = cancel.connect([&s] { s.cancel(); });
+        auto lease = buffer_pool::global().acquire();
+        while (done < length) {
+            size_t n = std::min<uint64_t>(lease.size(), length - done);
+            auto b = asio::buffer(lease.data(), n);
+            read_at(f, b, offset + done, cancel, yield[ec]);
+            if (ec) break;
+            asio::async_write(s, b, yield[ec]);
+            if (ec) break;
+            done += n;
+        }
+    }
+
+    timer.finish(f.native_handle(), done, ec);
+    return_or_throw_on_error(yield, cancel, ec, done);
+    return done;
+}
+
+void
+read(async_file_handle& f
+    , asio::mutable_buffer b
+    , Cancel& cancel
+    , asio::yield_context yield)
+{
+    read_at(f, b, 0, cancel, yield);
+}
+
+buffered_reader::chunk::chunk(size_t size)
+{
+    auto& pool = buffer_pool::global();
+    if (size <= pool.buffer_size()) {
+        lease = pool.acquire();
+    } else {
+        heap.resize(size);
+    }
+}
+
+buffered_reader::buffered_reader( async_file_handle& f
+                                , uint64_t offset
+                                , size_t chunk_size)
+    : _file(f)
+    , _state(std::make_shared<state>(f.get_executor(), chunk_size))
+    , _offset(offset)
+    , _ahead_offset(offset)
+{
+    read_ahead();
+}
+
+buffered_reader::~buffered_reader()
+{
+    // A read ahead may still be in flight, it keeps the state alive.
+}
+
+void
+buffered_reader::read_ahead()
+{
+    auto st = _state;
+    st->pending = true;
+    st->ahead_size = 0;
+    st->ahead_ec = {};
+
+    detail::async_read_at( _file
+                         , asio::buffer(st->ahead.data(), st->chunk_size)
+                         , _ahead_offset
+                         , [st] (const sys::error_code& ec, size_t n) {
+                               st->pending = false;
+                               st->ahead_ec = ec;
+                               st->ahead_size = n;
+                               st->ready.cancel();
+                           });
+}
+
+void
+buffered_reader::read( asio::mutable_buffer b
+                     , Cancel& cancel
+                     , asio::yield_context yield)
+{
+    auto& st = *_state;
+    auto out = static_cast<char*>(b.data());
+    size_t left = b.size();
+
+    while (left) {
+        if (_current_pos < _current_end) {
+            size_t n = std::min(left, _current_end - _current_pos);
+            std::memcpy(out, st.current.data() + _current_pos, n);
+            _current_pos += n;
+            _offset += n;
+            out += n;
+            left -= n;
+            continue;
+        }
+
+        if (st.pending) {
+            auto cancel_slot = cancel.connect([&] { st.ready.cancel(); });
+            st.ready.expires_at(std::chrono::steady_clock::time_point::max());
+            sys::error_code ec;
+            st.ready.async_wait(yield[ec]);
+            if (cancel) return or_throw(yield, asio::error::operation_aborted);
+            if (st.pending) continue;
+        }
+
+        if (st.ahead_size == 0) {
+            auto ec = st.ahead_ec ? st.ahead_ec : asio::error::eof;
+            return or_throw(yield, ec);
+        }
+
+        // Hand the chunk over to the consumer and go for the next one
+        // while it is being consumed.
+        std::swap(st.current, st.ahead);
+        _current_pos = 0;
+        _current_end = st.ahead_size;
+        _ahead_offset += st.ahead_size;
+
+        if (!st.ahead_ec) {
+            read_ahead();
+        } else {
+            st.ahead_size = 0;
+        }
+    }
+}
+
+void
+write_at_end(async_file_handle& f
+        , asio::const_buffer b
+        , Cancel& cancel
+        , asio::yield_context yield)
+{
+    sys::error_code ec;
+    uint64_t offset = end_position(f, ec);
+    write_at(f, b, offset, cancel, yield);
+    return_or_throw_on_error(yield, cancel, ec);
+}
+
+void
+write(async_file_handle& f
+        , asio::const_buffer b
+        , Cancel& cancel
+        , asio::yield_context yield)
+{
+    write_at_end(f, b, cancel, yield);
+}
+
+append_handle::append_handle(async_file_handle f, sys::error_code& ec)
+    : _file(std::move(f))
+    , _tail(0)
+{
+    sync_tail(ec);
+}
+
+append_handle::append_handle(append_handle&& other)
+    : _file(std::move(other._file))
+    , _tail(other._tail.load())
+{}
+
+append_handle&
+append_handle::operator=(append_handle&& other)
+{
+    _file = std::move(other._file);
+    _tail = other._tail.load();
+    return *this;
+}
+
+void
+append_handle::sync_tail(sys::error_code& ec)
+{
+    if (!_file.is_open()) return;
+    auto size = file_size(_file, ec);
+    if (!ec) _tail = size;
+}
+
+append_handle
+open_for_append(const asio::executor& exec, const fs::path& p, sys::error_code& ec)
+{
+    return append_handle(open_or_create(exec, p, ec), ec);
+}
+
+void
+write(append_handle& f
+        , asio::const_buffer b
+        , Cancel& cancel
+        , asio::yield_context yield)
+{
+    write_at(f.file(), b, f.reserve(b.size()), cancel, yield);
+}
+
+void
+truncate(append_handle& f
+        , uint64_t new_length
+        , sys::error_code& ec)
+{
+    truncate(f.file(), new_length, ec);
+    if (ec) return;
+    f.sync_tail(ec);
+}
+
 }}} // namespaces
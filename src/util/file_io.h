@@ -5,9 +5,22 @@
 #else
 #include <boost/asio/posix/stream_descriptor.hpp>
 #endif
+#include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/endian/conversion.hpp>
 #include <boost/filesystem.hpp>
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "file_io_stats.h"
+#include "file_lock_service.h"
 #include "signal.h"
 #include "../namespaces.h"
 #include "../or_throw.h"
@@ -22,11 +35,112 @@ using native_handle_t = int;
 
 namespace ouinet { namespace util { namespace file_io {
 
+// Alignment of offsets, lengths and buffers which direct transfers
+// are carried out without a bounce buffer for.
+constexpr size_t direct_alignment = 4096;
+
+// How a range of a file is going to be accessed, see posix_fadvise(2).
+enum class access_pattern {
+    normal,
+    // Read ahead more aggressively.
+    sequential,
+    // Do not read ahead at all, e.g. for lookups of small records.
+    random,
+    // Data is read once, so keeping it cached is not worth it.
+    noreuse,
+    // Start reading the range into the page cache.
+    willneed,
+    // Drop the range from the page cache, e.g. behind a scan.
+    dontneed,
+};
+
+struct open_options {
+    // Bypass the page cache (O_DIRECT on Linux, F_NOCACHE on macOS), e.g.
+    // for large objects written once and seldom read back, so that they do
+    // not evict hot data.  Positional transfers not aligned to
+    // `direct_alignment` go through an aligned bounce buffer instead,
+    // reading and writing back whole blocks at either end; concurrent
+    // unaligned writes sharing a block must thus be serialised (e.g. with
+    // `lock_range`).  Where the file system rejects direct I/O (e.g. tmpfs)
+    // the file is opened as usual, see `is_direct`.  Ignored on Windows.
+    bool direct = false;
+    // Expected access to the whole file, given right after opening it.
+    access_pattern pattern = access_pattern::normal;
+    // Do not update the access time of the file when reading it (O_NOATIME),
+    // saving a metadata write per read in cache scans.  Only the owner of a
+    // file may ask for it; for other files it is silently dropped.
+    bool no_atime = false;
+    // Bytes from the start of the file to begin reading into the page cache
+    // right after opening it, without waiting for them.
+    uint64_t readahead = 0;
+};
+
 async_file_handle
-open_or_create(const asio::executor&, const fs::path&, sys::error_code&);
+open_or_create( const asio::executor&
+              , const fs::path&
+              , sys::error_code&
+              , open_options = {});
 
 async_file_handle
-open_readonly(const asio::executor&, const fs::path&, sys::error_code&);
+open_readonly( const asio::executor&
+             , const fs::path&
+             , sys::error_code&
+             , open_options = {});
+
+// Same as above, but the file is opened on a worker thread (see
+// `file_background_service`), so that resolving a path (e.g. with a cold
+// dentry cache or in a directory with a huge number of entries) does not
+// stall other coroutines.  Cancelling makes them fail with
+// `operation_aborted` once the open call returns, closing the file if it
+// got opened; an open which has not started yet is skipped.  On Windows
+// the file is opened inline.
+async_file_handle
+async_open_or_create( const asio::executor&
+                    , const fs::path&
+                    , Cancel&
+                    , asio::yield_context
+                    , open_options = {});
+
+async_file_handle
+async_open_readonly( const asio::executor&
+                   , const fs::path&
+                   , Cancel&
+                   , asio::yield_context
+                   , open_options = {});
+
+// Close the file on a worker thread, since close(2) may block (e.g. to
+// flush data on network file systems).  The handle is left closed even if
+// closing fails or is cancelled.
+//
+// As with `close`, no operations may be pending on the handle: those going
+// through io_uring or the thread pool only know the descriptor number, so
+// once it is reused by another open they could land in an unrelated file.
+void async_close(async_file_handle&, Cancel&, asio::yield_context);
+
+// Whether transfers on the file are subject to the alignment constraints of
+// direct I/O, i.e. it was opened with `open_options::direct` and the
+// file system supports O_DIRECT.
+bool is_direct(async_file_handle&, sys::error_code&);
+
+// Tell the kernel how `length` bytes of the file from `offset` (up to its end
+// if `length` is zero) are going to be accessed.  This is only a hint, so it
+// does nothing where it is not supported (e.g. Windows, where the pattern is
+// given at CreateFile time).
+void advise( async_file_handle&
+           , uint64_t offset
+           , uint64_t length
+           , access_pattern
+           , sys::error_code&);
+
+// Read a range of the file into the page cache (readahead(2), or
+// POSIX_FADV_WILLNEED elsewhere), so that later reads of it do not wait for
+// the disk.  The range is read in the background; cancelling stops before
+// the next chunk of it.  Does nothing on Windows.
+void prefetch( async_file_handle&
+             , uint64_t offset
+             , uint64_t length
+             , Cancel&
+             , asio::yield_context);
 
 // Duplicate the descriptor, see dup(2).
 // The descriptor shares offset and flags with that of the original file,
@@ -34,27 +148,102 @@ open_readonly(const asio::executor&, const fs::path&, sys::error_code&);
 // so it must be closed separately.
 native_handle_t dup_fd(async_file_handle&, sys::error_code&);
 
-void fseek(async_file_handle&, size_t pos, sys::error_code&);
+// Positions and sizes are 64-bit, also on 32-bit platforms.
+void fseek(async_file_handle&, uint64_t pos, sys::error_code&);
 
-bool fseek_native(async_file_handle&, size_t pos);
+bool fseek_native(async_file_handle&, uint64_t pos);
 
-size_t current_position(async_file_handle&, sys::error_code&);
+uint64_t current_position(async_file_handle&, sys::error_code&);
 
-size_t end_position(async_file_handle& f, sys::error_code& ec);
+uint64_t end_position(async_file_handle& f, sys::error_code& ec);
 
-size_t file_size(async_file_handle&, sys::error_code&);
+uint64_t file_size(async_file_handle&, sys::error_code&);
 
-size_t file_remaining_size(async_file_handle&, sys::error_code&);
+uint64_t file_remaining_size(async_file_handle&, sys::error_code&);
 
 void truncate( async_file_handle&
-             , size_t new_length
+             , uint64_t new_length
              , sys::error_code&);
 
+// Same as above but without blocking the caller's thread.
+void truncate( async_file_handle&
+             , uint64_t new_length
+             , Cancel&
+             , asio::yield_context);
+
+// Reserve disk space for `length` bytes of the file from `offset`, so that
+// writing them later does not fail for lack of space nor fragment the file
+// (fallocate(2)).  Unless `keep_size`, the file grows to cover the range.
+// Where space can not be reserved this only grows the file as needed.
+void preallocate( async_file_handle&
+                , uint64_t offset
+                , uint64_t length
+                , bool keep_size
+                , Cancel&
+                , asio::yield_context);
+
+// Free the disk blocks of a range of the file, which then reads as zeros,
+// without changing its size (FALLOC_FL_PUNCH_HOLE, or FSCTL_SET_ZERO_DATA
+// on a sparse file on Windows).  Where holes are not supported the range
+// is overwritten with zeros instead.
+void punch_hole( async_file_handle&
+               , uint64_t offset
+               , uint64_t length
+               , Cancel&
+               , asio::yield_context);
+
+// Make a range of the file read as zeros while keeping its blocks allocated
+// (FALLOC_FL_ZERO_RANGE), growing the file if the range goes past its end.
+// Where that is not supported zeros are written over the range.
+void zero_range( async_file_handle&
+               , uint64_t offset
+               , uint64_t length
+               , Cancel&
+               , asio::yield_context);
+
+// Flush data and metadata of the file to the storage device,
+// see fsync(2) and FlushFileBuffers.
+void fsync( async_file_handle&
+          , Cancel&
+          , asio::yield_context);
+
+// Wait until data written to the file so far is durable.  Unlike `fsync`,
+// concurrent callers are grouped so that a batch of them costs a single
+// flush per file, see `group_commit_service`.
+void commit( async_file_handle&
+           , Cancel&
+           , asio::yield_context);
+
+// Lock `length` bytes of the file (zero for up to its end and beyond)
+// starting at `offset`, waiting while a conflicting lock is held by this or
+// another process, see `file_lock_service`.  The range stays locked until
+// the returned lock is released or destroyed, which must happen before the
+// file is closed.  Cancelling only aborts the wait.
+file_lock lock_range( async_file_handle&
+                    , uint64_t offset
+                    , uint64_t length
+                    , lock_mode
+                    , Cancel&
+                    , asio::yield_context);
+
+// Fill the buffer with data from the beginning of the file.
 void read( async_file_handle&
          , asio::mutable_buffer
          , Cancel&
          , asio::yield_context);
 
+// Fill the buffer with data from the given offset of the file.
+//
+// Cancelling this or any of the positional operations below aborts just that
+// operation with `operation_aborted`; the file stays open and other operations
+// on it go on (on Windows, other operations pending on the same handle are
+// aborted too).
+void read_at( async_file_handle&
+            , asio::mutable_buffer
+            , uint64_t offset
+            , Cancel&
+            , asio::yield_context);
+
 void write( async_file_handle&
           , asio::const_buffer
           , Cancel&
@@ -66,11 +255,265 @@ void write_at( async_file_handle&
              , Cancel&
              , asio::yield_context);
 
+namespace detail {
+
+using mutable_buffers = boost::container::small_vector<asio::mutable_buffer, 4>;
+using const_buffers = boost::container::small_vector<asio::const_buffer, 4>;
+
+using read_handler = std::function<void(const sys::error_code&, size_t)>;
+
+// Start reading the whole buffer from the offset, the handler is called
+// from the file's executor with the number of bytes read.
+void async_read_at( async_file_handle&
+                  , asio::mutable_buffer
+                  , uint64_t offset
+                  , read_handler);
+
+void read_v( async_file_handle&
+           , const mutable_buffers&
+           , uint64_t offset
+           , Cancel&
+           , asio::yield_context);
+
+void write_v( async_file_handle&
+            , const const_buffers&
+            , uint64_t offset
+            , Cancel&
+            , asio::yield_context);
+
+} // detail namespace
+
+// Scatter/gather versions of `read_at` and `write_at`: the whole buffer
+// sequence is transferred in a single vectored operation (preadv/pwritev or
+// one readv/writev ring entry) instead of one operation per buffer.
+template<class MutableBufferSequence>
+void read_v( async_file_handle& f
+           , const MutableBufferSequence& bufs
+           , uint64_t offset
+           , Cancel& cancel
+           , asio::yield_context yield)
+{
+    detail::read_v( f
+                  , detail::mutable_buffers( asio::buffer_sequence_begin(bufs)
+                                           , asio::buffer_sequence_end(bufs))
+                  , offset, cancel, yield);
+}
+
+template<class ConstBufferSequence>
+void write_v( async_file_handle& f
+            , const ConstBufferSequence& bufs
+            , uint64_t offset
+            , Cancel& cancel
+            , asio::yield_context yield)
+{
+    detail::write_v( f
+                   , detail::const_buffers( asio::buffer_sequence_begin(bufs)
+                                          , asio::buffer_sequence_end(bufs))
+                   , offset, cancel, yield);
+}
+
+// How `copy` moved the data, fastest first.
+enum class copy_method {
+    // Extents shared with the source (FICLONERANGE, e.g. on Btrfs or XFS),
+    // no data is copied until either file is modified.
+    reflink,
+    // Copied by the kernel (copy_file_range), maybe by the storage itself.
+    copy_file_range,
+    // Read into a pooled buffer and written back.
+    read_write,
+};
+
+const char* to_string(copy_method);
+
+struct copy_range {
+    uint64_t src_offset = 0;
+    uint64_t dst_offset = 0;
+    // Zero for up to the end of the source.
+    uint64_t length = 0;
+};
+
+struct copy_result {
+    uint64_t bytes = 0;
+    // The method which copied the data (or the rest of it, if a faster one
+    // gave up halfway).
+    copy_method method = copy_method::read_write;
+};
+
+// Copy a range of `src` into `dst`, trying the methods of `copy_method` in
+// order until one is supported for both files, so that data only goes
+// through user space as a last resort.  The copy is recorded in `io_stats`
+// (against `dst`) under the operation of the method used, e.g.
+// `io_op::copy_file_range`, so that throughput can be compared per method.
+// A range going past the end of the source fails with `eof`, once what
+// there is has been copied.  Only read and write are available on Windows.
+copy_result copy( async_file_handle& src
+                , async_file_handle& dst
+                , copy_range
+                , Cancel&
+                , asio::yield_context);
+
+// Send `length` bytes of the file from `offset` to the socket, returning the
+// number of bytes sent.  On Linux the data goes from the page cache to the
+// socket with sendfile(2), which splices it through a pipe internal to the
+// kernel, on worker threads of the background service so that reading cold
+// data does not block the caller's thread; the socket is made non-blocking
+// and partial sends wait for it to be writable.  Elsewhere, or if the file
+// does not support it, the data is read into a pooled buffer and written to
+// the socket.  Fails with `eof` if the file ends before the range does.
+//
+// Cancelling also cancels any other operation pending on the socket.
+uint64_t send_range( async_file_handle&
+                   , uint64_t offset
+                   , uint64_t length
+                   , asio::ip::tcp::socket&
+                   , Cancel&
+                   , asio::yield_context);
+
+// Reads a file sequentially in large chunks, the next chunk being read
+// ahead while the current one is consumed, so that parsing many small
+// fields does not issue one operation per field.  Chunks up to the size of
+// the global `buffer_pool`'s buffers are leased from it.
+//
+// The file handle must outlive the reader.  Cancelling a read
+// does not close the file (the read ahead just completes in the background).
+class buffered_reader {
+public:
+    // Same as `stellar::fs::bufsz()`, an AWS EBS IOP.
+    static constexpr size_t default_chunk_size = 0x40000;
+
+    buffered_reader( async_file_handle&
+                   , uint64_t offset = 0
+                   , size_t chunk_size = default_chunk_size);
+
+    buffered_reader(const buffered_reader&) = delete;
+    buffered_reader& operator=(const buffered_reader&) = delete;
+
+    ~buffered_reader();
+
+    // Fill the whole buffer, fails with `asio::error::eof`
+    // if the file ends before.
+    void read(asio::mutable_buffer, Cancel&, asio::yield_context);
+
+    // Offset in the file of the next byte to be read.
+    uint64_t offset() const { return _offset; }
+
+private:
+    struct chunk {
+        explicit chunk(size_t size);
+
+        char* data() { return lease ? lease.data() : heap.data(); }
+
+        buffer_pool::lease lease;
+        std::vector<char> heap;
+    };
+
+    struct state {
+        state(const asio::executor& ex, size_t chunk_size)
+            : chunk_size(chunk_size), current(chunk_size), ahead(chunk_size), ready(ex)
+        {}
+
+        size_t chunk_size;
+        chunk current;
+        chunk ahead;
+        // Cancelled when the read ahead completes.
+        asio::steady_timer ready;
+        bool pending = false;
+        sys::error_code ahead_ec;
+        size_t ahead_size = 0;
+    };
+
+    void read_ahead();
+
+private:
+    async_file_handle& _file;
+    // Shared with the read ahead in flight.
+    std::shared_ptr<state> _state;
+    uint64_t _offset;
+    uint64_t _ahead_offset;
+    size_t _current_pos = 0;
+    size_t _current_end = 0;
+};
+
+// A file handle for appending which keeps the end of the file in memory,
+// so that appending does not need to query the end position first, and
+// concurrent appenders are each given their own region of the file.
+//
+// The tail is synchronised with the file size when the handle is created
+// and when it is truncated through `truncate(append_handle&, ...)`,
+// so the file must not grow or shrink through other handles meanwhile.
+class append_handle {
+public:
+    append_handle(async_file_handle, sys::error_code&);
+
+    append_handle(append_handle&&);
+    append_handle& operator=(append_handle&&);
+
+    async_file_handle& file() { return _file; }
+
+    uint64_t tail() const { return _tail.load(); }
+
+    // Reserve `size` bytes at the end of the file, return their offset.
+    uint64_t reserve(size_t size) { return _tail.fetch_add(size); }
+
+    // Read the tail back from the file size.
+    void sync_tail(sys::error_code&);
+
+private:
+    async_file_handle _file;
+    std::atomic<uint64_t> _tail;
+};
+
+append_handle
+open_for_append(const asio::executor&, const fs::path&, sys::error_code&);
+
+// Write at the offset reserved for the buffer at the tail.  If the write
+// fails the reserved region is not given back, so it stays as a hole
+// unless the file is truncated.
+void write( append_handle&
+          , asio::const_buffer
+          , Cancel&
+          , asio::yield_context);
+
+void truncate( append_handle&
+             , uint64_t new_length
+             , sys::error_code&);
+
+// Have reads and writes of single buffers leased from the pool skip mapping
+// them on every operation, through io_uring fixed buffers.  Only the slabs
+// mapped so far are registered (see `buffer_pool::options::initial_buffers`),
+// replacing any earlier registration for the context.  Fails with
+// `operation_not_supported` where io_uring is not used.
+void register_buffers(asio::io_context&, const buffer_pool&, sys::error_code&);
+
 // Check whether the directory exists, if not, try to create it.
 // If the directory doesn't exist nor it can be created, the error
 // code is set. Returns true if the directory has been created.
 bool check_or_create_directory(const fs::path&, sys::error_code&);
 
+namespace detail {
+
+// Numbers are stored in little endian order on disk.  On little endian hosts
+// this is a no-op, otherwise the loop is simple enough for the compiler to
+// vectorize (e.g. into byte shuffles).
+template<typename T>
+void little_to_native_inplace(T* nums, size_t count)
+{
+    static_assert(std::is_integral<T>::value, "only integers can be converted");
+    if (boost::endian::order::native == boost::endian::order::little) return;
+    for (size_t i = 0; i < count; ++i) {
+        nums[i] = boost::endian::endian_reverse(nums[i]);
+    }
+}
+
+template<typename T>
+void native_to_little_inplace(T* nums, size_t count)
+{
+    // Byte swapping is its own inverse.
+    little_to_native_inplace(nums, count);
+}
+
+} // detail namespace
+
 template<typename T>
 T read_number( async_file_handle& f
              , Cancel& cancel
@@ -78,8 +521,20 @@ T read_number( async_file_handle& f
 {
     T num;
     sys::error_code ec;
-    // TODO: endianness? (also for writing)
     read(f, asio::buffer(&num, sizeof(num)), cancel, yield[ec]);
+    if (!ec) detail::little_to_native_inplace(&num, 1);
+    return or_throw<T>(yield, ec, std::move(num));
+}
+
+template<typename T>
+T read_number( buffered_reader& r
+             , Cancel& cancel
+             , asio::yield_context yield)
+{
+    T num;
+    sys::error_code ec;
+    r.read(asio::buffer(&num, sizeof(num)), cancel, yield[ec]);
+    if (!ec) detail::little_to_native_inplace(&num, 1);
     return or_throw<T>(yield, ec, std::move(num));
 }
 
@@ -90,11 +545,136 @@ void write_number( async_file_handle& f
                  , asio::yield_context yield)
 {
     sys::error_code ec;
-    // TODO: endianness? (also for reading)
+    detail::native_to_little_inplace(&num, 1);
     write(f, asio::buffer(&num, sizeof(num)), cancel, yield[ec]);
     return or_throw(yield, ec);
 }
 
+// Array versions of the above, the whole array is moved in a single
+// operation.  On a plain file handle they take the offset of the array in
+// the file, as `read_at` and `write_at` do.
+template<typename T>
+void read_numbers( async_file_handle& f
+                 , T* nums
+                 , size_t count
+                 , uint64_t offset
+                 , Cancel& cancel
+                 , asio::yield_context yield)
+{
+    sys::error_code ec;
+    read_at(f, asio::buffer(nums, count * sizeof(T)), offset, cancel, yield[ec]);
+    if (!ec) detail::little_to_native_inplace(nums, count);
+    return or_throw(yield, ec);
+}
+
+template<typename T>
+void read_numbers( buffered_reader& r
+                 , T* nums
+                 , size_t count
+                 , Cancel& cancel
+                 , asio::yield_context yield)
+{
+    sys::error_code ec;
+    r.read(asio::buffer(nums, count * sizeof(T)), cancel, yield[ec]);
+    if (!ec) detail::little_to_native_inplace(nums, count);
+    return or_throw(yield, ec);
+}
+
+template<typename T>
+void write_numbers( async_file_handle& f
+                  , const T* nums
+                  , size_t count
+                  , uint64_t offset
+                  , Cancel& cancel
+                  , asio::yield_context yield)
+{
+    sys::error_code ec;
+    if (boost::endian::order::native == boost::endian::order::little) {
+        write_at(f, asio::buffer(nums, count * sizeof(T)), offset, cancel, yield[ec]);
+    } else {
+        std::vector<T> little(nums, nums + count);
+        detail::native_to_little_inplace(little.data(), count);
+        write_at(f, asio::buffer(little), offset, cancel, yield[ec]);
+    }
+    return or_throw(yield, ec);
+}
+
+// Remove the file with a single system call, doing nothing if it does not
+// exist or is a directory.
 void remove_file(const fs::path& p);
 
+// Same as above, telling why the file could not be removed
+// (e.g. `no_such_file_or_directory`).
+void remove_file(const fs::path&, sys::error_code&);
+
+// Remove each of the files as `remove_file` does, returning their errors
+// in the same order (empty for the files removed).
+std::vector<sys::error_code> remove_files(const std::vector<fs::path>&);
+
+// Same as above but without blocking the caller's thread.  If cancelled,
+// the files not removed yet are left alone.
+std::vector<sys::error_code> remove_files( const asio::executor&
+                                         , const std::vector<fs::path>&
+                                         , Cancel&
+                                         , asio::yield_context);
+
+// Remove the path and everything below it like `fs::remove_all`, but with
+// up to `workers` threads emptying different directories at once.  Each
+// directory is read once and its entries are removed with `unlinkat`
+// relative to it.  Symlinks are removed, not followed.  A missing path is
+// not an error.  On Windows this is `fs::remove_all`.
+void remove_tree(const fs::path&, sys::error_code&, unsigned workers = 4);
+
+// Same as above but without blocking the caller's thread.  If cancelled,
+// workers stop before the next directory entry, leaving the rest in place.
+void remove_tree( const asio::executor&
+                , const fs::path&
+                , Cancel&
+                , asio::yield_context
+                , unsigned workers = 4);
+
+// A read-only memory mapping of a whole file.  Reading from it involves
+// no copy nor any asynchronous operation.  Copies share the mapping,
+// which is released when the last of them goes away.
+class mapped_file {
+public:
+    enum class access_hint { normal, sequential, random, willneed };
+
+    struct mapping {
+        const char* data = nullptr;
+        size_t size = 0;
+
+        ~mapping();
+    };
+
+    mapped_file() = default;
+
+    explicit mapped_file(std::shared_ptr<const mapping> m)
+        : _mapping(std::move(m))
+    {}
+
+    const char* data() const { return _mapping ? _mapping->data : nullptr; }
+    size_t size() const { return _mapping ? _mapping->size : 0; }
+
+    asio::const_buffer buffer() const { return asio::buffer(data(), size()); }
+
+    explicit operator bool() const { return bool(_mapping); }
+
+    // Tell the kernel how the mapping is going to be accessed, see madvise(2).
+    // This is only a hint, so it does nothing where it is not supported.
+    void advise(access_hint, sys::error_code&) const;
+
+private:
+    std::shared_ptr<const mapping> _mapping;
+};
+
+struct map_options {
+    mapped_file::access_hint hint = mapped_file::access_hint::normal;
+    // Read the whole file in right away (MAP_POPULATE) instead of
+    // page faulting on first access.
+    bool populate = false;
+};
+
+mapped_file map_readonly(const fs::path&, sys::error_code&, map_options = {});
+
 }}} // namespaces
@@ -0,0 +1,307 @@
+#include "file_io_stats.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+namespace ouinet { namespace util { namespace file_io {
+
+const char* to_string(io_op op)
+{
+    switch (op) {
+        case io_op::read:     return "read";
+        case io_op::write:    return "write";
+        case io_op::truncate: return "truncate";
+        case io_op::fsync:    return "fsync";
+        case io_op::commit:   return "commit";
+        case io_op::copy_reflink:    return "copy_reflink";
+        case io_op::copy_file_range: return "copy_file_range";
+        case io_op::copy_read_write: return "copy_read_write";
+        case io_op::send:            return "send";
+        case io_op::open:            return "open";
+        case io_op::close:           return "close";
+    }
+    return "unknown";
+}
+
+//--------------------------------------------------------------------
+// histogram
+
+static
+unsigned most_significant_bit(uint64_t v)
+{
+    unsigned msb = 0;
+    while (v >>= 1) ++msb;
+    return msb;
+}
+
+size_t histogram::bucket_index(uint64_t v)
+{
+    v = std::min(v, max_trackable);
+    if (v < sub_buckets) return v;
+    unsigned shift = most_significant_bit(v) - sub_bucket_bits;
+    return (shift + 1) * sub_buckets + ((v >> shift) - sub_buckets);
+}
+
+uint64_t histogram::bucket_lowest(size_t i)
+{
+    if (i < sub_buckets) return i;
+    unsigned shift = i / sub_buckets - 1;
+    return (i % sub_buckets + sub_buckets) << shift;
+}
+
+uint64_t histogram::bucket_highest(size_t i)
+{
+    if (i < sub_buckets) return i;
+    unsigned shift = i / sub_buckets - 1;
+    return ((i % sub_buckets + sub_buckets + 1) << shift) - 1;
+}
+
+void histogram::record(uint64_t v)
+{
+    if (_buckets.empty()) _buckets.resize(bucket_count);
+    ++_buckets[bucket_index(v)];
+    _min = _count ? std::min(_min, v) : v;
+    _max = std::max(_max, v);
+    _sum += v;
+    ++_count;
+}
+
+void histogram::merge(const histogram& other)
+{
+    if (!other._count) return;
+    if (_buckets.empty()) _buckets.resize(bucket_count);
+    for (size_t i = 0; i < bucket_count; ++i) _buckets[i] += other._buckets[i];
+    _min = _count ? std::min(_min, other._min) : other._min;
+    _max = std::max(_max, other._max);
+    _sum += other._sum;
+    _count += other._count;
+}
+
+uint64_t histogram::percentile(double q) const
+{
+    if (!_count) return 0;
+    q = std::max(0.0, std::min(1.0, q));
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(q * _count + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < _buckets.size(); ++i) {
+        seen += _buckets[i];
+        if (seen >= rank) return std::min(bucket_highest(i), _max);
+    }
+    return _max;
+}
+
+//--------------------------------------------------------------------
+// io_stats
+
+std::atomic<bool> io_stats::_enabled{false};
+
+namespace {
+
+struct registry {
+    std::mutex mutex;
+    std::map<io_stats::native_handle_t, std::string> tags;
+    std::map<std::string, std::map<io_op, io_stats::op_stats>> sources;
+};
+
+registry& get_registry()
+{
+    static registry r;
+    return r;
+}
+
+std::string handle_name(io_stats::native_handle_t h)
+{
+    std::ostringstream os;
+#ifdef _WIN32
+    os << "handle:" << h;
+#else
+    os << "fd:" << h;
+#endif
+    return os.str();
+}
+
+uint64_t to_ns(io_stats::clock::duration d)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    return ns > 0 ? ns : 0;
+}
+
+} // anonymous namespace
+
+void io_stats::enable(bool e)
+{
+    _enabled.store(e, std::memory_order_relaxed);
+}
+
+void io_stats::set_tag(native_handle_t h, std::string tag)
+{
+    auto& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.tags[h] = std::move(tag);
+}
+
+void io_stats::clear_tag(native_handle_t h)
+{
+    auto& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.tags.erase(h);
+}
+
+io_stats::snapshot io_stats::take_snapshot()
+{
+    auto& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return snapshot{r.sources};
+}
+
+void io_stats::reset()
+{
+    auto& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.sources.clear();
+}
+
+void io_stats::record(native_handle_t h, const sample& s)
+{
+    auto& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    auto tag = r.tags.find(h);
+    auto& st = tag != r.tags.end() ? r.sources[tag->second][s.op]
+                                   : r.sources[handle_name(h)][s.op];
+
+    ++st.ops;
+    st.bytes += s.bytes;
+    st.syscalls += s.syscalls;
+    if (s.failed) ++st.errors;
+    st.queue_wait.record(to_ns(s.dispatched - s.start));
+    st.service.record(to_ns(s.end - s.dispatched));
+    st.latency.record(to_ns(s.end - s.start));
+}
+
+//--------------------------------------------------------------------
+// Output
+
+static
+std::string escape(const std::string& s)
+{
+    std::ostringstream os;
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"':  os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            default:
+                if (c < 0x20) {
+                    os << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                       << unsigned(c) << std::dec << std::setfill(' ');
+                } else {
+                    os << c;
+                }
+        }
+    }
+    return os.str();
+}
+
+static
+void histogram_json(std::ostream& os, const histogram& h)
+{
+    os << "{\"count\":" << h.count()
+       << ",\"sum\":" << h.sum()
+       << ",\"min\":" << h.min()
+       << ",\"max\":" << h.max()
+       << ",\"mean\":" << h.mean()
+       << ",\"p50\":" << h.percentile(0.50)
+       << ",\"p90\":" << h.percentile(0.90)
+       << ",\"p99\":" << h.percentile(0.99)
+       << ",\"p999\":" << h.percentile(0.999)
+       // Non empty buckets as [highest value, count].
+       << ",\"buckets\":[";
+    bool first = true;
+    for (size_t i = 0; i < h.buckets().size(); ++i) {
+        if (!h.buckets()[i]) continue;
+        os << (first ? "" : ",") << "[" << histogram::bucket_highest(i)
+           << "," << h.buckets()[i] << "]";
+        first = false;
+    }
+    os << "]}";
+}
+
+std::string io_stats::snapshot::to_json() const
+{
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(1) << "{\"sources\":{";
+    bool first_source = true;
+    for (auto& s : sources) {
+        os << (first_source ? "" : ",") << "\"" << escape(s.first) << "\":{";
+        first_source = false;
+        bool first_op = true;
+        for (auto& o : s.second) {
+            auto& st = o.second;
+            os << (first_op ? "" : ",") << "\"" << to_string(o.first) << "\":{"
+               << "\"ops\":" << st.ops
+               << ",\"bytes\":" << st.bytes
+               << ",\"syscalls\":" << st.syscalls
+               << ",\"errors\":" << st.errors
+               << ",\"queue_wait_ns\":";
+            histogram_json(os, st.queue_wait);
+            os << ",\"service_ns\":";
+            histogram_json(os, st.service);
+            os << ",\"latency_ns\":";
+            histogram_json(os, st.latency);
+            os << "}";
+            first_op = false;
+        }
+        os << "}";
+    }
+    os << "}}";
+    return os.str();
+}
+
+std::string io_stats::snapshot::to_prometheus() const
+{
+    std::ostringstream os;
+    os << std::setprecision(9);
+
+    auto labels = [] (const std::string& source, io_op op) {
+        return "source=\"" + escape(source) + "\",op=\"" + to_string(op) + "\"";
+    };
+
+    auto counter = [&] (const char* name, const char* help, uint64_t op_stats::* field) {
+        os << "# HELP ouinet_file_io_" << name << " " << help << "\n"
+           << "# TYPE ouinet_file_io_" << name << " counter\n";
+        for (auto& s : sources) for (auto& o : s.second) {
+            os << "ouinet_file_io_" << name << "{" << labels(s.first, o.first) << "} "
+               << o.second.*field << "\n";
+        }
+    };
+
+    auto summary = [&] (const char* name, const char* help, histogram op_stats::* field) {
+        os << "# HELP ouinet_file_io_" << name << " " << help << "\n"
+           << "# TYPE ouinet_file_io_" << name << " summary\n";
+        for (auto& s : sources) for (auto& o : s.second) {
+            auto& h = o.second.*field;
+            auto l = labels(s.first, o.first);
+            for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                os << "ouinet_file_io_" << name << "{" << l << ",quantile=\"" << q << "\"} "
+                   << h.percentile(q) / 1e9 << "\n";
+            }
+            os << "ouinet_file_io_" << name << "_sum{" << l << "} " << h.sum() / 1e9 << "\n"
+               << "ouinet_file_io_" << name << "_count{" << l << "} " << h.count() << "\n";
+        }
+    };
+
+    counter("ops_total", "File operations completed.", &op_stats::ops);
+    counter("bytes_total", "Bytes read or written.", &op_stats::bytes);
+    counter("syscalls_total", "System calls or io_uring submissions issued.", &op_stats::syscalls);
+    counter("errors_total", "File operations which failed.", &op_stats::errors);
+    summary("queue_wait_seconds", "Time until a worker or the kernel started on the operation.", &op_stats::queue_wait);
+    summary("service_seconds", "Time the worker or the kernel took to carry out the operation.", &op_stats::service);
+    summary("latency_seconds", "Time from the call to its completion.", &op_stats::latency);
+
+    return os.str();
+}
+
+}}} // namespaces
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/system/error_code.hpp>
+
+#include "../namespaces.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace ouinet { namespace util { namespace file_io {
+
+// Operations measured by `io_stats`.  Copies are recorded under the method
+// which carried them out, see `file_io::copy`.
+enum class io_op { read, write, truncate, fsync, commit
+                 , copy_reflink, copy_file_range, copy_read_write
+                 , send, open, close };
+
+constexpr size_t io_op_count = 11;
+
+const char* to_string(io_op);
+
+// A histogram of values with log-linear buckets, as in HdrHistogram: each
+// power of two is split into `sub_buckets` linear buckets, so any value is
+// known to within 1/16 of itself whatever its magnitude, and recording is an
+// index computation and an increment.
+class histogram {
+public:
+    static constexpr unsigned sub_bucket_bits = 4;
+    static constexpr uint64_t sub_buckets = uint64_t(1) << sub_bucket_bits;
+    // Larger values are recorded as this one (about 18 minutes in ns).
+    static constexpr uint64_t max_trackable = (uint64_t(1) << 40) - 1;
+    static constexpr size_t bucket_count = (40 - sub_bucket_bits + 1) * sub_buckets;
+
+    static size_t bucket_index(uint64_t);
+    // Smallest and largest values recorded in the bucket.
+    static uint64_t bucket_lowest(size_t);
+    static uint64_t bucket_highest(size_t);
+
+    void record(uint64_t);
+    void merge(const histogram&);
+
+    uint64_t count() const { return _count; }
+    uint64_t sum() const { return _sum; }
+    uint64_t min() const { return _count ? _min : 0; }
+    uint64_t max() const { return _max; }
+    double mean() const { return _count ? double(_sum) / _count : 0; }
+
+    // Value under which a fraction `q` (in [0, 1]) of the values fall,
+    // i.e. the highest value of the bucket holding that rank.
+    uint64_t percentile(double q) const;
+
+    // Number of values recorded in each bucket, empty before the first one.
+    const std::vector<uint64_t>& buckets() const { return _buckets; }
+
+private:
+    std::vector<uint64_t> _buckets;
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _min = 0;
+    uint64_t _max = 0;
+};
+
+// Opt-in instrumentation of `file_io` operations.
+//
+// While enabled, each operation records its outcome against its file handle
+// (or against the tag given to that handle with `set_tag`): number of
+// operations, bytes transferred, syscalls (or io_uring submissions) issued,
+// errors, and histograms in nanoseconds of:
+//
+// * queue wait: from the call until a worker thread or the kernel starts on it,
+// * service: from then until it is done,
+// * latency: the whole of it, as seen by the caller.
+//
+// While disabled (the default) operations only check a flag, so the clock
+// is not even read.  Statistics are kept process wide; handles are told
+// apart by their native handle, which the system may reuse once closed, so
+// long lived components should tag their handles.
+//
+//     io_stats::enable();
+//     io_stats::set_tag(f.native_handle(), "cache-index");
+//     ...
+//     std::cout << io_stats::take_snapshot().to_prometheus();
+class io_stats {
+public:
+    using clock = std::chrono::steady_clock;
+#ifdef _WIN32
+    using native_handle_t = HANDLE;
+#else
+    using native_handle_t = int;
+#endif
+
+    struct op_stats {
+        uint64_t ops = 0;
+        uint64_t bytes = 0;
+        uint64_t syscalls = 0;
+        uint64_t errors = 0;
+        histogram queue_wait;
+        histogram service;
+        histogram latency;
+    };
+
+    struct snapshot {
+        // By handle or tag name, then by operation, only those which were
+        // used.
+        std::map<std::string, std::map<io_op, op_stats>> sources;
+
+        std::string to_json() const;
+        // In the Prometheus text exposition format, latencies as summaries
+        // in seconds.
+        std::string to_prometheus() const;
+    };
+
+    // A finished operation.
+    struct sample {
+        io_op op;
+        size_t bytes = 0;
+        unsigned syscalls = 0;
+        bool failed = false;
+        clock::time_point start;
+        // When a worker or the kernel started on it, `start` if unknown.
+        clock::time_point dispatched;
+        clock::time_point end;
+    };
+
+    static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+
+    // Start or stop recording, what was recorded so far is kept.
+    static void enable(bool = true);
+
+    // Record the operations on the handle under `tag` instead of the handle
+    // itself, handles with the same tag are added up.
+    static void set_tag(native_handle_t, std::string tag);
+    static void clear_tag(native_handle_t);
+
+    static snapshot take_snapshot();
+
+    // Forget everything recorded so far (tags are kept).
+    static void reset();
+
+    static void record(native_handle_t, const sample&);
+
+private:
+    static std::atomic<bool> _enabled;
+};
+
+namespace detail {
+
+// Measures one operation if stats are enabled when it starts,
+// otherwise it does nothing.
+class io_timer {
+public:
+    explicit io_timer(io_op op)
+        : _enabled(io_stats::enabled())
+    {
+        if (!_enabled) return;
+        _sample.op = op;
+        _sample.start = io_stats::clock::now();
+    }
+
+    bool enabled() const { return _enabled; }
+
+    // For operations only known once done.
+    void set_op(io_op op) { _sample.op = op; }
+
+    void dispatched(io_stats::clock::time_point t) { _sample.dispatched = t; }
+
+    void add_syscalls(unsigned n) { _sample.syscalls += n; }
+
+    void finish( io_stats::native_handle_t h
+               , size_t bytes
+               , const sys::error_code& ec)
+    {
+        if (!_enabled) return;
+        _sample.end = io_stats::clock::now();
+        if (_sample.dispatched == io_stats::clock::time_point()) {
+            _sample.dispatched = _sample.start;
+        }
+        _sample.bytes = bytes;
+        _sample.failed = bool(ec);
+        io_stats::record(h, _sample);
+    }
+
+private:
+    bool _enabled;
+    io_stats::sample _sample;
+};
+
+} // detail namespace
+
+}}} // namespaces
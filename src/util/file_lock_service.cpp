@@ -0,0 +1,397 @@
+#include "file_lock_service.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#endif
+
+namespace ouinet { namespace util {
+
+namespace errc = boost::system::errc;
+
+namespace detail {
+
+struct lock_table {
+    struct holder {
+        uint64_t id;
+        uint64_t begin;
+        uint64_t end;
+        lock_mode mode;
+    };
+
+    std::mutex mutex;
+    std::map<lock_native_handle, std::vector<holder>> held;
+    uint64_t next_id = 0;
+    // Null once the service is shut down.
+    file_lock_service* service = nullptr;
+};
+
+} // detail namespace
+
+using holders_t = std::vector<detail::lock_table::holder>;
+
+asio::execution_context::id file_lock_service::id;
+
+static
+bool overlaps(uint64_t b1, uint64_t e1, uint64_t b2, uint64_t e2)
+{
+    return b1 < e2 && b2 < e1;
+}
+
+static
+bool conflicts(lock_mode m1, lock_mode m2)
+{
+    return m1 == lock_mode::exclusive || m2 == lock_mode::exclusive;
+}
+
+#ifdef _WIN32
+// Returns false without setting `ec` if the range is busy.
+static
+bool os_lock(HANDLE h, uint64_t begin, uint64_t end, lock_mode mode, sys::error_code& ec)
+{
+    OVERLAPPED ov{};
+    ov.Offset = DWORD(begin);
+    ov.OffsetHigh = DWORD(begin >> 32);
+    uint64_t len = end - begin;
+    DWORD flags = LOCKFILE_FAIL_IMMEDIATELY;
+    if (mode == lock_mode::exclusive) flags |= LOCKFILE_EXCLUSIVE_LOCK;
+
+    if (::LockFileEx(h, flags, 0, DWORD(len), DWORD(len >> 32), &ov)) return true;
+
+    auto err = ::GetLastError();
+    if (err == ERROR_LOCK_VIOLATION || err == ERROR_IO_PENDING) return false;
+    ec = sys::error_code(err, sys::system_category());
+    return false;
+}
+
+// Windows locks do not merge, each one is released by itself.
+static
+void os_unlock(HANDLE h, uint64_t begin, uint64_t end, const holders_t&)
+{
+    OVERLAPPED ov{};
+    ov.Offset = DWORD(begin);
+    ov.OffsetHigh = DWORD(begin >> 32);
+    uint64_t len = end - begin;
+    ::UnlockFileEx(h, 0, DWORD(len), DWORD(len >> 32), &ov);
+}
+#else
+#ifdef F_OFD_SETLK
+static const int lock_cmd = F_OFD_SETLK;
+#else
+// Process-associated locks: released when any descriptor of the file
+// is closed by this process.
+static const int lock_cmd = F_SETLK;
+#endif
+
+static
+bool fcntl_lock(int fd, uint64_t begin, uint64_t end, short type, sys::error_code& ec)
+{
+    struct flock fl{};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = off_t(begin);
+    fl.l_len = end == UINT64_MAX ? 0 : off_t(end - begin);
+    fl.l_pid = 0;
+
+    while (::fcntl(fd, lock_cmd, &fl) == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EACCES) return false;
+        ec = make_error_code(static_cast<errc::errc_t>(errno));
+        return false;
+    }
+    return true;
+}
+
+// Returns false without setting `ec` if the range is busy.
+static
+bool os_lock(int fd, uint64_t begin, uint64_t end, lock_mode mode, sys::error_code& ec)
+{
+    return fcntl_lock( fd, begin, end
+                     , mode == lock_mode::exclusive ? F_WRLCK : F_RDLCK
+                     , ec);
+}
+
+// The kernel merges ranges locked through the same descriptor, so only
+// unlock the parts not covered by other (necessarily shared) holders.
+static
+void os_unlock(int fd, uint64_t begin, uint64_t end, const holders_t& others)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> covered;
+    for (auto& h : others) {
+        if (!overlaps(begin, end, h.begin, h.end)) continue;
+        covered.emplace_back(std::max(begin, h.begin), std::min(end, h.end));
+    }
+    std::sort(covered.begin(), covered.end());
+
+    sys::error_code ec;
+    uint64_t pos = begin;
+    for (auto& c : covered) {
+        if (c.first > pos) fcntl_lock(fd, pos, c.first, F_UNLCK, ec);
+        pos = std::max(pos, c.second);
+    }
+    if (pos < end) fcntl_lock(fd, pos, end, F_UNLCK, ec);
+}
+#endif
+
+file_lock::file_lock( std::shared_ptr<detail::lock_table> table
+                    , detail::lock_native_handle h
+                    , uint64_t begin, uint64_t end
+                    , lock_mode mode
+                    , uint64_t id)
+    : _table(std::move(table))
+    , _handle(h)
+    , _begin(begin)
+    , _end(end)
+    , _mode(mode)
+    , _id(id)
+{}
+
+file_lock::file_lock(file_lock&& other)
+    : _table(std::move(other._table))
+    , _handle(other._handle)
+    , _begin(other._begin)
+    , _end(other._end)
+    , _mode(other._mode)
+    , _id(other._id)
+{}
+
+file_lock& file_lock::operator=(file_lock&& other)
+{
+    if (this == &other) return *this;
+    release();
+    _table = std::move(other._table);
+    _handle = other._handle;
+    _begin = other._begin;
+    _end = other._end;
+    _mode = other._mode;
+    _id = other._id;
+    return *this;
+}
+
+void file_lock::release()
+{
+    if (!_table) return;
+
+    auto table = std::move(_table);
+    std::lock_guard<std::mutex> lock(table->mutex);
+
+    auto i = table->held.find(_handle);
+    if (i != table->held.end()) {
+        auto& hs = i->second;
+        hs.erase(std::remove_if(hs.begin(), hs.end(),
+                    [&] (const auto& h) { return h.id == _id; }),
+                 hs.end());
+        os_unlock(_handle, _begin, _end, hs);
+        if (hs.empty()) table->held.erase(i);
+    }
+
+    if (table->service) table->service->retry(false, _handle);
+}
+
+file_lock_service::file_lock_service(asio::execution_context& ctx)
+    : file_lock_service(ctx, options{})
+{}
+
+file_lock_service::file_lock_service( asio::execution_context& ctx
+                                    , options opts)
+    : asio::execution_context::service(ctx)
+    , _options(opts)
+    , _ioc(&static_cast<asio::io_context&>(ctx))
+    , _table(std::make_shared<detail::lock_table>())
+    , _timer(*_ioc)
+    , _retry_delay(opts.min_retry)
+{
+    _table->service = this;
+}
+
+void file_lock_service::shutdown()
+{
+    std::lock_guard<std::mutex> lock(_table->mutex);
+    _table->service = nullptr;
+    _timer.cancel();
+    for (auto op : _waiting) delete op;
+    _waiting.clear();
+}
+
+uint64_t file_lock_service::range_end(uint64_t offset, uint64_t length)
+{
+    if (length == 0 || length > UINT64_MAX - offset) return UINT64_MAX;
+    return offset + length;
+}
+
+file_lock file_lock_service::try_lock( native_handle_t h
+                                     , uint64_t offset, uint64_t length
+                                     , lock_mode mode
+                                     , sys::error_code& ec)
+{
+    detail::lock_request r{h, offset, range_end(offset, length), mode};
+
+    std::lock_guard<std::mutex> lock(_table->mutex);
+
+    if (waits_behind(r)) {
+        ec = make_error_code(errc::resource_unavailable_try_again);
+        return {};
+    }
+
+    bool external = false;
+    auto l = acquire(r, external, ec);
+    if (!l && !ec) ec = make_error_code(errc::resource_unavailable_try_again);
+    return l;
+}
+
+void file_lock_service::cancel(native_handle_t h)
+{
+    std::lock_guard<std::mutex> lock(_table->mutex);
+    abort_waiting([h] (const detail::lock_op& op) { return op.handle == h; });
+}
+
+void file_lock_service::cancel_request(const void* tag)
+{
+    if (!tag) return;
+    std::lock_guard<std::mutex> lock(_table->mutex);
+    abort_waiting([tag] (const detail::lock_op& op) { return op.tag == tag; });
+}
+
+// Must be called with the table mutex held.
+template<class Pred>
+void file_lock_service::abort_waiting(Pred pred)
+{
+    std::vector<detail::lock_op*> aborted;
+    for (auto i = _waiting.begin(); i != _waiting.end();) {
+        if (!pred(**i)) { ++i; continue; }
+        aborted.push_back(*i);
+        i = _waiting.erase(i);
+    }
+
+    for (auto op : aborted) op->complete(asio::error::operation_aborted, {});
+
+    // Requests queued behind the aborted ones may go now.
+    if (!aborted.empty()) retry(true, {});
+}
+
+void file_lock_service::start(detail::lock_op* op)
+{
+    std::lock_guard<std::mutex> lock(_table->mutex);
+
+    if (!_table->service) {
+        op->complete(asio::error::shut_down, {});
+        return;
+    }
+
+    // Do not overtake earlier conflicting requests.
+    if (waits_behind(*op)) {
+        _waiting.push_back(op);
+        return;
+    }
+
+    sys::error_code ec;
+    auto l = acquire(*op, op->external, ec);
+
+    if (l || ec) {
+        op->complete(ec, std::move(l));
+        return;
+    }
+
+    _waiting.push_back(op);
+    if (op->external) arm_timer();
+}
+
+file_lock file_lock_service::acquire( const detail::lock_request& r
+                                    , bool& external
+                                    , sys::error_code& ec)
+{
+    external = false;
+
+    if (r.begin >= r.end || r.begin > uint64_t(INT64_MAX)
+        || (r.end != UINT64_MAX && r.end > uint64_t(INT64_MAX))) {
+        ec = make_error_code(errc::invalid_argument);
+        return {};
+    }
+
+    auto i = _table->held.find(r.handle);
+
+    if (i != _table->held.end()) {
+        for (auto& h : i->second) {
+            if (overlaps(r.begin, r.end, h.begin, h.end) && conflicts(r.mode, h.mode)) {
+                return {};
+            }
+        }
+    }
+
+    if (!os_lock(r.handle, r.begin, r.end, r.mode, ec)) {
+        if (!ec) external = true;
+        return {};
+    }
+
+    auto id = ++_table->next_id;
+    _table->held[r.handle].push_back({id, r.begin, r.end, r.mode});
+    return file_lock(_table, r.handle, r.begin, r.end, r.mode, id);
+}
+
+bool file_lock_service::waits_behind(const detail::lock_request& r) const
+{
+    for (auto op : _waiting) {
+        if (op == &r) break;
+        if (op->handle != r.handle) continue;
+        if (overlaps(r.begin, r.end, op->begin, op->end) && conflicts(r.mode, op->mode)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void file_lock_service::retry(bool all, native_handle_t h)
+{
+    bool external = false;
+
+    for (auto i = _waiting.begin(); i != _waiting.end();) {
+        auto op = *i;
+
+        if ((!all && op->handle != h) || waits_behind(*op)) {
+            external |= op->external;
+            ++i;
+            continue;
+        }
+
+        sys::error_code ec;
+        auto l = acquire(*op, op->external, ec);
+
+        if (!l && !ec) {
+            external |= op->external;
+            ++i;
+            continue;
+        }
+
+        i = _waiting.erase(i);
+        op->complete(ec, std::move(l));
+    }
+
+    if (external) {
+        arm_timer();
+    } else {
+        _retry_delay = _options.min_retry;
+    }
+}
+
+void file_lock_service::arm_timer()
+{
+    if (_timer_armed) return;
+
+    _timer_armed = true;
+    _timer.expires_after(_retry_delay);
+    _timer.async_wait([this] (const sys::error_code& ec) {
+        if (ec == asio::error::operation_aborted) return;
+        std::lock_guard<std::mutex> lock(_table->mutex);
+        _timer_armed = false;
+        if (!_table->service) return;
+        _retry_delay = std::min(_retry_delay * 2, _options.max_retry);
+        retry(true, {});
+    });
+}
+
+}} // namespaces
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "../namespaces.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace ouinet { namespace util {
+
+enum class lock_mode { shared, exclusive };
+
+class file_lock_service;
+
+namespace detail {
+
+#ifdef _WIN32
+using lock_native_handle = HANDLE;
+#else
+using lock_native_handle = int;
+#endif
+
+// Ranges locked by this process, shared by the service and its locks
+// so that the latter may be released after the service is gone.
+struct lock_table;
+
+} // detail namespace
+
+// A byte range locked with `file_lock_service`, unlocked on destruction.
+// Locks must be released before the file they refer to is closed.
+class file_lock {
+public:
+    file_lock() = default;
+
+    file_lock(const file_lock&) = delete;
+    file_lock& operator=(const file_lock&) = delete;
+
+    file_lock(file_lock&&);
+    file_lock& operator=(file_lock&&);
+
+    ~file_lock() { release(); }
+
+    explicit operator bool() const { return bool(_table); }
+
+    uint64_t offset() const { return _begin; }
+    // Zero if the lock extends to the end of the file and beyond.
+    uint64_t length() const { return _end == UINT64_MAX ? 0 : _end - _begin; }
+    lock_mode mode() const { return _mode; }
+
+    void release();
+
+private:
+    friend class file_lock_service;
+
+    file_lock( std::shared_ptr<detail::lock_table>
+             , detail::lock_native_handle
+             , uint64_t begin, uint64_t end
+             , lock_mode
+             , uint64_t id);
+
+private:
+    std::shared_ptr<detail::lock_table> _table;
+    detail::lock_native_handle _handle{};
+    uint64_t _begin = 0;
+    uint64_t _end = 0;
+    lock_mode _mode = lock_mode::shared;
+    uint64_t _id = 0;
+};
+
+namespace detail {
+
+struct lock_request {
+    lock_native_handle handle;
+    uint64_t begin;
+    // UINT64_MAX for up to the end of the file and beyond.
+    uint64_t end;
+    lock_mode mode;
+};
+
+struct lock_op : lock_request {
+    lock_op(lock_native_handle h, uint64_t b, uint64_t e, lock_mode m)
+        : lock_request{h, b, e, m}
+    {}
+
+    virtual void complete(const sys::error_code&, file_lock) = 0;
+    virtual ~lock_op() = default;
+
+    // Last attempt failed because of a lock held by another process.
+    bool external = false;
+    const void* tag = nullptr;
+};
+
+template<class Handler>
+struct lock_handler_op : lock_op {
+    using executor_type = asio::associated_executor_t<Handler, asio::io_context::executor_type>;
+
+    lock_handler_op( lock_native_handle h, uint64_t b, uint64_t e, lock_mode m
+                   , Handler hd, asio::io_context::executor_type ex)
+        : lock_op(h, b, e, m)
+        , handler(std::move(hd))
+        , work(asio::get_associated_executor(handler, ex))
+    {}
+
+    void complete(const sys::error_code& ec, file_lock l) override {
+        auto h = std::move(handler);
+        auto w = std::move(work);
+        delete this;
+        asio::post(w.get_executor(), [h = std::move(h), ec, l = std::move(l)] () mutable {
+            h(ec, std::move(l));
+        });
+    }
+
+    Handler handler;
+    asio::executor_work_guard<executor_type> work;
+};
+
+} // detail namespace
+
+// Byte range lock manager.
+//
+// Replaces whole file, fail-if-busy locking (as in `fs::lockFile`) with
+// shared and exclusive locks on byte ranges of a file which can be requested
+// from any thread.  Ranges are locked with open file description locks
+// (`F_OFD_SETLK`) where available so that they also exclude other processes,
+// while overlapping requests within this process (which the kernel would
+// merge for the same descriptor) are sorted out by the service itself.
+//
+// Conflicting requests wait instead of failing: they are retried as soon as
+// a lock of this process on the same file is released, and with a backoff
+// timer while the conflicting lock was taken by another process (or through
+// another open file description of this one).
+class file_lock_service : public asio::execution_context::service {
+public:
+    using native_handle_t = detail::lock_native_handle;
+
+    struct options {
+        // Delay between attempts to take a range locked by another
+        // process, doubled after every failure up to `max_retry`.
+        std::chrono::milliseconds min_retry = std::chrono::milliseconds(1);
+        std::chrono::milliseconds max_retry = std::chrono::milliseconds(100);
+    };
+
+    static asio::execution_context::id id;
+
+    explicit file_lock_service(asio::execution_context&);
+    file_lock_service(asio::execution_context&, options);
+
+    file_lock_service(const file_lock_service&) = delete;
+    file_lock_service& operator=(const file_lock_service&) = delete;
+
+    const options& get_options() const { return _options; }
+
+    // Lock `length` bytes (zero for up to the end of the file and beyond)
+    // starting at `offset`, and complete with the lock once it is held.
+    template<class Token>
+    auto async_lock( native_handle_t h
+                   , uint64_t offset, uint64_t length
+                   , lock_mode mode
+                   , Token&& token)
+    {
+        return async_lock(h, offset, length, mode, nullptr, std::forward<Token>(token));
+    }
+
+    // As above, with `tag` identifying the request for `cancel_request`.
+    template<class Token>
+    auto async_lock( native_handle_t h
+                   , uint64_t offset, uint64_t length
+                   , lock_mode mode
+                   , const void* tag
+                   , Token&& token)
+    {
+        using Sig = void(sys::error_code, file_lock);
+        asio::async_completion<Token, Sig> init(token);
+        using Handler = typename asio::async_completion<Token, Sig>::completion_handler_type;
+
+        auto op = new detail::lock_handler_op<Handler>(
+                    h, offset, range_end(offset, length), mode,
+                    std::move(init.completion_handler),
+                    _ioc->get_executor());
+        op->tag = tag;
+        start(op);
+
+        return init.result.get();
+    }
+
+    // Lock without waiting, set `ec` to `resource_unavailable_try_again`
+    // if the range is busy.
+    file_lock try_lock( native_handle_t
+                      , uint64_t offset, uint64_t length
+                      , lock_mode
+                      , sys::error_code&);
+
+    // Abort pending requests on the file with `operation_aborted`.
+    void cancel(native_handle_t);
+
+    // Abort the pending request started with the given tag, if any.
+    void cancel_request(const void* tag);
+
+private:
+    friend class file_lock;
+
+    static uint64_t range_end(uint64_t offset, uint64_t length);
+
+    void shutdown() override;
+
+    void start(detail::lock_op*);
+    template<class Pred> void abort_waiting(Pred);
+    // The following must be called with the table mutex held.
+    file_lock acquire(const detail::lock_request&, bool& external, sys::error_code&);
+    bool waits_behind(const detail::lock_request&) const;
+    void retry(bool all, native_handle_t);
+    void arm_timer();
+
+private:
+    options _options;
+    asio::io_context* _ioc;
+    std::shared_ptr<detail::lock_table> _table;
+    std::list<detail::lock_op*> _waiting;
+
+    asio::steady_timer _timer;
+    bool _timer_armed = false;
+    std::chrono::milliseconds _retry_delay;
+};
+
+}} // namespaces
@@ -5,11 +5,14 @@
 // of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
 
 #include "asio.h"
+#include "fs_paths.h"
 
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace stellar
@@ -60,6 +63,52 @@ FILE* fdOpen(native_handle_t h);
 bool durableRename(std::string const& src, std::string const& dst,
                    std::string const& dir);
 
+// Performs many renames like durableRename does, but issues a single
+// fsync() per directory for the whole batch instead of one per rename.
+// Directory handles are kept open between batches (up to maxCachedDirs),
+// and reopened if the path no longer names the directory they refer to.
+// On Win32 each rename is done with MoveFileExA with MOVEFILE_WRITE_THROUGH.
+class DurableRenameBatch
+{
+  public:
+    explicit DurableRenameBatch(size_t maxCachedDirs = 64);
+    ~DurableRenameBatch();
+
+    DurableRenameBatch(DurableRenameBatch const&) = delete;
+    DurableRenameBatch& operator=(DurableRenameBatch const&) = delete;
+
+    // Queue rename(src, dst), where dir is the directory containing dst.
+    void add(std::string const& src, std::string const& dst,
+             std::string const& dir);
+
+    size_t
+    size() const
+    {
+        return mPending.size();
+    }
+
+    // Perform all queued renames, then fsync() every directory where at least
+    // one of them succeeded. Returns, for each rename in the order they were
+    // added, what durableRename would have returned; throws like it does if a
+    // directory cannot be synced. All renames are durable once this returns.
+    std::vector<bool> commit();
+
+  private:
+    struct Rename
+    {
+        std::string src;
+        std::string dst;
+        std::string dir;
+    };
+
+    native_handle_t dirHandle(std::string const& dir);
+    void trimDirCache(std::vector<std::string> const& keep);
+
+    size_t const mMaxCachedDirs;
+    std::vector<Rename> mPending;
+    std::map<std::string, native_handle_t> mDirHandles;
+};
+
 // Return whether a path exists.
 bool exists(std::string const& path);
 
@@ -80,12 +129,83 @@ std::vector<std::string>
 findfiles(std::string const& path,
           std::function<bool(std::string const& name)> predicate);
 
+struct EnumerateOptions
+{
+    // Also list the files in subdirectories, named relative to the
+    // enumerated path (e.g. "ab/cd/file"). Symlinks to directories are not
+    // followed.
+    bool recursive = false;
+    // Directories read at once when recursive.
+    size_t maxThreads = 1;
+    // Fill in sizes and modification times. On POSIX this costs a stat per
+    // file; without it only symlinks and entries of unknown type are.
+    bool withStat = false;
+};
+
+// Regular files found by enumerateDir, in no particular order. Names are
+// packed one after the other in a single buffer.
+class DirEntries
+{
+  public:
+    size_t
+    size() const
+    {
+        return mEnds.size();
+    }
+
+    bool
+    empty() const
+    {
+        return mEnds.empty();
+    }
+
+    std::string_view
+    name(size_t i) const
+    {
+        size_t begin = i == 0 ? 0 : mEnds[i - 1];
+        return std::string_view(mNames).substr(begin, mEnds[i] - begin);
+    }
+
+    // Only set when enumerated withStat, zero otherwise.
+    uint64_t
+    fileSize(size_t i) const
+    {
+        return mSizes.empty() ? 0 : mSizes[i];
+    }
+
+    // Nanoseconds since the Unix epoch.
+    int64_t
+    mtime(size_t i) const
+    {
+        return mMtimes.empty() ? 0 : mMtimes[i];
+    }
+
+    void add(std::string_view prefix, std::string_view name);
+    void add(std::string_view prefix, std::string_view name, uint64_t size,
+             int64_t mtime);
+    void append(DirEntries&& other);
+
+  private:
+    std::string mNames;
+    std::vector<size_t> mEnds;
+    std::vector<uint64_t> mSizes;
+    std::vector<int64_t> mMtimes;
+};
+
+// List the regular files (or symlinks to them) in path, reading directory
+// entries in bulk (getdents64 on Linux, large fetches with FindFirstFileEx on
+// Win32) and telling files apart by the entry type where the filesystem
+// reports it. Throws FileSystemException if a directory cannot be read.
+DirEntries enumerateDir(std::string const& path,
+                        EnumerateOptions const& options = EnumerateOptions());
+
 size_t size(std::ifstream& ifs);
 
 size_t size(std::string const& path);
 
 ////
-// Utility functions for constructing path names
+// Utility functions for constructing path names. See fs_paths.h for versions
+// building them in place instead of returning a std::string.
 ////
 
 // Format a 32bit number as an 8-char hex string
@@ -0,0 +1,162 @@
+#pragma once
+
+// Copyright 2015 Stellar Development Foundation and contributors. Licensed
+// under the Apache License, Version 2.0. See the COPYING file at the root
+// of this distribution or at http://www.apache.org/licenses/LICENSE-2.0
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace stellar
+{
+namespace fs
+{
+
+// A string of up to N chars stored inline, so that paths can be built on the
+// stack (or at compile time) without allocating. Always NUL terminated.
+template <size_t N> class FixedPath
+{
+  public:
+    constexpr FixedPath() = default;
+
+    constexpr FixedPath&
+    append(std::string_view s)
+    {
+        if (s.size() > N - mSize)
+        {
+            throw std::length_error("fs::FixedPath capacity exceeded");
+        }
+        for (char c : s)
+        {
+            mData[mSize++] = c;
+        }
+        mData[mSize] = '\0';
+        return *this;
+    }
+
+    constexpr FixedPath&
+    append(char c)
+    {
+        return append(std::string_view(&c, 1));
+    }
+
+    constexpr size_t
+    size() const
+    {
+        return mSize;
+    }
+
+    static constexpr size_t
+    capacity()
+    {
+        return N;
+    }
+
+    constexpr std::string_view
+    view() const
+    {
+        return std::string_view(mData, mSize);
+    }
+
+    constexpr char const*
+    c_str() const
+    {
+        return mData;
+    }
+
+    std::string
+    str() const
+    {
+        return std::string(mData, mSize);
+    }
+
+    constexpr bool
+    operator==(std::string_view s) const
+    {
+        return view() == s;
+    }
+
+  private:
+    char mData[N + 1] = {};
+    size_t mSize = 0;
+};
+
+// Long enough for any <type>/AB/CD/EF/<type>-<hex>.<suffix> we publish.
+using RemotePath = FixedPath<255>;
+
+constexpr bool
+isHexDigit(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+           (c >= 'A' && c <= 'F');
+}
+
+// Whether hexStr starts with the 6 hex digits hexDir needs.
+constexpr bool
+hasHexDirPrefix(std::string_view hexStr)
+{
+    if (hexStr.size() < 6)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < 6; ++i)
+    {
+        if (!isHexDigit(hexStr[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Same as hexDir, throws std::invalid_argument if hexStr does not start with
+// 6 hex digits.
+constexpr FixedPath<8>
+hexDirPath(std::string_view hexStr)
+{
+    if (!hasHexDirPrefix(hexStr))
+    {
+        throw std::invalid_argument("fs::hexDirPath needs 6 hex digits");
+    }
+    FixedPath<8> res;
+    res.append(hexStr.substr(0, 2))
+        .append('/')
+        .append(hexStr.substr(2, 2))
+        .append('/')
+        .append(hexStr.substr(4, 2));
+    return res;
+}
+
+// Same as baseName.
+constexpr RemotePath
+baseNamePath(std::string_view type, std::string_view hexStr,
+             std::string_view suffix)
+{
+    RemotePath res;
+    res.append(type).append('-').append(hexStr).append('.').append(suffix);
+    return res;
+}
+
+// Same as remoteDir.
+constexpr RemotePath
+remoteDirPath(std::string_view type, std::string_view hexStr)
+{
+    RemotePath res;
+    res.append(type).append('/').append(hexDirPath(hexStr).view());
+    return res;
+}
+
+// Same as remoteName.
+constexpr RemotePath
+remoteNamePath(std::string_view type, std::string_view hexStr,
+               std::string_view suffix)
+{
+    RemotePath res = remoteDirPath(type, hexStr);
+    res.append('/').append(type).append('-').append(hexStr).append('.').append(
+        suffix);
+    return res;
+}
+}
+}
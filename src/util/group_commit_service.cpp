@@ -0,0 +1,205 @@
+#include "group_commit_service.h"
+#include "file_background_service.h"
+
+#include <memory>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ouinet { namespace util {
+
+namespace errc = boost::system::errc;
+
+using results_t = std::map<group_commit_service::native_handle_t, sys::error_code>;
+
+asio::execution_context::id group_commit_service::id;
+
+static
+sys::error_code last_error()
+{
+    return make_error_code(static_cast<errc::errc_t>(errno));
+}
+
+#ifdef _WIN32
+// Runs on a worker thread, returns the number of flushing calls made.
+static
+size_t flush_files( const std::vector<group_commit_service::native_handle_t>& files
+                  , size_t
+                  , results_t& results)
+{
+    for (auto h : files) {
+        if (!::FlushFileBuffers(h)) {
+            results[h] = sys::error_code(::GetLastError(), sys::system_category());
+        }
+    }
+    return files.size();
+}
+#else
+static
+sys::error_code flush_data(int fd)
+{
+    while (::fdatasync(fd) == -1) {
+        if (errno == EINTR) continue;
+        return last_error();
+    }
+    return {};
+}
+
+// Runs on a worker thread, returns the number of flushing calls made.
+static
+size_t flush_files( const std::vector<int>& files
+                  , size_t syncfs_threshold
+                  , results_t& results)
+{
+    size_t calls = 0;
+
+    // Group files by the file system they live in.
+    std::map<dev_t, std::vector<int>> devices;
+    for (auto fd : files) {
+        struct stat st;
+        if (::fstat(fd, &st) == -1) {
+            results[fd] = last_error();
+            continue;
+        }
+        devices[st.st_dev].push_back(fd);
+    }
+
+    for (auto& d : devices) {
+        auto& fds = d.second;
+#ifdef __linux__
+        if (syncfs_threshold && fds.size() >= syncfs_threshold) {
+            ++calls;
+            if (::syncfs(fds.front()) == 0) continue;
+            // Fall back to flushing files one by one.
+        }
+#endif
+        for (auto fd : fds) {
+            ++calls;
+            if (auto ec = flush_data(fd)) results[fd] = ec;
+        }
+    }
+
+    return calls;
+}
+#endif
+
+group_commit_service::group_commit_service(asio::execution_context& ctx)
+    : group_commit_service(ctx, options{})
+{}
+
+group_commit_service::group_commit_service( asio::execution_context& ctx
+                                          , options opts)
+    : asio::execution_context::service(ctx)
+    , _options(opts)
+    , _ioc(&static_cast<asio::io_context&>(ctx))
+    , _timer(*_ioc)
+{}
+
+void group_commit_service::shutdown()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _timer.cancel();
+    for (auto& p : _pending) {
+        for (auto op : p.second) delete op;
+    }
+    _pending.clear();
+    _pending_count = 0;
+}
+
+group_commit_service::stats group_commit_service::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return stats{ _requests, _flushes, _batches };
+}
+
+void group_commit_service::enqueue(native_handle_t h, detail::commit_op* op)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _pending[h].push_back(op);
+    ++_pending_count;
+    ++_requests;
+
+    // Requests arriving during a flush wait for the next one,
+    // which is scheduled once the current one is over.
+    if (_flushing) return;
+
+    if (_pending_count >= _options.max_batch) {
+        _timer.cancel();
+        _timer_armed = false;
+        start_flush();
+        return;
+    }
+
+    arm_timer();
+}
+
+// Must be called with the mutex held.
+void group_commit_service::arm_timer()
+{
+    if (_timer_armed) return;
+
+    _timer_armed = true;
+    _timer.expires_after(_options.window);
+    _timer.async_wait([this] (const sys::error_code& ec) {
+        if (ec == asio::error::operation_aborted) return;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _timer_armed = false;
+        if (!_flushing && _pending_count) start_flush();
+    });
+}
+
+// Must be called with the mutex held.
+void group_commit_service::start_flush()
+{
+    _flushing = true;
+    ++_batches;
+
+    batch b;
+    std::swap(b, _pending);
+    _pending_count = 0;
+
+    std::vector<native_handle_t> files;
+    files.reserve(b.size());
+    for (auto& p : b) files.push_back(p.first);
+
+    auto results = std::make_shared<results_t>();
+    auto threshold = _options.syncfs_threshold;
+
+    asio::use_service<file_background_service>(*_ioc).async_run(
+        [files = std::move(files), threshold, results] (sys::error_code&) {
+            return flush_files(files, threshold, *results);
+        },
+        [this, b = std::move(b), results] (const sys::error_code&, size_t calls) mutable {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _flushes += calls;
+            }
+            on_flushed(std::move(b), std::move(*results));
+        });
+}
+
+void group_commit_service::on_flushed(batch b, results_t results)
+{
+    for (auto& p : b) {
+        auto r = results.find(p.first);
+        sys::error_code ec = r == results.end() ? sys::error_code() : r->second;
+        for (auto op : p.second) op->complete(ec);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _flushing = false;
+
+    if (_pending_count == 0) return;
+
+    if (_pending_count >= _options.max_batch) {
+        start_flush();
+    } else {
+        arm_timer();
+    }
+}
+
+}} // namespaces
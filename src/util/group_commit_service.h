@@ -0,0 +1,146 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "../namespaces.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace ouinet { namespace util {
+
+namespace detail {
+
+struct commit_op {
+    virtual void complete(const sys::error_code&) = 0;
+    virtual ~commit_op() = default;
+};
+
+template<class Handler>
+struct commit_handler_op : commit_op {
+    using executor_type = asio::associated_executor_t<Handler, asio::io_context::executor_type>;
+
+    commit_handler_op(Handler h, asio::io_context::executor_type ex)
+        : handler(std::move(h))
+        , work(asio::get_associated_executor(handler, ex))
+    {}
+
+    void complete(const sys::error_code& ec) override {
+        auto h = std::move(handler);
+        auto w = std::move(work);
+        delete this;
+        asio::post(w.get_executor(), [h = std::move(h), ec] () mutable {
+            h(ec);
+        });
+    }
+
+    Handler handler;
+    asio::executor_work_guard<executor_type> work;
+};
+
+} // detail namespace
+
+// Group commit of file data to the storage device.
+//
+// Instead of each caller flushing its file (as `fs::flushFileChanges` does),
+// callers queue a durability request for their file and wait.  Requests
+// arriving within a short window are coalesced: each file gets a single
+// fdatasync, and where many files on the same file system are pending a
+// single syncfs is issued for all of them (Linux only).  Flushes run on the
+// `file_background_service` pool, one batch at a time, and every waiter
+// resumes once a flush started after its request has completed.
+//
+//     asio::make_service<group_commit_service>(ctx, group_commit_service::options{...});
+class group_commit_service : public asio::execution_context::service {
+public:
+#ifdef _WIN32
+    using native_handle_t = HANDLE;
+#else
+    using native_handle_t = int;
+#endif
+
+    struct options {
+        // How long to wait for more requests before flushing a batch.
+        std::chrono::microseconds window = std::chrono::milliseconds(2);
+        // Flush right away once this many requests are waiting.
+        size_t max_batch = 64;
+        // Use a single syncfs instead of per file flushes once this many
+        // files of the same file system are pending (0 to disable).
+        size_t syncfs_threshold = 16;
+    };
+
+    struct stats {
+        uint64_t requests;
+        // Flushing syscalls issued (fdatasync, syncfs...).
+        uint64_t flushes;
+        uint64_t batches;
+        // Requests which did not need a syscall of their own.
+        uint64_t flushes_saved() const { return requests > flushes ? requests - flushes : 0; }
+    };
+
+    static asio::execution_context::id id;
+
+    explicit group_commit_service(asio::execution_context&);
+    group_commit_service(asio::execution_context&, options);
+
+    group_commit_service(const group_commit_service&) = delete;
+    group_commit_service& operator=(const group_commit_service&) = delete;
+
+    const options& get_options() const { return _options; }
+
+    stats get_stats() const;
+
+    // Complete once data written to the file before the call is durable.
+    // The file must stay open until then.
+    template<class Token>
+    auto async_commit(native_handle_t h, Token&& token)
+    {
+        using Sig = void(sys::error_code);
+        asio::async_completion<Token, Sig> init(token);
+        using Handler = typename asio::async_completion<Token, Sig>::completion_handler_type;
+
+        enqueue(h, new detail::commit_handler_op<Handler>(
+                    std::move(init.completion_handler),
+                    _ioc->get_executor()));
+
+        return init.result.get();
+    }
+
+private:
+    using batch = std::map<native_handle_t, std::vector<detail::commit_op*>>;
+
+    void shutdown() override;
+
+    void enqueue(native_handle_t, detail::commit_op*);
+    void arm_timer();
+    void start_flush();
+    void on_flushed(batch, std::map<native_handle_t, sys::error_code>);
+
+private:
+    options _options;
+    asio::io_context* _ioc;
+    asio::steady_timer _timer;
+
+    mutable std::mutex _mutex;
+    batch _pending;
+    size_t _pending_count = 0;
+    bool _timer_armed = false;
+    bool _flushing = false;
+
+    uint64_t _requests = 0;
+    uint64_t _flushes = 0;
+    uint64_t _batches = 0;
+};
+
+}} // namespaces
@@ -0,0 +1,519 @@
+#include "io_uring_service.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+
+#include <boost/asio/error.hpp>
+
+#ifdef OUINET_HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace ouinet { namespace util {
+
+namespace errc = boost::system::errc;
+
+asio::execution_context::id io_uring_service::id;
+
+io_uring_service::io_uring_service(asio::execution_context& ctx)
+    : io_uring_service(ctx, options{})
+{}
+
+io_uring_service::io_uring_service(asio::execution_context& ctx, options opts)
+    : asio::execution_context::service(ctx)
+    , _options(opts)
+    // Completions are delivered through the io_context's reactor.
+    , _ioc(&static_cast<asio::io_context&>(ctx))
+{
+    open_ring();
+}
+
+io_uring_service::~io_uring_service()
+{
+    close_ring();
+}
+
+void io_uring_service::shutdown()
+{
+    // Closing the ring makes the kernel cancel whatever is still in flight,
+    // after that no completion may refer to our operations.
+    close_ring();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    // Partially transferred operations are in both lists.
+    for (auto op : _pending) if (!op->is_linked()) delete op;
+    _pending.clear();
+    _active.clear_and_dispose([] (detail::io_uring_op* op) { delete op; });
+    _inflight = 0;
+}
+
+#ifdef OUINET_HAS_IO_URING
+
+template<class T>
+static
+T* ring_ptr(void* ring, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+static
+unsigned load_acquire(const unsigned* p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static
+void store_release(unsigned* p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+void io_uring_service::open_ring()
+{
+    io_uring_params p{};
+
+    if (_options.sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = _options.sqpoll_idle;
+    }
+
+    int fd = ::syscall(__NR_io_uring_setup, std::max(1u, _options.queue_depth), &p);
+    if (fd == -1) return;
+
+    _sq_entries = p.sq_entries;
+    _cq_entries = p.cq_entries;
+
+    _sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+
+    if (single_mmap) {
+        _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+    }
+
+    _sq_ring = ::mmap( nullptr, _sq_ring_size, PROT_READ | PROT_WRITE
+                     , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+    if (_sq_ring == MAP_FAILED) {
+        _sq_ring = nullptr;
+        ::close(fd);
+        return;
+    }
+
+    if (single_mmap) {
+        _cq_ring = _sq_ring;
+    } else {
+        _cq_ring = ::mmap( nullptr, _cq_ring_size, PROT_READ | PROT_WRITE
+                         , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (_cq_ring == MAP_FAILED) {
+            _cq_ring = nullptr;
+            ::munmap(_sq_ring, _sq_ring_size);
+            _sq_ring = nullptr;
+            ::close(fd);
+            return;
+        }
+    }
+
+    void* sqes = ::mmap( nullptr, _sqes_size, PROT_READ | PROT_WRITE
+                       , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    int efd = sqes == MAP_FAILED ? -1 : ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (efd == -1 || ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1) == -1) {
+        if (efd != -1) ::close(efd);
+        if (sqes != MAP_FAILED) ::munmap(sqes, _sqes_size);
+        if (_cq_ring != _sq_ring) ::munmap(_cq_ring, _cq_ring_size);
+        ::munmap(_sq_ring, _sq_ring_size);
+        _sq_ring = _cq_ring = nullptr;
+        ::close(fd);
+        return;
+    }
+
+    _sqes = static_cast<io_uring_sqe*>(sqes);
+
+    _sq_head  = ring_ptr<unsigned>(_sq_ring, p.sq_off.head);
+    _sq_tail  = ring_ptr<unsigned>(_sq_ring, p.sq_off.tail);
+    _sq_mask  = ring_ptr<unsigned>(_sq_ring, p.sq_off.ring_mask);
+    _sq_flags = ring_ptr<unsigned>(_sq_ring, p.sq_off.flags);
+    _sq_array = ring_ptr<unsigned>(_sq_ring, p.sq_off.array);
+    _cq_head  = ring_ptr<unsigned>(_cq_ring, p.cq_off.head);
+    _cq_tail  = ring_ptr<unsigned>(_cq_ring, p.cq_off.tail);
+    _cq_mask  = ring_ptr<unsigned>(_cq_ring, p.cq_off.ring_mask);
+    _cqes     = ring_ptr<io_uring_cqe>(_cq_ring, p.cq_off.cqes);
+
+    _event.emplace(*_ioc, efd);
+    _ring_fd = fd;
+}
+
+void io_uring_service::close_ring()
+{
+    if (_ring_fd == -1) return;
+
+    _event.reset();
+
+    ::munmap(_sqes, _sqes_size);
+    if (_cq_ring != _sq_ring) ::munmap(_cq_ring, _cq_ring_size);
+    ::munmap(_sq_ring, _sq_ring_size);
+    ::close(_ring_fd);
+
+    _sqes = nullptr;
+    _sq_ring = _cq_ring = nullptr;
+    _ring_fd = -1;
+}
+
+void io_uring_service::start(detail::io_uring_op* op)
+{
+    if (!is_open()) {
+        op->complete(asio::error::operation_not_supported, 0);
+        return;
+    }
+
+    // A READV/WRITEV without iovecs would return 0, which reads as EOF
+    // (or a failed write), while empty transfers are no-ops everywhere else.
+    if (op->iov.empty()) {
+        op->complete(sys::error_code(), 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // Keep the number of operations in flight below the size of the
+        // completion queue so that completions are never dropped.
+        if (!_pending.empty() || _inflight >= _cq_entries || !push_sqe(op)) {
+            _pending.push_back(op);
+        }
+
+        submit();
+        wait_for_completions();
+    }
+}
+
+bool io_uring_service::push_sqe(const io_uring_sqe& entry)
+{
+    unsigned tail = *_sq_tail;
+
+    if (tail - load_acquire(_sq_head) >= _sq_entries) return false;
+
+    unsigned index = tail & *_sq_mask;
+    _sqes[index] = entry;
+    _sq_array[index] = index;
+    store_release(_sq_tail, tail + 1);
+
+    ++_inflight;
+    ++_unsubmitted;
+    return true;
+}
+
+// Must be called with the mutex held.
+auto io_uring_service::find_fixed(const iovec& v) const -> const fixed_buffer*
+{
+    auto p = static_cast<const char*>(v.iov_base);
+    auto i = std::upper_bound( _fixed.begin(), _fixed.end(), p
+                             , [] (const char* p, const fixed_buffer& b) { return p < b.data; });
+    if (i == _fixed.begin()) return nullptr;
+    --i;
+    if (p + v.iov_len > i->data + i->size) return nullptr;
+    return &*i;
+}
+
+bool io_uring_service::push_sqe(detail::io_uring_op* op)
+{
+    bool is_read = op->op_kind == detail::io_uring_op::kind::read;
+
+    io_uring_sqe sqe{};
+    sqe.opcode = is_read ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe.fd = op->fd;
+    sqe.off = op->offset + op->transferred;
+    sqe.addr = reinterpret_cast<uint64_t>(op->iov.data());
+    sqe.len = std::min<size_t>(op->iov.size(), IOV_MAX);
+    sqe.user_data = reinterpret_cast<uint64_t>(op);
+
+    const fixed_buffer* fixed = nullptr;
+    if (!_fixed.empty() && op->iov.size() == 1 && op->iov[0].iov_len <= UINT32_MAX) {
+        fixed = find_fixed(op->iov[0]);
+    }
+    if (fixed) {
+        sqe.opcode = is_read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe.addr = reinterpret_cast<uint64_t>(op->iov[0].iov_base);
+        sqe.len = op->iov[0].iov_len;
+        sqe.buf_index = fixed->index;
+    }
+
+    if (!push_sqe(sqe)) return false;
+
+    ++_submissions;
+    if (fixed) ++_fixed_submissions;
+
+    if (!op->is_linked()) _active.push_back(*op);
+    op->in_flight = true;
+
+    if (op->trace && op->trace->submissions++ == 0) {
+        op->trace->submitted = std::chrono::steady_clock::now();
+    }
+    return true;
+}
+
+// Must be called with the mutex held.
+void io_uring_service::finish( detail::io_uring_op* op
+                             , const sys::error_code& ec
+                             , std::vector<completion>& done)
+{
+    if (op->cancels) {
+        op->finished = true;
+        op->result = ec;
+        return;
+    }
+    op->unlink();
+    done.push_back({op, ec});
+}
+
+io_uring_service::stats io_uring_service::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return stats{_submissions, _fixed_submissions};
+}
+
+void io_uring_service::register_buffers( const std::vector<asio::mutable_buffer>& bufs
+                                       , sys::error_code& ec)
+{
+    if (!is_open()) {
+        ec = asio::error::operation_not_supported;
+        return;
+    }
+
+    std::vector<iovec> iov;
+    std::vector<fixed_buffer> fixed;
+    for (auto& b : bufs) {
+        fixed.push_back({static_cast<const char*>(b.data()), b.size(), unsigned(iov.size())});
+        iov.push_back({b.data(), b.size()});
+    }
+    std::sort(fixed.begin(), fixed.end(), [] (auto& a, auto& b) { return a.data < b.data; });
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_fixed.empty()) {
+        ::syscall(__NR_io_uring_register, _ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        _fixed.clear();
+    }
+
+    if (iov.empty()) return;
+
+    if (::syscall( __NR_io_uring_register, _ring_fd, IORING_REGISTER_BUFFERS
+                 , iov.data(), unsigned(iov.size())) == -1) {
+        ec = make_error_code(static_cast<errc::errc_t>(errno));
+        return;
+    }
+
+    _fixed = std::move(fixed);
+}
+
+void io_uring_service::cancel(const void* tag)
+{
+    if (!tag || !is_open()) return;
+
+    std::vector<completion> done;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        for (auto i = _pending.begin(); i != _pending.end();) {
+            auto op = *i;
+            if (op->tag != tag) { ++i; continue; }
+            i = _pending.erase(i);
+            op->cancelled = true;
+            finish(op, asio::error::operation_aborted, done);
+        }
+
+        for (auto& op : _active) {
+            if (op.tag != tag || !op.in_flight || op.cancelled) continue;
+
+            op.cancelled = true;
+
+            // Without room for the request the operation is simply not
+            // resubmitted after its current transfer.
+            if (_inflight >= _cq_entries) continue;
+
+            // Cancel requests are told apart by the low bit of their data.
+            io_uring_sqe sqe{};
+            sqe.opcode = IORING_OP_ASYNC_CANCEL;
+            sqe.fd = -1;
+            sqe.addr = reinterpret_cast<uint64_t>(&op);
+            sqe.user_data = reinterpret_cast<uint64_t>(&op) | 1;
+
+            if (push_sqe(sqe)) ++op.cancels;
+        }
+
+        submit();
+    }
+
+    for (auto& c : done) c.op->complete(c.ec, c.op->transferred);
+}
+
+void io_uring_service::submit()
+{
+    if (_unsubmitted == 0) return;
+
+    if (_options.sqpoll) {
+        // The kernel thread picks entries up by itself,
+        // it only needs to be woken up if it went to sleep.
+        _unsubmitted = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (load_acquire(_sq_flags) & IORING_SQ_NEED_WAKEUP) {
+            ::syscall(__NR_io_uring_enter, _ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP, nullptr, 0);
+        }
+        return;
+    }
+
+    int r = ::syscall(__NR_io_uring_enter, _ring_fd, _unsubmitted, 0, 0, nullptr, 0);
+
+    // On failure (e.g. EAGAIN or EBUSY) the entries stay in the ring
+    // and are submitted again once some completions have been reaped.
+    if (r > 0) _unsubmitted -= std::min<unsigned>(r, _unsubmitted);
+}
+
+void io_uring_service::wait_for_completions()
+{
+    if (_waiting || _inflight == 0) return;
+
+    _waiting = true;
+
+    // Not re-arming once nothing is in flight is what lets `io_context::run`
+    // return when there is no more work.
+    _event->async_read_some( asio::buffer(&_event_count, sizeof(_event_count))
+                           , [this] (const sys::error_code& ec, size_t) {
+                                 on_event(ec);
+                             });
+}
+
+void io_uring_service::on_event(const sys::error_code& ec)
+{
+    if (ec == asio::error::operation_aborted) return;
+
+    std::vector<completion> done;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _waiting = false;
+
+        unsigned head = *_cq_head;
+        unsigned tail = load_acquire(_cq_tail);
+
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = _cqes[head & *_cq_mask];
+            int res = cqe.res;
+
+            --_inflight;
+
+            if (cqe.user_data & 1) {
+                // Answer to a cancel request, whatever it says
+                // the operation itself completes on its own.
+                auto op = reinterpret_cast<detail::io_uring_op*>(cqe.user_data & ~uint64_t(1));
+                if (--op->cancels == 0 && op->finished) {
+                    op->unlink();
+                    done.push_back({op, op->result});
+                }
+                continue;
+            }
+
+            auto op = reinterpret_cast<detail::io_uring_op*>(cqe.user_data);
+            op->in_flight = false;
+
+            if ((res == -EAGAIN || res == -EINTR) && !op->cancelled) {
+                _pending.push_back(op);
+                continue;
+            }
+
+            if (res < 0) {
+                finish(op, res == -ECANCELED || op->cancelled
+                           ? sys::error_code(asio::error::operation_aborted)
+                           : make_error_code(static_cast<errc::errc_t>(-res)), done);
+                continue;
+            }
+
+            if (res == 0) {
+                finish(op, op->op_kind == detail::io_uring_op::kind::read
+                           ? sys::error_code(asio::error::eof)
+                           : make_error_code(errc::io_error), done);
+                continue;
+            }
+
+            // Drop what has been transferred and go for the rest.
+            op->transferred += res;
+            size_t n = res;
+            auto i = op->iov.begin();
+            for (; i != op->iov.end() && n >= i->iov_len; ++i) n -= i->iov_len;
+            op->iov.erase(op->iov.begin(), i);
+
+            if (op->iov.empty()) {
+                finish(op, sys::error_code(), done);
+                continue;
+            }
+
+            if (op->cancelled) {
+                finish(op, asio::error::operation_aborted, done);
+                continue;
+            }
+
+            op->iov.front().iov_base = static_cast<char*>(op->iov.front().iov_base) + n;
+            op->iov.front().iov_len -= n;
+            _pending.push_back(op);
+        }
+
+        store_release(_cq_head, head);
+
+        while (!_pending.empty() && _inflight < _cq_entries && push_sqe(_pending.front())) {
+            _pending.pop_front();
+        }
+
+        submit();
+    }
+
+    // Handlers may start new operations right away,
+    // so they must be invoked without holding the lock.
+    for (auto& c : done) c.op->complete(c.ec, c.op->transferred);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    wait_for_completions();
+}
+
+#else // !OUINET_HAS_IO_URING
+
+void io_uring_service::open_ring() {}
+void io_uring_service::close_ring() {}
+
+void io_uring_service::start(detail::io_uring_op* op)
+{
+    op->complete(asio::error::operation_not_supported, 0);
+}
+
+bool io_uring_service::push_sqe(const io_uring_sqe&) { return false; }
+bool io_uring_service::push_sqe(detail::io_uring_op*) { return false; }
+void io_uring_service::finish(detail::io_uring_op*, const sys::error_code&, std::vector<completion>&) {}
+void io_uring_service::cancel(const void*) {}
+const io_uring_service::fixed_buffer* io_uring_service::find_fixed(const iovec&) const { return nullptr; }
+
+io_uring_service::stats io_uring_service::get_stats() const
+{
+    return stats{0, 0};
+}
+
+void io_uring_service::register_buffers(const std::vector<asio::mutable_buffer>&, sys::error_code& ec)
+{
+    ec = asio::error::operation_not_supported;
+}
+void io_uring_service::submit() {}
+void io_uring_service::wait_for_completions() {}
+void io_uring_service::on_event(const sys::error_code&) {}
+
+#endif // OUINET_HAS_IO_URING
+
+}} // namespaces
@@ -0,0 +1,340 @@
+#pragma once
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define OUINET_HAS_IO_URING 1
+#endif
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/intrusive/list.hpp>
+#include <boost/optional.hpp>
+
+#include "../namespaces.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace ouinet { namespace util {
+
+namespace detail {
+
+// Filled in by the service for operations being measured.
+struct io_uring_trace {
+    // When the operation was first handed to the kernel.
+    std::chrono::steady_clock::time_point submitted;
+    // Ring entries used, more than one on short reads or writes.
+    unsigned submissions = 0;
+};
+
+// An operation handed to the ring.  The service keeps track of how much has
+// been transferred and resubmits the remainder on short reads or writes, so
+// the handler only sees full transfers, EOF or an error (same semantics as
+// `asio::async_read_at`/`async_write_at`).
+struct io_uring_op
+    : boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>>
+{
+    enum class kind { read, write };
+
+    kind op_kind;
+    int fd;
+    uint64_t offset;
+    std::vector<iovec> iov;
+    size_t transferred = 0;
+
+    // Identifies the operation for `io_uring_service::cancel`.
+    const void* tag = nullptr;
+    io_uring_trace* trace = nullptr;
+    bool in_flight = false;
+    bool cancelled = false;
+    // The kernel may still refer to the operation through cancel requests,
+    // its completion is held back until they are all answered.
+    unsigned cancels = 0;
+    bool finished = false;
+    sys::error_code result;
+
+    virtual void complete(const sys::error_code&, size_t) = 0;
+    virtual ~io_uring_op() = default;
+};
+
+template<class Handler>
+struct io_uring_handler_op : io_uring_op {
+    using executor_type = asio::associated_executor_t<Handler, asio::io_context::executor_type>;
+
+    io_uring_handler_op(Handler h, asio::io_context::executor_type ex)
+        : handler(std::move(h))
+        , work(asio::get_associated_executor(handler, ex))
+    {}
+
+    // The handler is always posted: completions may come from within the
+    // initiating function or from `io_uring_service::cancel` (i.e. from
+    // within a `Cancel` slot), where running it inline is not allowed.
+    void complete(const sys::error_code& ec, size_t n) override {
+        // Free the operation before the upcall, see asio's
+        // "Allocation of handlers" rules.
+        auto h = std::move(handler);
+        auto w = std::move(work);
+        delete this;
+        asio::post(w.get_executor(), [h = std::move(h), ec, n] () mutable {
+            h(ec, n);
+        });
+    }
+
+    Handler handler;
+    asio::executor_work_guard<executor_type> work;
+};
+
+} // detail namespace
+
+// Asynchronous positional file I/O on top of Linux io_uring.
+//
+// One ring is created per `io_context`.  Completions are signalled through an
+// eventfd which is waited on by the `io_context`'s own reactor, so handlers
+// run on the io_context like those of any other asio operation and many
+// reads and writes from different coroutines are in flight at the same time.
+//
+// If the kernel does not provide io_uring (or it is forbidden e.g. by a
+// seccomp policy) `is_open()` returns false and callers are expected to fall
+// back to another implementation.
+//
+// The service must belong to an `io_context`.  Options must be given before
+// it is first used, e.g.:
+//
+//     asio::make_service<io_uring_service>(ctx, io_uring_service::options{256, true});
+class io_uring_service : public asio::execution_context::service {
+public:
+    struct options {
+        // Number of submission queue entries.  Operations beyond what the
+        // ring can hold are queued in user space until earlier ones complete.
+        unsigned queue_depth = 64;
+        // Have a kernel thread poll the submission queue, so that submitting
+        // does not need a syscall, at the cost of a (mostly) busy thread.
+        bool sqpoll = false;
+        // Milliseconds the SQPOLL thread spins before going to sleep.
+        unsigned sqpoll_idle = 1000;
+    };
+
+    struct stats {
+        // Ring entries used by reads and writes, and those of them which
+        // used registered buffers.
+        uint64_t submissions;
+        uint64_t fixed_submissions;
+    };
+
+    static asio::execution_context::id id;
+
+    explicit io_uring_service(asio::execution_context&);
+    io_uring_service(asio::execution_context&, options);
+
+    io_uring_service(const io_uring_service&) = delete;
+    io_uring_service& operator=(const io_uring_service&) = delete;
+
+    ~io_uring_service();
+
+    bool is_open() const { return _ring_fd != -1; }
+
+    const options& get_options() const { return _options; }
+
+    stats get_stats() const;
+
+    // Register memory (e.g. `buffer_pool::slabs()`) with the ring, so that
+    // the kernel does not map its pages for every read or write of a single
+    // buffer within it (IORING_OP_READ_FIXED/WRITE_FIXED).  This replaces
+    // any earlier registration, and the memory must stay mapped until then
+    // or until the service is destroyed.
+    void register_buffers(const std::vector<asio::mutable_buffer>&, sys::error_code&);
+
+    template<class MutableBufferSequence, class Token>
+    auto async_read_at( int fd
+                      , uint64_t offset
+                      , const MutableBufferSequence& bufs
+                      , Token&& token)
+    {
+        return async_read_at(fd, offset, bufs, nullptr, std::forward<Token>(token));
+    }
+
+    // As above, with `tag` identifying the operation for `cancel`.
+    template<class MutableBufferSequence, class Token>
+    auto async_read_at( int fd
+                      , uint64_t offset
+                      , const MutableBufferSequence& bufs
+                      , const void* tag
+                      , Token&& token)
+    {
+        return async_read_at(fd, offset, bufs, tag, nullptr, std::forward<Token>(token));
+    }
+
+    // As above, also filling in `trace` (which must outlive the operation)
+    // if given.
+    template<class MutableBufferSequence, class Token>
+    auto async_read_at( int fd
+                      , uint64_t offset
+                      , const MutableBufferSequence& bufs
+                      , const void* tag
+                      , detail::io_uring_trace* trace
+                      , Token&& token)
+    {
+        return initiate( detail::io_uring_op::kind::read, fd, offset
+                       , asio::buffer_sequence_begin(bufs)
+                       , asio::buffer_sequence_end(bufs)
+                       , tag, trace
+                       , std::forward<Token>(token));
+    }
+
+    template<class ConstBufferSequence, class Token>
+    auto async_write_at( int fd
+                       , uint64_t offset
+                       , const ConstBufferSequence& bufs
+                       , Token&& token)
+    {
+        return async_write_at(fd, offset, bufs, nullptr, std::forward<Token>(token));
+    }
+
+    template<class ConstBufferSequence, class Token>
+    auto async_write_at( int fd
+                       , uint64_t offset
+                       , const ConstBufferSequence& bufs
+                       , const void* tag
+                       , Token&& token)
+    {
+        return async_write_at(fd, offset, bufs, tag, nullptr, std::forward<Token>(token));
+    }
+
+    template<class ConstBufferSequence, class Token>
+    auto async_write_at( int fd
+                       , uint64_t offset
+                       , const ConstBufferSequence& bufs
+                       , const void* tag
+                       , detail::io_uring_trace* trace
+                       , Token&& token)
+    {
+        return initiate( detail::io_uring_op::kind::write, fd, offset
+                       , asio::buffer_sequence_begin(bufs)
+                       , asio::buffer_sequence_end(bufs)
+                       , tag, trace
+                       , std::forward<Token>(token));
+    }
+
+    // Abort the operations started with the given tag: those still queued
+    // complete right away, those the kernel is working on are sent an
+    // `IORING_OP_ASYNC_CANCEL`.  Either way they complete with
+    // `operation_aborted` (and the number of bytes transferred so far)
+    // unless they were already done.  Other operations on the same file
+    // are not affected.
+    void cancel(const void* tag);
+
+private:
+    template<class Iterator, class Token>
+    auto initiate( detail::io_uring_op::kind k
+                 , int fd
+                 , uint64_t offset
+                 , Iterator begin
+                 , Iterator end
+                 , const void* tag
+                 , detail::io_uring_trace* trace
+                 , Token&& token)
+    {
+        using Sig = void(sys::error_code, size_t);
+        asio::async_completion<Token, Sig> init(token);
+        using Handler = typename asio::async_completion<Token, Sig>::completion_handler_type;
+
+        auto op = new detail::io_uring_handler_op<Handler>(
+                std::move(init.completion_handler), _ioc->get_executor());
+
+        op->op_kind = k;
+        op->fd = fd;
+        op->offset = offset;
+        op->tag = tag;
+        op->trace = trace;
+
+        for (auto i = begin; i != end; ++i) {
+            auto b = asio::buffer(*i);
+            if (b.size() == 0) continue;
+            op->iov.push_back({ const_cast<void*>(static_cast<const void*>(b.data()))
+                              , b.size() });
+        }
+
+        start(op);
+        return init.result.get();
+    }
+
+    void shutdown() override;
+
+    void open_ring();
+    void close_ring();
+
+    struct completion {
+        detail::io_uring_op* op;
+        sys::error_code ec;
+    };
+
+    struct fixed_buffer {
+        const char* data;
+        size_t size;
+        unsigned index;
+    };
+
+    const fixed_buffer* find_fixed(const iovec&) const;
+
+    void start(detail::io_uring_op*);
+    bool push_sqe(const io_uring_sqe&);
+    bool push_sqe(detail::io_uring_op*);
+    void finish(detail::io_uring_op*, const sys::error_code&, std::vector<completion>&);
+    void submit();
+    void wait_for_completions();
+    void on_event(const sys::error_code&);
+
+private:
+    options _options;
+    asio::io_context* _ioc = nullptr;
+
+    int _ring_fd = -1;
+    unsigned _sq_entries = 0;
+    unsigned _cq_entries = 0;
+
+    void* _sq_ring = nullptr;
+    size_t _sq_ring_size = 0;
+    void* _cq_ring = nullptr;
+    size_t _cq_ring_size = 0;
+    io_uring_sqe* _sqes = nullptr;
+    size_t _sqes_size = 0;
+
+    unsigned* _sq_head = nullptr;
+    unsigned* _sq_tail = nullptr;
+    unsigned* _sq_mask = nullptr;
+    unsigned* _sq_flags = nullptr;
+    unsigned* _sq_array = nullptr;
+    unsigned* _cq_head = nullptr;
+    unsigned* _cq_tail = nullptr;
+    unsigned* _cq_mask = nullptr;
+    io_uring_cqe* _cqes = nullptr;
+
+    boost::optional<asio::posix::stream_descriptor> _event;
+    uint64_t _event_count = 0;
+    bool _waiting = false;
+
+    mutable std::mutex _mutex;
+    unsigned _unsubmitted = 0;
+    size_t _inflight = 0;
+    // Operations waiting for room in the ring.
+    std::deque<detail::io_uring_op*> _pending;
+    // Operations the kernel currently knows about, destroyed on shutdown.
+    boost::intrusive::list< detail::io_uring_op
+                          , boost::intrusive::constant_time_size<false>> _active;
+    // Registered buffers by address.
+    std::vector<fixed_buffer> _fixed;
+    uint64_t _submissions = 0;
+    uint64_t _fixed_submissions = 0;
+};
+
+}} // namespaces
@@ -2,8 +2,20 @@
 #include <boost/test/included/unit_test.hpp>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <future>
+#include <list>
+#include <thread>
+#include "util/atomic_cancel.h"
 #include "util/signal.h"
 #include "util/file_io.h"
+#ifndef _WIN32
+#include "util/file_background_service.h"
+#include "util/group_commit_service.h"
+#include "util/io_uring_service.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "../test/util/base_fixture.hpp"
 
 namespace asio = boost::asio;
@@ -13,6 +25,10 @@ namespace file_io = ouinet::util::file_io;
 
 using Cancel = ouinet::Signal<void()>;
 
+#ifndef _WIN32
+static const native_handle_t INVALID_HANDLE_VALUE = -1;
+#endif
+
 struct fixture_file_io:fixture_base
 {
     asio::io_context ctx;
@@ -149,7 +165,8 @@ BOOST_AUTO_TEST_CASE(test_read_only_operations)
                 ctx.get_executor(),
                 temp_file.get_name(),
                 ec);
-        file_io::write_at(aio_file_ro, boost::asio::const_buffer("DEF456uvw", 9), 0, cancel, yield);
+        file_io::write_at(aio_file_ro, boost::asio::const_buffer("DEF456uvw", 9), 0, cancel, yield[ec]);
+        BOOST_TEST(ec);
         timer.expires_from_now(std::chrono::seconds(default_timer));
         timer.async_wait(yield);
         file_io::read(aio_file_ro, asio::buffer(data_in), cancel, yield);
@@ -247,6 +264,60 @@ BOOST_AUTO_TEST_CASE(test_remove_file)
     ctx.run();
 }
 
+BOOST_AUTO_TEST_CASE(test_remove_files_and_tree)
+{
+    temp_file temp_file{test_id};
+    boost::filesystem::path root = temp_file.get_name();
+
+    // Two levels of directories with a few files each.
+    auto make_tree = [&] {
+        std::vector<boost::filesystem::path> files;
+        for (int i = 0; i < 4; ++i) {
+            auto dir = root / std::to_string(i);
+            boost::filesystem::create_directories(dir / "sub");
+            for (int j = 0; j < 8; ++j) {
+                for (auto d : {dir, dir / "sub"}) {
+                    files.push_back(d / ("file" + std::to_string(j)));
+                    std::ofstream(files.back().string()) << j;
+                }
+            }
+        }
+        return files;
+    };
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto files = make_tree();
+        std::vector<boost::filesystem::path> to_remove{
+            files[0], root / "missing", root / "0"};
+        auto errors = file_io::remove_files(ctx.get_executor(), to_remove, cancel, yield);
+        BOOST_REQUIRE_EQUAL(errors.size(), 3u);
+        BOOST_CHECK(!errors[0]);
+        BOOST_CHECK(!boost::filesystem::exists(files[0]));
+        BOOST_CHECK(errors[1] == sys::errc::no_such_file_or_directory);
+        // Directories are not removed.
+        BOOST_CHECK(errors[2]);
+        BOOST_CHECK(boost::filesystem::is_directory(root / "0"));
+
+        file_io::remove_tree(ctx.get_executor(), root, cancel, yield);
+        BOOST_CHECK(!boost::filesystem::exists(root));
+
+        // Missing paths are not an error.
+        file_io::remove_tree(ctx.get_executor(), root, cancel, yield);
+    });
+    ctx.run();
+
+    make_tree();
+    // Symlinks are removed, not followed.
+    auto outside = root.string() + "-outside";
+    std::ofstream(outside) << "keep";
+    boost::filesystem::create_symlink(outside, root / "1" / "link");
+    file_io::remove_tree(root, ec, 1);
+    BOOST_CHECK(!ec);
+    BOOST_CHECK(!boost::filesystem::exists(root));
+    BOOST_CHECK(boost::filesystem::exists(outside));
+    boost::filesystem::remove(outside);
+}
+
 BOOST_AUTO_TEST_CASE(test_read_and_write_numbers)
 {
     temp_file temp_file{test_id};
@@ -267,4 +338,1185 @@ BOOST_AUTO_TEST_CASE(test_read_and_write_numbers)
     ctx.run();
 }
 
+BOOST_AUTO_TEST_CASE(test_async_truncate_and_fsync)
+{
+    temp_file temp_file{test_id};
+    std::string expected_string = "abc";
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        async_file_handle aio_file = file_io::open_or_create(
+                ctx.get_executor(),
+                temp_file.get_name(),
+                ec);
+        file_io::write(aio_file, boost::asio::const_buffer("abcXYZ", 6), cancel, yield);
+        file_io::truncate(aio_file, 3, cancel, yield);
+        file_io::fsync(aio_file, cancel, yield);
+        BOOST_TEST(3 == file_io::file_size(aio_file, ec));
+    });
+    ctx.run();
+
+    if (std::ifstream input{temp_file.get_name()} ) {
+        std::string current_string;
+        input >> current_string;
+        BOOST_TEST(expected_string == current_string);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_read_at)
+{
+    temp_file temp_file{test_id};
+    std::string data_in(3, '\0');
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        async_file_handle aio_file = file_io::open_or_create(
+                ctx.get_executor(),
+                temp_file.get_name(),
+                ec);
+        file_io::write(aio_file, boost::asio::const_buffer("ABC123xyz", 9), cancel, yield);
+        file_io::read_at(aio_file, asio::buffer(data_in), 3, cancel, yield);
+        BOOST_TEST("123" == data_in);
+        file_io::read_at(aio_file, asio::buffer(data_in), 7, cancel, yield[ec]);
+        BOOST_TEST(ec == asio::error::eof);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_empty_transfers)
+{
+    temp_file temp_file{test_id};
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        async_file_handle aio_file = file_io::open_or_create(
+                ctx.get_executor(),
+                temp_file.get_name(),
+                ec);
+        file_io::write_at(aio_file, asio::const_buffer("", 0), 0, cancel, yield[ec]);
+        BOOST_TEST(!ec);
+        char c;
+        file_io::read_at(aio_file, asio::buffer(&c, 0), 0, cancel, yield[ec]);
+        BOOST_TEST(!ec);
+        BOOST_TEST(file_io::file_size(aio_file, ec) == 0u);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_buffered_reader)
+{
+    temp_file temp_file{test_id};
+    uint32_t count = 1000;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        async_file_handle aio_file = file_io::open_or_create(
+                ctx.get_executor(),
+                temp_file.get_name(),
+                ec);
+        std::vector<uint32_t> numbers(count);
+        for (uint32_t i = 0; i < count; ++i) numbers[i] = i;
+        file_io::write(aio_file, asio::buffer(numbers), cancel, yield);
+
+        // A small chunk size spreads the numbers over many chunks
+        // and has some of them straddle two chunks.
+        file_io::buffered_reader reader(aio_file, sizeof(uint32_t), 61);
+        for (uint32_t i = 1; i < count; ++i) {
+            BOOST_REQUIRE(i == file_io::read_number<uint32_t>(reader, cancel, yield));
+        }
+        BOOST_TEST(count * sizeof(uint32_t) == reader.offset());
+        file_io::read_number<uint32_t>(reader, cancel, yield[ec]);
+        BOOST_TEST(ec == asio::error::eof);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_scatter_gather)
+{
+    temp_file temp_file{test_id};
+    std::string header = "HEAD", body = "body-body", trailer = "TAIL";
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        async_file_handle aio_file = file_io::open_or_create(
+                ctx.get_executor(),
+                temp_file.get_name(),
+                ec);
+        std::array<asio::const_buffer, 3> out{
+            asio::buffer(header), asio::buffer(body), asio::buffer(trailer)};
+        file_io::write_v(aio_file, out, 0, cancel, yield);
+        BOOST_TEST(17 == file_io::file_size(aio_file, ec));
+
+        std::string h(4, '\0'), b(9, '\0'), t(4, '\0');
+        std::vector<asio::mutable_buffer> in{
+            asio::buffer(h), asio::buffer(b), asio::buffer(t)};
+        file_io::read_v(aio_file, in, 0, cancel, yield);
+        BOOST_TEST(header == h);
+        BOOST_TEST(body == b);
+        BOOST_TEST(trailer == t);
+
+        // A second record after the first one
+        std::string body2 = "other-body";
+        std::array<asio::const_buffer, 3> out2{
+            asio::buffer(header), asio::buffer(body2), asio::buffer(trailer)};
+        file_io::write_v(aio_file, out2, 17, cancel, yield);
+        BOOST_TEST(35 == file_io::file_size(aio_file, ec));
+
+        std::string b2(10, '\0');
+        h.assign(4, '\0');
+        t.assign(4, '\0');
+        std::vector<asio::mutable_buffer> in2{
+            asio::buffer(h), asio::buffer(b2), asio::buffer(t)};
+        file_io::read_v(aio_file, in2, 17, cancel, yield);
+        BOOST_TEST(header == h);
+        BOOST_TEST(body2 == b2);
+        BOOST_TEST(trailer == t);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_append_handle)
+{
+    temp_file temp_file{test_id};
+    if (std::ofstream output{temp_file.get_name()} ) {
+        output << "head";
+    }
+    size_t writers = 10;
+    std::string record = "0123456789";
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto aio_file = file_io::open_for_append(
+                ctx.get_executor(),
+                temp_file.get_name(),
+                ec);
+        BOOST_REQUIRE(!ec);
+        BOOST_TEST(4 == aio_file.tail());
+
+        // Concurrent appenders must not overwrite each other
+        size_t done = 0;
+        for (size_t i = 0; i < writers; ++i) {
+            asio::spawn(ctx, [&](asio::yield_context yield) {
+                file_io::write(aio_file, asio::buffer(record), cancel, yield);
+                ++done;
+            });
+        }
+        while (done < writers) {
+            asio::post(ctx, yield);
+        }
+        BOOST_TEST(4 + writers * record.size() == aio_file.tail());
+        BOOST_TEST(aio_file.tail() == file_io::file_size(aio_file.file(), ec));
+
+        // Truncating brings the tail back
+        file_io::truncate(aio_file, 2, ec);
+        BOOST_TEST(2 == aio_file.tail());
+        file_io::write(aio_file, asio::buffer("ad", 2), cancel, yield);
+    });
+    ctx.run();
+
+    if (std::ifstream input{temp_file.get_name()} ) {
+        std::string current_string;
+        input >> current_string;
+        BOOST_TEST("head" == current_string);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_lock_range)
+{
+    using ouinet::util::lock_mode;
+
+    temp_file temp_file{test_id};
+    std::vector<std::string> events;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto f = file_io::open_or_create(ctx.get_executor(), temp_file.get_name(), ec);
+        auto g = file_io::open_or_create(ctx.get_executor(), temp_file.get_name(), ec);
+        BOOST_REQUIRE(!ec);
+
+        auto a = file_io::lock_range(f, 0, 100, lock_mode::exclusive, cancel, yield);
+        BOOST_TEST(bool(a));
+        size_t done = 0;
+
+        // Overlapping lock on the same descriptor waits for `a`
+        asio::spawn(ctx, [&](asio::yield_context yield) {
+            auto b = file_io::lock_range(f, 50, 100, lock_mode::shared, cancel, yield);
+            events.push_back("b");
+            ++done;
+        });
+        // Disjoint lock does not
+        asio::spawn(ctx, [&](asio::yield_context yield) {
+            auto c = file_io::lock_range(f, 150, 0, lock_mode::exclusive, cancel, yield);
+            events.push_back("c");
+            ++done;
+        });
+        // Through another descriptor (as another process would)
+        asio::spawn(ctx, [&](asio::yield_context yield) {
+            auto d = file_io::lock_range(g, 0, 10, lock_mode::shared, cancel, yield);
+            events.push_back("d");
+            ++done;
+        });
+        // Cancelled while waiting
+        asio::spawn(ctx, [&](asio::yield_context yield) {
+            Cancel c2;
+            asio::post(ctx, [&] { c2(); });
+            sys::error_code ec2;
+            auto e = file_io::lock_range(f, 0, 1, lock_mode::exclusive, c2, yield[ec2]);
+            BOOST_TEST(ec2 == asio::error::operation_aborted);
+            BOOST_TEST(!e);
+            events.push_back("e");
+            ++done;
+        });
+
+        asio::steady_timer timer(ctx);
+        timer.expires_after(std::chrono::milliseconds(20));
+        timer.async_wait(yield);
+        events.push_back("a");
+        a.release();
+
+        while (done < 4) {
+            timer.expires_after(std::chrono::milliseconds(1));
+            timer.async_wait(yield);
+        }
+
+        // All released, the file is still usable
+        BOOST_TEST(f.is_open());
+        auto l = file_io::lock_range(g, 0, 0, lock_mode::exclusive, cancel, yield);
+        BOOST_TEST(bool(l));
+    });
+    ctx.run();
+
+    std::vector<std::string> expected{"c", "e", "a", "b", "d"};
+    BOOST_TEST(events == expected);
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(test_cancel_keeps_file_open)
+{
+    using ouinet::util::file_background_service;
+    using ouinet::util::io_uring_service;
+
+    temp_file temp_file{test_id};
+    const std::string data = "abcdefgh";
+    std::ofstream(temp_file.get_name(), std::ios::binary) << data;
+
+    // A single worker, so that jobs can be held in its queue.
+    auto& pool = asio::make_service<file_background_service>(
+            ctx, file_background_service::options{1});
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        // Through io_uring: reading an empty FIFO blocks until cancelled.
+        if (asio::use_service<io_uring_service>(ctx).is_open()) {
+            auto fifo = temp_file.get_name() + ".fifo";
+            BOOST_REQUIRE(::mkfifo(fifo.c_str(), 0600) == 0);
+            // Opening it for writing too does not wait for a writer.
+            auto f = file_io::open_or_create(ctx.get_executor(), fifo, ec);
+            BOOST_REQUIRE(!ec);
+
+            Cancel c;
+            asio::steady_timer timer(ctx);
+            timer.expires_after(std::chrono::milliseconds(20));
+            timer.async_wait([&] (const sys::error_code&) { c(); });
+            char in[4] = {};
+            file_io::read_at(f, asio::buffer(in), 0, c, yield[ec]);
+            BOOST_TEST(ec == asio::error::operation_aborted);
+
+            // The handle is still usable
+            BOOST_TEST(f.is_open());
+            BOOST_REQUIRE(::write(f.native_handle(), "wxyz", 4) == 4);
+            file_io::read_at(f, asio::buffer(in), 0, cancel, yield);
+            BOOST_TEST(std::string(in, 4) == "wxyz");
+            ::unlink(fifo.c_str());
+            ec = {};
+        }
+
+        // Through the thread pool (the ring is only used with plain
+        // io_context executors): a read cancelled while queued never runs.
+        asio::executor strand = asio::make_strand(ctx);
+        auto f = file_io::open_or_create(strand, temp_file.get_name(), ec);
+        BOOST_REQUIRE(!ec);
+
+        std::promise<void> release;
+        auto released = release.get_future().share();
+        bool blocker_done = false;
+        pool.async_run([released] (sys::error_code&) {
+                released.wait();
+                return size_t(0);
+            }, [&] (sys::error_code, size_t) { blocker_done = true; });
+
+        Cancel c;
+        std::string in(4, '\0');
+        bool read_done = false;
+        sys::error_code read_ec;
+        asio::spawn(ctx, [&](asio::yield_context yield) {
+            file_io::read_at(f, asio::buffer(in), 0, c, yield[read_ec]);
+            read_done = true;
+        });
+        // Let the read get queued behind the blocker.
+        asio::post(ctx, yield);
+        BOOST_TEST(!read_done);
+        c();
+        release.set_value();
+        while (!read_done || !blocker_done) asio::post(ctx, yield);
+
+        BOOST_TEST(read_ec == asio::error::operation_aborted);
+        BOOST_TEST(in == std::string(4, '\0'));
+
+        // The handle is still usable for reading and writing
+        BOOST_TEST(f.is_open());
+        file_io::write_at(f, asio::buffer("XYZ", 3), 1, cancel, yield);
+        in.assign(5, '\0');
+        file_io::read_at(f, asio::buffer(in), 0, cancel, yield);
+        BOOST_TEST(in == "aXYZe");
+
+        // An already cancelled operation does not touch the file either
+        Cancel done;
+        done();
+        file_io::read_at(f, asio::buffer(in), 0, done, yield[ec]);
+        BOOST_TEST(ec == asio::error::operation_aborted);
+        BOOST_TEST(f.is_open());
+    });
+    ctx.run();
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_atomic_cancel)
+{
+    using ouinet::AtomicCancel;
+
+    AtomicCancel parent;
+    AtomicCancel child(parent);
+    AtomicCancel grandchild(child);
+
+    std::atomic<size_t> calls{0};
+    auto slot = [&] { ++calls; };
+
+    // Connections are not movable, build them in place
+    struct holder {
+        holder(AtomicCancel& t, decltype(slot) s) : c(t.connect(s)) {}
+        AtomicCancel::Connection c;
+    };
+
+    const size_t per_thread = 1000;
+    std::vector<std::unique_ptr<std::list<holder>>> kept;
+    for (int i = 0; i < 4; ++i) kept.emplace_back(new std::list<holder>);
+
+    // Connect and disconnect from several threads while another one fires
+    std::vector<std::thread> threads;
+    for (auto& k : kept) {
+        threads.emplace_back([&, &k = *k] {
+            for (size_t i = 0; i < per_thread; ++i) {
+                if (i % 2) {
+                    auto c = grandchild.connect(slot);
+                } else {
+                    k.emplace_back(grandchild, slot);
+                }
+            }
+        });
+    }
+    threads.emplace_back([&] { parent(); });
+    for (auto& t : threads) t.join();
+
+    BOOST_TEST(bool(grandchild));
+    BOOST_TEST(grandchild.call_count() == 1);
+
+    // Every slot still connected was called exactly once
+    size_t kept_calls = 0;
+    for (auto& k : kept) {
+        for (auto& h : *k) {
+            BOOST_TEST(h.c.call_count() == 1);
+            kept_calls += h.c.call_count();
+        }
+    }
+    BOOST_TEST(kept_calls == kept.size() * per_thread / 2);
+    BOOST_TEST(calls >= kept_calls);
+    BOOST_TEST(calls <= kept.size() * per_thread);
+
+    // Children do not fire their parents
+    AtomicCancel other;
+    AtomicCancel other_child(other);
+    other_child();
+    BOOST_TEST(!other);
+    BOOST_TEST(compute_error_code(sys::error_code(), other_child) == asio::error::operation_aborted);
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(test_background_service)
+{
+    using ouinet::util::file_background_service;
+
+    auto& service = asio::make_service<file_background_service>(
+            ctx, file_background_service::options{2});
+    size_t job_count = 16;
+    size_t sum = 0;
+
+    for (size_t i = 0; i < job_count; ++i) {
+        asio::spawn(ctx, [&, i](asio::yield_context yield) {
+            sum += service.async_run([i] (sys::error_code&) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    return i;
+                }, yield);
+        });
+    }
+    ctx.run();
+
+    auto stats = service.get_stats();
+    BOOST_TEST(sum == job_count * (job_count - 1) / 2);
+    BOOST_TEST(stats.completed == job_count);
+    BOOST_TEST(stats.queue_length == 0);
+    BOOST_TEST(stats.max_queue_length > 0);
+}
+
+#ifdef OUINET_HAS_IO_URING
+BOOST_AUTO_TEST_CASE(test_io_uring_cancel)
+{
+    using ouinet::util::io_uring_service;
+
+    auto& service = asio::use_service<io_uring_service>(ctx);
+    if (!service.is_open()) return;
+
+    // Reading an empty pipe stays in flight until cancelled
+    int p[2];
+    BOOST_REQUIRE(::pipe(p) == 0);
+    char buf[4];
+    int tag;
+    sys::error_code ec1, ec2;
+    std::string in;
+
+    service.async_read_at(p[0], 0, asio::buffer(buf), &tag, [&] (sys::error_code ec, size_t) {
+        ec1 = ec;
+        // The descriptor is still usable
+        service.async_read_at(p[0], 0, asio::buffer(buf), [&] (sys::error_code ec, size_t n) {
+            ec2 = ec;
+            in.assign(buf, n);
+        });
+        BOOST_REQUIRE(::write(p[1], "abcd", 4) == 4);
+    });
+
+    asio::steady_timer timer(ctx);
+    timer.expires_after(std::chrono::milliseconds(20));
+    timer.async_wait([&] (const sys::error_code&) { service.cancel(&tag); });
+    ctx.run();
+
+    BOOST_TEST(ec1 == asio::error::operation_aborted);
+    BOOST_TEST(!ec2);
+    BOOST_TEST(in == "abcd");
+
+    ::close(p[0]);
+    ::close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(test_io_uring_options)
+{
+    using ouinet::util::io_uring_service;
+
+    temp_file temp_file{test_id};
+    const size_t block = 4096;
+    const size_t count = 256;
+    std::string data(block * count, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = char(i * 31 + i / block);
+    std::ofstream(temp_file.get_name(), std::ios::binary) << data;
+
+    // A ring of one or two entries queues nearly every read in user space.
+    for (auto opts : { io_uring_service::options{1}
+                     , io_uring_service::options{2}
+                     , io_uring_service::options{64, true} }) {
+        asio::io_context ctx;
+        auto& service = asio::make_service<io_uring_service>(ctx, opts);
+        // SQPOLL may need privileges.
+        if (!service.is_open()) continue;
+
+        auto f = file_io::open_readonly(ctx.get_executor(), temp_file.get_name(), ec);
+        BOOST_REQUIRE(!ec);
+        size_t correct = 0;
+        for (size_t i = 0; i < count; ++i) {
+            asio::spawn(ctx, [&, i](asio::yield_context yield) {
+                std::string in(block, '\0');
+                file_io::read_at(f, asio::buffer(in), i * block, cancel, yield);
+                if (in == data.substr(i * block, block)) ++correct;
+            });
+        }
+
+        // Handlers never run from within the initiating function.
+        bool called = false;
+        service.async_read_at(f.native_handle(), 0, asio::mutable_buffer(), [&] (sys::error_code ec, size_t n) {
+            BOOST_TEST(!ec);
+            BOOST_TEST(n == 0u);
+            called = true;
+        });
+        BOOST_TEST(!called);
+
+        ctx.run();
+        BOOST_TEST(called);
+        BOOST_TEST(correct == count);
+        BOOST_TEST(service.get_stats().submissions >= count);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_io_uring_cancel_queued)
+{
+    using ouinet::util::io_uring_service;
+
+    // A tiny ring, so that most reads wait in the service's own queue.
+    auto& service = asio::make_service<io_uring_service>(
+            ctx, io_uring_service::options{2});
+    if (!service.is_open()) return;
+
+    temp_file temp_file{test_id};
+    BOOST_REQUIRE(::mkfifo(temp_file.get_name().c_str(), 0600) == 0);
+    auto f = file_io::open_or_create(ctx.get_executor(), temp_file.get_name(), ec);
+    BOOST_REQUIRE(!ec);
+
+    // Reads of an empty FIFO stay in flight until cancelled.  The first
+    // ones take the ring, the last ones share a Cancel and are all queued.
+    const size_t count = 16;
+    Cancel in_flight[count / 2];
+    Cancel queued;
+    sys::error_code results[count];
+    size_t done = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        asio::spawn(ctx, [&, i](asio::yield_context yield) {
+            char buf[4];
+            Cancel& c = i < count / 2 ? in_flight[i] : queued;
+            file_io::read_at(f, asio::buffer(buf), 0, c, yield[results[i]]);
+            ++done;
+        });
+    }
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        asio::post(ctx, yield);
+        BOOST_TEST(done == 0u);
+
+        // Completes the queued reads without resuming them from within
+        // the signal.
+        queued();
+        while (done < count / 2) asio::post(ctx, yield);
+        for (size_t i = count / 2; i < count; ++i) {
+            BOOST_TEST(results[i] == asio::error::operation_aborted);
+        }
+
+        // With the ring full these are not cancelled in the kernel,
+        // just not resubmitted: unblock them.
+        for (auto& c : in_flight) c();
+        std::string data(4 * count, 'x');
+        BOOST_REQUIRE(::write(f.native_handle(), data.data(), data.size()) == ssize_t(data.size()));
+    });
+    ctx.run();
+
+    BOOST_TEST(done == count);
+    for (auto& r : results) BOOST_TEST(r == asio::error::operation_aborted);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_group_commit)
+{
+    using ouinet::util::group_commit_service;
+
+    group_commit_service::options options;
+    options.window = std::chrono::milliseconds(50);
+    options.syncfs_threshold = 0;
+    auto& service = asio::make_service<group_commit_service>(ctx, options);
+
+    std::vector<temp_file> temp_files;
+    for (int i = 0; i < 2; ++i) {
+        temp_files.emplace_back(test_id + "_" + std::to_string(i));
+    }
+    size_t committers = 10;
+    size_t committed = 0;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        std::vector<async_file_handle> files;
+        for (auto& t : temp_files) {
+            files.push_back(file_io::open_or_create(ctx.get_executor(), t.get_name(), ec));
+        }
+        for (size_t i = 0; i < committers; ++i) {
+            asio::spawn(ctx, [&, i](asio::yield_context yield) {
+                auto& f = files[i % files.size()];
+                file_io::write(f, asio::buffer("data", 4), cancel, yield);
+                file_io::commit(f, cancel, yield);
+                ++committed;
+            });
+        }
+        while (committed < committers) {
+            asio::post(ctx, yield);
+        }
+    });
+    ctx.run();
+
+    // All the requests fell in the same window: one flush per file
+    auto stats = service.get_stats();
+    BOOST_TEST(stats.requests == committers);
+    BOOST_TEST(stats.batches == 1);
+    BOOST_TEST(stats.flushes == temp_files.size());
+    BOOST_TEST(stats.flushes_saved() == committers - temp_files.size());
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_read_and_write_number_arrays)
+{
+    temp_file temp_file{test_id};
+    std::vector<uint64_t> expected_numbers(100000);
+    for (size_t i = 0; i < expected_numbers.size(); ++i) {
+        expected_numbers[i] = 0x0102030405060708ull * i;
+    }
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        async_file_handle aio_file = file_io::open_or_create(
+                ctx.get_executor(),
+                temp_file.get_name(),
+                ec);
+        // After a header, as in an index file
+        const uint64_t offset = 16;
+        file_io::write_numbers( aio_file, expected_numbers.data()
+                              , expected_numbers.size(), offset, cancel, yield);
+
+        std::vector<uint64_t> actual_numbers(expected_numbers.size());
+        file_io::read_numbers( aio_file, actual_numbers.data()
+                             , actual_numbers.size(), offset, cancel, yield);
+        BOOST_TEST(expected_numbers == actual_numbers);
+
+        // A slice from the middle
+        std::vector<uint64_t> slice(10);
+        file_io::read_numbers( aio_file, slice.data(), slice.size()
+                             , offset + 500 * sizeof(uint64_t), cancel, yield);
+        BOOST_TEST((slice == std::vector<uint64_t>( expected_numbers.begin() + 500
+                                                  , expected_numbers.begin() + 510)));
+
+        // Stored in little endian order regardless of the host
+        uint8_t bytes[8];
+        file_io::read_at(aio_file, asio::buffer(bytes), offset + 8, cancel, yield);
+        BOOST_TEST(bytes[0] == 0x08);
+        BOOST_TEST(bytes[7] == 0x01);
+
+        // Nothing to move
+        file_io::write_numbers(aio_file, expected_numbers.data(), 0, 0, cancel, yield[ec]);
+        BOOST_TEST(!ec);
+
+        // Past the end
+        actual_numbers.assign(2, 42);
+        file_io::read_numbers( aio_file, actual_numbers.data(), actual_numbers.size()
+                             , file_io::file_size(aio_file, ec) - 8, cancel, yield[ec]);
+        BOOST_TEST(ec == asio::error::eof);
+        BOOST_TEST(actual_numbers[1] == 42u);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_map_readonly)
+{
+    temp_file temp_file{test_id};
+    std::string expected_string = "mapped contents";
+
+    if (std::ofstream output{temp_file.get_name()} ) {
+        output << expected_string;
+    }
+
+    file_io::mapped_file copy;
+    {
+        auto mapped = file_io::map_readonly(
+                temp_file.get_name(),
+                ec,
+                {file_io::mapped_file::access_hint::sequential, true});
+        BOOST_REQUIRE(!ec);
+        BOOST_REQUIRE(mapped);
+        copy = mapped;
+    }
+    // The copy keeps the mapping alive
+    BOOST_TEST(expected_string == std::string(copy.data(), copy.size()));
+
+    copy.advise(file_io::mapped_file::access_hint::random, ec);
+    BOOST_TEST(!ec);
+
+    file_io::map_readonly(temp_file.get_name() + ".missing", ec);
+    BOOST_TEST(ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_direct_io)
+{
+    temp_file temp_file{test_id};
+    std::string data(3 * file_io::direct_alignment + 123, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = char('a' + i % 26);
+    size_t offset = 100;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto f = file_io::open_or_create( ctx.get_executor()
+                                        , temp_file.get_name()
+                                        , ec
+                                        , {true});
+        BOOST_REQUIRE(!ec);
+        // Not all file systems support it (e.g. tmpfs), transfers work anyway
+        file_io::is_direct(f, ec);
+        BOOST_TEST(!ec);
+
+        // Neither offsets, lengths nor buffers are aligned
+        file_io::write_at(f, asio::buffer(data.data() + 1, data.size() - 1), offset + 1, cancel, yield);
+        file_io::write_at(f, asio::buffer(data.data(), 1), offset, cancel, yield);
+        BOOST_TEST(file_io::file_size(f, ec) == offset + data.size());
+
+        // Blocks around the patch are kept
+        data.replace(5000, 3, "XYZ");
+        file_io::write_at(f, asio::buffer("XYZ", 3), offset + 5000, cancel, yield);
+        BOOST_TEST(file_io::file_size(f, ec) == offset + data.size());
+
+        std::string actual(data.size(), '\0');
+        file_io::read_at(f, asio::buffer(&actual[0], actual.size()), offset, cancel, yield);
+        BOOST_TEST(actual == data);
+
+        file_io::buffered_reader reader(f, offset + 1);
+        char c;
+        file_io::read_numbers(reader, &c, 1, cancel, yield);
+        BOOST_TEST(c == data[1]);
+
+        file_io::read_at(f, asio::buffer(&actual[0], actual.size()), offset + 1, cancel, yield[ec]);
+        BOOST_TEST(ec == asio::error::eof);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_buffer_pool)
+{
+    using ouinet::util::buffer_pool;
+
+    buffer_pool::options options;
+    options.buffer_size = 4 * file_io::direct_alignment;
+    options.buffers_per_slab = 4;
+    options.max_buffers = 6;
+    options.thread_cache = 2;
+    buffer_pool pool(options);
+
+    std::vector<buffer_pool::lease> leases;
+    for (int i = 0; i < 7; ++i) leases.push_back(pool.acquire());
+    for (auto& l : leases) {
+        BOOST_TEST(reinterpret_cast<uintptr_t>(l.data()) % file_io::direct_alignment == 0u);
+        BOOST_TEST(l.size() == options.buffer_size);
+    }
+
+    auto stats = pool.get_stats();
+    BOOST_TEST(stats.buffers == 6u);
+    BOOST_TEST(stats.slabs == 2u);
+    BOOST_TEST(stats.unpooled == 1u);
+    BOOST_TEST(stats.peak_in_use == 7u);
+
+    // Buffers cached by a thread go back to the pool when it exits
+    std::thread([&] { leases.clear(); }).join();
+    BOOST_TEST(pool.get_stats().in_use == 0u);
+    leases.push_back(pool.acquire());
+    BOOST_TEST(pool.get_stats().shared_hits == 1u);
+
+    // The last buffer released by this thread is reused first
+    char* data = leases.back().data();
+    leases.clear();
+    leases.push_back(pool.acquire());
+    BOOST_TEST(leases.back().data() == data);
+
+    stats = pool.get_stats();
+    BOOST_TEST(stats.thread_cache_hits == 1u);
+    BOOST_TEST(stats.in_use == 1u);
+    BOOST_TEST(stats.hit_rate() == 2.0 / 9);
+
+#ifdef OUINET_HAS_IO_URING
+    temp_file temp_file{test_id};
+    auto& service = asio::use_service<ouinet::util::io_uring_service>(ctx);
+
+    // Pinning memory may not be allowed
+    file_io::register_buffers(ctx, pool, ec);
+    if (!service.is_open() || ec) return;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto f = file_io::open_or_create(ctx.get_executor(), temp_file.get_name(), ec);
+        auto& l = leases.front();
+        std::fill(l.data(), l.data() + l.size(), 'x');
+        file_io::write_at(f, l.buffer(), 0, cancel, yield);
+        std::fill(l.data(), l.data() + l.size(), 'y');
+        file_io::read_at(f, l.buffer(), 0, cancel, yield);
+        BOOST_TEST(std::count(l.data(), l.data() + l.size(), 'x') == long(l.size()));
+    });
+    ctx.run();
+
+    BOOST_TEST(service.get_stats().fixed_submissions == 2u);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(test_io_stats)
+{
+    using file_io::io_op;
+    using file_io::io_stats;
+    using file_io::histogram;
+
+    // Buckets are contiguous and keep values within 1/16 of themselves
+    for (uint64_t v : {0ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull}) {
+        auto i = histogram::bucket_index(v);
+        BOOST_TEST(histogram::bucket_lowest(i) <= v);
+        BOOST_TEST(histogram::bucket_highest(i) >= v);
+        BOOST_TEST(histogram::bucket_lowest(i + 1) == histogram::bucket_highest(i) + 1);
+        BOOST_TEST(histogram::bucket_highest(i) - histogram::bucket_lowest(i) <= v / 16);
+    }
+
+    temp_file temp_file{test_id};
+    io_stats::reset();
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto f = file_io::open_or_create(ctx.get_executor(), temp_file.get_name(), ec);
+        char buf[100] = {};
+
+        // Nothing is recorded while disabled
+        file_io::write_at(f, asio::buffer(buf), 0, cancel, yield);
+        BOOST_TEST(io_stats::take_snapshot().sources.empty());
+
+        io_stats::enable();
+        io_stats::set_tag(f.native_handle(), "index");
+        for (int i = 0; i < 10; ++i) {
+            file_io::write_at(f, asio::buffer(buf), i * sizeof(buf), cancel, yield);
+        }
+        file_io::read_at(f, asio::buffer(buf), 0, cancel, yield);
+        file_io::fsync(f, cancel, yield);
+        file_io::read_at(f, asio::buffer(buf), 10 * sizeof(buf), cancel, yield[ec]);
+        BOOST_TEST(ec == asio::error::eof);
+        io_stats::enable(false);
+        io_stats::clear_tag(f.native_handle());
+    });
+    ctx.run();
+
+    auto snapshot = io_stats::take_snapshot();
+    BOOST_REQUIRE(snapshot.sources.count("index"));
+    auto& ops = snapshot.sources["index"];
+
+    auto& writes = ops[io_op::write];
+    BOOST_TEST(writes.ops == 10u);
+    BOOST_TEST(writes.bytes == 1000u);
+    BOOST_TEST(writes.syscalls >= 10u);
+    BOOST_TEST(writes.errors == 0u);
+    BOOST_TEST(writes.latency.count() == 10u);
+    BOOST_TEST(writes.latency.percentile(0.5) > 0u);
+    BOOST_TEST(writes.latency.max() >= writes.service.max());
+
+    auto& reads = ops[io_op::read];
+    BOOST_TEST(reads.ops == 2u);
+    BOOST_TEST(reads.bytes == 100u);
+    BOOST_TEST(reads.errors == 1u);
+    BOOST_TEST(ops[io_op::fsync].ops == 1u);
+
+    auto json = snapshot.to_json();
+    BOOST_TEST(json.find("\"index\":{\"read\":{\"ops\":2,\"bytes\":100") != std::string::npos);
+    auto prometheus = snapshot.to_prometheus();
+    BOOST_TEST(prometheus.find("ouinet_file_io_ops_total{source=\"index\",op=\"write\"} 10\n")
+            != std::string::npos);
+    BOOST_TEST(prometheus.find("ouinet_file_io_latency_seconds_count{source=\"index\",op=\"read\"} 2\n")
+            != std::string::npos);
+
+    io_stats::reset();
+}
+
+BOOST_AUTO_TEST_CASE(test_copy)
+{
+    using file_io::copy_method;
+    using file_io::io_stats;
+
+    temp_file src_file{test_id + "_src"};
+    temp_file dst_file{test_id + "_dst"};
+
+    // Larger than a pool buffer, so that copying it by hand takes a few rounds.
+    std::string data(1 << 20, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = char(i * 31 + i / 4096);
+    std::ofstream(src_file.get_name(), std::ios::binary) << data;
+
+    io_stats::reset();
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto src = file_io::open_readonly(ctx.get_executor(), src_file.get_name(), ec);
+        auto dst = file_io::open_or_create(ctx.get_executor(), dst_file.get_name(), ec);
+
+        io_stats::enable();
+        io_stats::set_tag(dst.native_handle(), "copy");
+        auto r = file_io::copy(src, dst, {}, cancel, yield);
+        io_stats::enable(false);
+        io_stats::clear_tag(dst.native_handle());
+        BOOST_TEST(r.bytes == data.size());
+#ifdef __linux__
+        BOOST_TEST((r.method != copy_method::read_write));
+#endif
+
+        auto snapshot = io_stats::take_snapshot();
+        auto op = r.method == copy_method::reflink         ? file_io::io_op::copy_reflink
+                : r.method == copy_method::copy_file_range ? file_io::io_op::copy_file_range
+                                                           : file_io::io_op::copy_read_write;
+        BOOST_TEST(snapshot.sources["copy"][op].ops == 1u);
+        BOOST_TEST(snapshot.sources["copy"][op].bytes == data.size());
+
+        // A range not aligned to blocks, into the middle of the copy.
+        r = file_io::copy(src, dst, {10, 5000, 100000}, cancel, yield);
+        BOOST_TEST(r.bytes == 100000u);
+        BOOST_TEST(file_io::file_size(dst, ec) == data.size());
+
+        // Past the end of the source, what there is gets copied.
+        file_io::copy(src, dst, {data.size() - 10, 0, 20}, cancel, yield[ec]);
+        BOOST_TEST(ec == asio::error::eof);
+    });
+    ctx.run();
+    io_stats::reset();
+
+    std::string expected = data;
+    expected.replace(5000, 100000, data, 10, 100000);
+    expected.replace(0, 10, data, data.size() - 10, 10);
+    std::ifstream in(dst_file.get_name(), std::ios::binary);
+    std::string copied((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    BOOST_TEST((copied == expected));
+}
+
+BOOST_AUTO_TEST_CASE(test_send_range)
+{
+    using tcp = asio::ip::tcp;
+
+    temp_file temp_file{test_id};
+    // Much more than fits in the socket buffers, so that sends are partial.
+    std::string data(16 << 20, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = char(i * 7 + i / 65536);
+    std::ofstream(temp_file.get_name(), std::ios::binary) << data;
+
+    tcp::acceptor acceptor(ctx, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket server(ctx);
+    tcp::socket client(ctx);
+    std::string received;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        acceptor.async_accept(server, yield);
+        auto f = file_io::open_readonly(ctx.get_executor(), temp_file.get_name(), ec);
+
+        auto n = file_io::send_range(f, 0, data.size(), server, cancel, yield);
+        BOOST_TEST(n == data.size());
+        n = file_io::send_range(f, 12345, 1000, server, cancel, yield);
+        BOOST_TEST(n == 1000u);
+
+        // Past the end of the file, what there is gets sent.
+        n = file_io::send_range(f, data.size() - 10, 20, server, cancel, yield[ec]);
+        BOOST_TEST(ec == asio::error::eof);
+        server.shutdown(tcp::socket::shutdown_send);
+    });
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        client.async_connect(acceptor.local_endpoint(), yield);
+        sys::error_code read_ec;
+        asio::async_read(client, asio::dynamic_buffer(received), yield[read_ec]);
+        BOOST_TEST(read_ec == asio::error::eof);
+    });
+    ctx.run();
+
+    auto expected = data + data.substr(12345, 1000) + data.substr(data.size() - 10);
+    BOOST_TEST(received.size() == expected.size());
+    BOOST_TEST((received == expected));
+}
+
+BOOST_AUTO_TEST_CASE(test_preallocate_and_punch_hole)
+{
+    temp_file temp_file{test_id};
+    const size_t block = 1 << 20;
+    std::string data(4 * block, 'x');
+    std::ofstream(temp_file.get_name(), std::ios::binary) << data;
+
+#ifndef _WIN32
+    auto allocated = [&] {
+        struct stat st;
+        ::stat(temp_file.get_name().c_str(), &st);
+        return uint64_t(st.st_blocks) * 512;
+    };
+#endif
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto f = file_io::open_or_create(ctx.get_executor(), temp_file.get_name(), ec);
+
+        file_io::preallocate(f, 0, 8 * block, true, cancel, yield);
+        BOOST_TEST(file_io::file_size(f, ec) == data.size());
+        file_io::preallocate(f, 0, 6 * block, false, cancel, yield);
+        BOOST_TEST(file_io::file_size(f, ec) == 6 * block);
+        data.resize(6 * block, '\0');
+
+#ifndef _WIN32
+        auto before = allocated();
+#endif
+        file_io::punch_hole(f, block, 2 * block, cancel, yield);
+        BOOST_TEST(file_io::file_size(f, ec) == data.size());
+#ifndef _WIN32
+        // Where holes are supported at all.
+        BOOST_TEST(allocated() <= before);
+#endif
+        std::fill(data.begin() + block, data.begin() + 3 * block, '\0');
+
+        file_io::zero_range(f, 0, 10, cancel, yield);
+        std::fill(data.begin(), data.begin() + 10, '\0');
+        file_io::zero_range(f, data.size() - 10, 20, cancel, yield);
+        data.resize(data.size() + 10, '\0');
+        BOOST_TEST(file_io::file_size(f, ec) == data.size());
+
+        std::string read(data.size(), 'z');
+        file_io::read_at(f, asio::buffer(read), 0, cancel, yield);
+        BOOST_TEST((read == data));
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_access_hints)
+{
+    temp_file temp_file{test_id};
+    std::string data(3 << 20, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = char(i * 13 + i / 4096);
+    std::ofstream(temp_file.get_name(), std::ios::binary) << data;
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        file_io::open_options opts;
+        opts.pattern = file_io::access_pattern::random;
+        opts.no_atime = true;
+        opts.readahead = 1 << 20;
+        auto f = file_io::open_readonly(ctx.get_executor(), temp_file.get_name(), ec, opts);
+        BOOST_REQUIRE(!ec);
+
+        using P = file_io::access_pattern;
+        for (auto p : {P::normal, P::sequential, P::random, P::noreuse, P::willneed, P::dontneed}) {
+            file_io::advise(f, 0, 0, p, ec);
+            BOOST_TEST(!ec);
+        }
+
+        file_io::prefetch(f, 4096, data.size(), cancel, yield);
+        std::string read(data.size(), 'z');
+        file_io::read_at(f, asio::buffer(read), 0, cancel, yield);
+        BOOST_TEST((read == data));
+
+        file_io::advise(f, 0, 0, P::dontneed, ec);
+        BOOST_TEST(!ec);
+
+        // Cancelled before it starts.
+        Cancel cancelled;
+        cancelled();
+        file_io::prefetch(f, 0, data.size(), cancelled, yield[ec]);
+        BOOST_TEST(ec == asio::error::operation_aborted);
+    });
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_large_offsets)
+{
+    temp_file temp_file{test_id};
+    // Past 4 GiB, where 32-bit offsets wrap.  The file is sparse,
+    // so hardly anything gets written.
+    const uint64_t far = (uint64_t(1) << 32) + 12345;
+    const std::string data = "past four gigabytes";
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto f = file_io::open_or_create(ctx.get_executor(), temp_file.get_name(), ec);
+        BOOST_REQUIRE(!ec);
+
+        file_io::truncate(f, far + 4096, cancel, yield);
+        BOOST_TEST(file_io::file_size(f, ec) == far + 4096);
+        BOOST_TEST(file_io::end_position(f, ec) == far + 4096);
+
+        file_io::write_at(f, asio::buffer(data), far, cancel, yield);
+        file_io::fseek(f, far, ec);
+        BOOST_TEST(!ec);
+        BOOST_TEST(file_io::current_position(f, ec) == far);
+        BOOST_TEST(file_io::file_remaining_size(f, ec) == 4096u);
+
+        std::string read(data.size(), '\0');
+        file_io::read_at(f, asio::buffer(read), far, cancel, yield);
+        BOOST_TEST(read == data);
+
+        // The same bytes at the wrapped offset are still a hole.
+        file_io::read_at(f, asio::buffer(read), far - (uint64_t(1) << 32), cancel, yield);
+        BOOST_TEST(read == std::string(data.size(), '\0'));
+
+        file_io::truncate(f, far + data.size(), ec);
+        BOOST_TEST(!ec);
+        BOOST_TEST(file_io::file_size(f, ec) == far + data.size());
+    });
+    ctx.run();
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto a = file_io::open_for_append(ctx.get_executor(), temp_file.get_name(), ec);
+        BOOST_REQUIRE(!ec);
+        BOOST_TEST(a.tail() == far + data.size());
+        file_io::write(a, asio::buffer(data), cancel, yield);
+        BOOST_TEST(a.tail() == far + 2 * data.size());
+        BOOST_TEST(file_io::file_size(a.file(), ec) == far + 2 * data.size());
+    });
+    ctx.restart();
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_async_open_close)
+{
+    temp_file temp_file{test_id};
+    const std::string data = "opened off the loop";
+
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto f = file_io::async_open_or_create(ctx.get_executor(), temp_file.get_name(), cancel, yield);
+        file_io::write_at(f, asio::buffer(data), 0, cancel, yield);
+        file_io::async_close(f, cancel, yield);
+        BOOST_TEST(!f.is_open());
+
+        auto g = file_io::async_open_readonly(ctx.get_executor(), temp_file.get_name(), cancel, yield);
+        std::string read(data.size(), '\0');
+        file_io::read_at(g, asio::buffer(read), 0, cancel, yield);
+        BOOST_TEST(read == data);
+        file_io::async_close(g, cancel, yield);
+
+        file_io::async_open_readonly(ctx.get_executor(), temp_file.get_name() + ".missing", cancel, yield[ec]);
+        BOOST_TEST(ec == boost::system::errc::no_such_file_or_directory);
+    });
+    ctx.run();
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(test_async_open_latency)
+{
+    using namespace std::chrono;
+
+    temp_file temp_file{test_id};
+    // Opening a FIFO for reading blocks until a writer opens it too,
+    // which stands for an open stuck resolving the path.
+    BOOST_REQUIRE(::mkfifo(temp_file.get_name().c_str(), 0600) == 0);
+    const auto slow_open = milliseconds(300);
+    auto open_writer = [&] {
+        std::this_thread::sleep_for(slow_open);
+        ::close(::open(temp_file.get_name().c_str(), O_WRONLY));
+    };
+
+    bool opened = false;
+    auto longest_tick = steady_clock::duration::zero();
+    size_t ticks = 0;
+
+    std::thread writer(open_writer);
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        auto start = steady_clock::now();
+        auto f = file_io::async_open_readonly(ctx.get_executor(), temp_file.get_name(), cancel, yield);
+        BOOST_TEST(f.is_open());
+        BOOST_TEST((steady_clock::now() - start >= slow_open));
+        opened = true;
+        file_io::async_close(f, cancel, yield);
+    });
+    // Other coroutines keep running meanwhile.
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        asio::steady_timer timer(ctx);
+        while (!opened) {
+            auto start = steady_clock::now();
+            timer.expires_after(milliseconds(1));
+            timer.async_wait(yield);
+            longest_tick = std::max(longest_tick, steady_clock::now() - start);
+            ++ticks;
+        }
+    });
+    ctx.run();
+    writer.join();
+
+    BOOST_TEST(ticks > 10u);
+    BOOST_TEST((longest_tick < slow_open / 2));
+
+    // Cancelled while blocked, it completes once the open returns.
+    writer = std::thread(open_writer);
+    ctx.restart();
+    asio::spawn(ctx, [&](asio::yield_context yield) {
+        Cancel c;
+        asio::steady_timer timer(ctx);
+        timer.expires_after(milliseconds(20));
+        timer.async_wait([&] (const sys::error_code&) { c(); });
+        auto f = file_io::async_open_readonly(ctx.get_executor(), temp_file.get_name(), c, yield[ec]);
+        BOOST_TEST(ec == asio::error::operation_aborted);
+        BOOST_TEST(!f.is_open());
+    });
+    ctx.run();
+    writer.join();
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END();